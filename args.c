@@ -9,23 +9,41 @@
 #include <libssh/libssh.h>
 
 #include "state.h"
+#include "log.h"
+#include "output.h"
+#include "server.h"
 
 #define KEYS_FOLDER "./keys/"
 
-static char *short_options = "l:p:o:vH:P:r:d:e:k:K:h";
+static char *short_options = "l:L:p:w:o:S:A:T:B:z:I:vH:P:b:R:t:n:r:d:e:k:K:M:U:D:h";
 
 static struct option long_options[] = {
     {"loglevel",    required_argument, 0, 'l'},
+    {"logging",     required_argument, 0, 'L'},
     {"inport",      required_argument, 0, 'p'},
+    {"workers",     required_argument, 0, 'w'},
     {"pcap",        required_argument, 0, 'o'},
+    {"pcapsize",    required_argument, 0, 'S'},
+    {"pcapage",     required_argument, 0, 'A'},
+    {"transcript",  required_argument, 0, 'T'},
+    {"writer",      required_argument, 0, 'B'},
+    {"compress",    required_argument, 0, 'z'},
+    {"index",       required_argument, 0, 'I'},
     {"verbose",     no_argument,       0, 'v'},
     {"host",        required_argument, 0, 'H'},
     {"outport",     required_argument, 0, 'P'},
+    {"balance",     required_argument, 0, 'b'},
+    {"routes",      required_argument, 0, 'R'},
+    {"timeout",     required_argument, 0, 't'},
+    {"pool",        required_argument, 0, 'n'},
     {"rsa",         required_argument, 0, 'r'},
     {"dsa",         required_argument, 0, 'd'},
     {"ecdsa",       required_argument, 0, 'e'},
     {"pubkey",      required_argument, 0, 'k'},
     {"privkey",     required_argument, 0, 'K'},
+    {"metrics",     required_argument, 0, 'M'},
+    {"handoff",     required_argument, 0, 'U'},
+    {"drain",       required_argument, 0, 'D'},
     {"help",        required_argument, 0, 'h'},
     {0, 0, 0, 0}
 };
@@ -43,16 +61,39 @@ void usage(char **argv)
     fprintf(stdout, "Where args are:\n");
     fprintf(stdout, " -l | --loglevel <num>     Set libssh log level (%d-%d)\n", SSH_LOG_WARNING, SSH_LOG_FUNCTIONS);
     fprintf(stdout, " -v | --verbose            Increase libssh log level\n");
+    fprintf(stdout, " -L | --logging <num>      Set sshdump log level (%d-%d). Default %d\n", LOG_LEVEL_ERROR, LOG_LEVEL_DEBUG, LOG_LEVEL_DEBUG);
     fprintf(stdout, " -p | --inport <num>       Set TCP/IP port to listen on, 1-65535. Default 9000\n");
-    fprintf(stdout, " -o | --pcap <file>        Set packet capture file name. Defaults to none\n");
-    fprintf(stdout, " -H | --host <name>        Set host to connect to. Defaults to 'localhost'\n");
-    fprintf(stdout, " -P | --outport <num>      Set TCP/IP port to connect to, 1-65535. Default 22\n");
+    fprintf(stdout, " -w | --workers <num>      Set number of event loop threads. Each is pinned to a CPU. Default 1\n");
+    fprintf(stdout, " -o | --pcap <template>    Set packet capture file name. %%i pid.connection, %%l leg (in/out), %%n rotation,\n");
+    fprintf(stdout, "                           %%t time opened. Without any %%, .%%i.%%l.%%n is appended. Defaults to none\n");
+    fprintf(stdout, " -S | --pcapsize <MB>      Start a new capture file after this many megabytes. Default 0, no limit\n");
+    fprintf(stdout, " -A | --pcapage <secs>     Start a new capture file after this many seconds. Default 0, no limit\n");
+    fprintf(stdout, " -T | --transcript <file>  Set decrypted transcript file name, suffixed with .<pid>.<connection>. Defaults to none\n");
+    fprintf(stdout, " -B | --writer <name>      Set how capture files are written: auto, io_uring or write. Default auto\n");
+    fprintf(stdout, " -z | --compress <level>   Compress capture files with zstd at this level (1-19). Default 0, off\n");
+    fprintf(stdout, " -I | --index <dir>        Index logins, commands, subsystems and env by user, client and upstream\n");
+    fprintf(stdout, "                           in this directory, searched with index_query. Defaults to none\n");
+    fprintf(stdout, " -H | --host <list>        Set host to connect to, or a comma separated list of host[:port] to spread\n");
+    fprintf(stdout, "                           sessions over. IPv6 addresses go in []. Defaults to 'localhost'\n");
+    fprintf(stdout, " -P | --outport <num>      Set TCP/IP port to connect to where the host doesn't give one, 1-65535. Default 22\n");
+    fprintf(stdout, " -b | --balance <policy>   Set how sessions are spread over hosts: round-robin, least-sessions or latency.\n");
+    fprintf(stdout, "                           Default round-robin\n");
+    fprintf(stdout, " -R | --routes <file>      Pick the upstream by login from this file of '<login> <host[:port]>' lines,\n");
+    fprintf(stdout, "                           '@name' routes user@name as user. Unrouted logins go to --host. Reloaded on SIGHUP\n");
+    fprintf(stdout, " -t | --timeout <secs>     Set time allowed to connect and exchange keys. Default 30\n");
+    fprintf(stdout, " -n | --pool <num>         Set number of pre-connected upstream sessions per worker. Default 0\n");
     fprintf(stdout, " -r | --rsa <file>         Set the RSA private key file to use for the inbound connection\n");
     fprintf(stdout, " -d | --dsa <file>         Set the DSA private key file to use for the inbound connection\n");
     fprintf(stdout, " -e | --ecdsa <file>       Set the ECDSA private key file to use for the inbound connection\n");
-    fprintf(stdout, " -k | --pubkey <file>      Set the public key file to use for the outbound connection\n");
-    fprintf(stdout, " -K | --privkey <file>     Set the private key file to use for the outbound connection\n");
+    fprintf(stdout, " -k | --pubkey <file>      Set the public key file to use for the outbound connection. Reloaded on SIGHUP\n");
+    fprintf(stdout, " -K | --privkey <file>     Set the private key file to use for the outbound connection. Reloaded on SIGHUP\n");
+    fprintf(stdout, " -M | --metrics <port|path> Serve Prometheus metrics on this loopback port or Unix socket path\n");
+    fprintf(stdout, " -U | --handoff <path>     Take over the listen sockets of the sshdump serving this Unix socket, if any,\n");
+    fprintf(stdout, "                           then serve it for our own replacement\n");
+    fprintf(stdout, " -D | --drain <secs>       Time sessions get to end once we stop accepting. Default 600\n");
     fprintf(stdout, " -h | --help               Display this help\n");
+    fprintf(stdout, "Send SIGUSR1 to log proxy latency per direction, per worker and across all of them. Each session's is logged when it ends\n");
+    fprintf(stdout, "Send SIGUSR2 to stop accepting and exit once sessions have drained\n");
 }
 
 int check_file(char *file)
@@ -109,9 +150,10 @@ int check_int_arg(char *arg, int *result, int low, int high)
     return rc;
 }
 
-int parse_args(int argc, char **argv, stateptr state)
+int parse_args(int argc, char **argv, configptr config)
 {
     int args_ok = 1;
+    int port;
 
     while (args_ok) {
         int opt = getopt_long(argc, argv, short_options, long_options, NULL);
@@ -121,49 +163,138 @@ int parse_args(int argc, char **argv, stateptr state)
         switch (opt){
         case 'l':
             // Log level
-            if (check_int_arg(optarg, &(state->log_level), SSH_LOG_WARNING, SSH_LOG_FUNCTIONS) != 0) {
+            if (check_int_arg(optarg, &(config->log_level), SSH_LOG_WARNING, SSH_LOG_FUNCTIONS) != 0) {
                 fprintf(stderr, "Log level should be between %d and %d\n", SSH_LOG_WARNING, SSH_LOG_FUNCTIONS);
                 args_ok = 0;
             }
             break;
 
+        case 'L':
+            // sshdump log level
+            if (check_int_arg(optarg, &log_level, LOG_LEVEL_ERROR, LOG_LEVEL_DEBUG) != 0) {
+                fprintf(stderr, "Logging level should be between %d and %d\n", LOG_LEVEL_ERROR, LOG_LEVEL_DEBUG);
+                args_ok = 0;
+            }
+            break;
+
         case 'v':
             // Increase log level
-            if (state->log_level < SSH_LOG_FUNCTIONS) {
-                ++state->log_level;
+            if (config->log_level < SSH_LOG_FUNCTIONS) {
+                ++config->log_level;
             }
             break;
 
         case 'p':
             // Listen port
-            if (check_int_arg(optarg, &(state->in_port), 1, 65535) != 0) {
+            if (check_int_arg(optarg, &(config->in_port), 1, 65535) != 0) {
                 fprintf(stderr, "Listen port should be an integer between 1 and 65535\n");
                 args_ok = 0;
             }
             break;
 
+        case 'w':
+            // Worker threads
+            if (check_int_arg(optarg, &(config->workers), 1, SERVER_MAX_WORKERS) != 0) {
+                fprintf(stderr, "Workers should be an integer between 1 and %d\n", SERVER_MAX_WORKERS);
+                args_ok = 0;
+            }
+            break;
+
         case 'o':
-            // pcap file name
-            state->pcap_file = optarg;
+            // pcap file name template
+            config->pcap_file = optarg;
+            break;
+
+        case 'S':
+            // pcap rotation size
+            if (check_int_arg(optarg, &(config->pcap_max_size), 0, 1048576) != 0) {
+                fprintf(stderr, "Capture file size should be an integer between 0 and 1048576 megabytes\n");
+                args_ok = 0;
+            }
+            break;
+
+        case 'A':
+            // pcap rotation age
+            if (check_int_arg(optarg, &(config->pcap_max_age), 0, 604800) != 0) {
+                fprintf(stderr, "Capture file age should be an integer between 0 and 604800 seconds\n");
+                args_ok = 0;
+            }
+            break;
+
+        case 'T':
+            // Transcript file name
+            config->transcript_file = optarg;
+            break;
+
+        case 'B':
+            // Capture output backend
+            if (strcmp(optarg, "auto") == 0) {
+                config->output_backend = OUTPUT_AUTO;
+            } else if (strcmp(optarg, "io_uring") == 0) {
+                config->output_backend = OUTPUT_URING;
+            } else if (strcmp(optarg, "write") == 0) {
+                config->output_backend = OUTPUT_WRITE;
+            } else {
+                fprintf(stderr, "Writer should be one of auto, io_uring or write\n");
+                args_ok = 0;
+            }
+            break;
+
+        case 'z':
+            // Capture compression level
+            if (check_int_arg(optarg, &(config->compress_level), 0, 19) != 0) {
+                fprintf(stderr, "Compression level should be an integer between 0 and 19\n");
+                args_ok = 0;
+            }
             break;
 
         case 'H':
             // Host to connect to
-            state->out_host = optarg;
+            config->out_host = optarg;
             break;
 
         case 'P':
             // Port to connect to
-            if (check_int_arg(optarg, &(state->out_port), 1, 65535) != 0) {
+            if (check_int_arg(optarg, &(config->out_port), 1, 65535) != 0) {
                 fprintf(stderr, "Outbound port should be an integer between 1 and 65535\n");
                 args_ok = 0;
             }
             break;
 
+        case 'b':
+            // Upstream selection
+            config->balance = upstream_policy(optarg);
+            if (config->balance < 0) {
+                fprintf(stderr, "Balance should be round-robin, least-sessions or latency\n");
+                args_ok = 0;
+            }
+            break;
+
+        case 'R':
+            // Upstream by login
+            config->routes_file = optarg;
+            break;
+
+        case 't':
+            // Connect timeout
+            if (check_int_arg(optarg, &(config->connect_timeout), 1, 3600) != 0) {
+                fprintf(stderr, "Timeout should be an integer between 1 and 3600\n");
+                args_ok = 0;
+            }
+            break;
+
+        case 'n':
+            // Upstream pool size
+            if (check_int_arg(optarg, &(config->pool_size), 0, 1000) != 0) {
+                fprintf(stderr, "Pool size should be an integer between 0 and 1000\n");
+                args_ok = 0;
+            }
+            break;
+
         case 'r':
             // RSA private key file
             if (check_file(optarg) == 0) {
-                state->rsa_key_file = optarg;
+                config->rsa_key_file = optarg;
             } else {
                 fprintf(stderr, "File '%s' is not valid\n", optarg);
                 args_ok = 0;
@@ -173,7 +304,7 @@ int parse_args(int argc, char **argv, stateptr state)
         case 'd':
             // DSA private key file
             if (check_file(optarg) == 0) {
-                state->dsa_key_file = optarg;
+                config->dsa_key_file = optarg;
             } else {
                 fprintf(stderr, "File '%s' is not valid\n", optarg);
                 args_ok = 0;
@@ -183,7 +314,7 @@ int parse_args(int argc, char **argv, stateptr state)
         case 'e':
             // ECDSA private key file
             if (check_file(optarg) == 0) {
-                state->ecdsa_key_file = optarg;
+                config->ecdsa_key_file = optarg;
             } else {
                 fprintf(stderr, "File '%s' is not valid\n", optarg);
                 args_ok = 0;
@@ -193,7 +324,7 @@ int parse_args(int argc, char **argv, stateptr state)
         case 'k':
             // Public key file
             if (check_file(optarg) == 0) {
-                state->pub_key_file = optarg;
+                config->pub_key_file = optarg;
             } else {
                 fprintf(stderr, "File '%s' is not valid\n", optarg);
                 args_ok = 0;
@@ -203,13 +334,46 @@ int parse_args(int argc, char **argv, stateptr state)
         case 'K':
             // Private key file
             if (check_file(optarg) == 0) {
-                state->priv_key_file = optarg;
+                config->priv_key_file = optarg;
             } else {
                 fprintf(stderr, "File '%s' is not valid\n", optarg);
                 args_ok = 0;
             }
             break;
 
+        case 'M':
+            // Metrics endpoint, a path for a Unix socket, otherwise a port
+            if (optarg[0] == '/' || check_int_arg(optarg, &port, 1, 65535) == 0) {
+                config->metrics_address = optarg;
+            } else {
+                fprintf(stderr, "Metrics should be a port between 1 and 65535 or an absolute socket path\n");
+                args_ok = 0;
+            }
+            break;
+
+        case 'U':
+            // Listen socket handoff
+            if (optarg[0] == '/') {
+                config->handoff_path = optarg;
+            } else {
+                fprintf(stderr, "Handoff socket should be an absolute path\n");
+                args_ok = 0;
+            }
+            break;
+
+        case 'I':
+            // Login and command index
+            config->index_dir = optarg;
+            break;
+
+        case 'D':
+            // Drain deadline
+            if (check_int_arg(optarg, &(config->drain_timeout), 1, 86400) != 0) {
+                fprintf(stderr, "Drain time should be an integer between 1 and 86400\n");
+                args_ok = 0;
+            }
+            break;
+
         case 'h':
         default:
             // Unrecognised
@@ -223,27 +387,27 @@ int parse_args(int argc, char **argv, stateptr state)
     while (args_ok) {
         args_ok = 0;
 
-        if (!state->dsa_key_file && !state->rsa_key_file && !state->ecdsa_key_file) {
+        if (!config->dsa_key_file && !config->rsa_key_file && !config->ecdsa_key_file) {
             // No key files given - default
-            state->rsa_key_file = check_file_or_null(KEYS_FOLDER "ssh_host_rsa_key");
-            state->dsa_key_file = check_file_or_null(KEYS_FOLDER "ssh_host_dsa_key");
-            state->ecdsa_key_file = check_file_or_null(KEYS_FOLDER "ssh_host_ecdsa_key");
+            config->rsa_key_file = check_file_or_null(KEYS_FOLDER "ssh_host_rsa_key");
+            config->dsa_key_file = check_file_or_null(KEYS_FOLDER "ssh_host_dsa_key");
+            config->ecdsa_key_file = check_file_or_null(KEYS_FOLDER "ssh_host_ecdsa_key");
         }
 
-        if ((!state->pub_key_file  && state->priv_key_file) || (state->pub_key_file && !state->priv_key_file)) {
+        if ((!config->pub_key_file  && config->priv_key_file) || (config->pub_key_file && !config->priv_key_file)) {
             fprintf(stderr, "Public and private key files for outbound connection must be specified\n");
             break;
         }
 
-        if (!state->pub_key_file && !state->priv_key_file) {
+        if (!config->pub_key_file && !config->priv_key_file) {
             // No key files specified for outbound connection - default
-            state->pub_key_file = check_file_or_null(KEYS_FOLDER "ssh_rsa_key.pub");
-            state->priv_key_file = check_file_or_null(KEYS_FOLDER "ssh_rsa_key");
+            config->pub_key_file = check_file_or_null(KEYS_FOLDER "ssh_rsa_key.pub");
+            config->priv_key_file = check_file_or_null(KEYS_FOLDER "ssh_rsa_key");
         }
 
-        if (!state->pub_key_file || !state->priv_key_file) {
-            state->pub_key_file = NULL;
-            state->priv_key_file = NULL;
+        if (!config->pub_key_file || !config->priv_key_file) {
+            config->pub_key_file = NULL;
+            config->priv_key_file = NULL;
         }
 
         args_ok = 1;
@@ -1,3 +1,3 @@
 #include "state.h"
 
-int parse_args(int argc, char **argv, stateptr state);
+int parse_args(int argc, char **argv, configptr config);
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Runs bench_client against bench_sshd directly, then through sshdump, all on
+# loopback. Each run appends a line of JSON to $RESULTS. Extra sshdump
+# arguments, e.g. capture options, go in $SSHDUMP_ARGS, client ones in
+# $BENCH_ARGS.
+#
+# ./bench.sh load runs bench_load through sshdump instead, appending to
+# $LOAD_RESULTS, with its arguments in $LOAD_ARGS. To proxy public key logins
+# give sshdump an outbound key pair, e.g.
+#   SSHDUMP_ARGS="-k keys/ssh_host_rsa_key.pub -K keys/ssh_host_rsa_key"
+#   LOAD_ARGS="-K keys/ssh_host_rsa_key"
+
+UPSTREAM_PORT=${UPSTREAM_PORT:-9022}
+PROXY_PORT=${PROXY_PORT:-9000}
+RESULTS=${RESULTS:-bench-results.json}
+LOAD_RESULTS=${LOAD_RESULTS:-load-results.json}
+
+# Thousands of sessions need as many descriptors in every process
+ulimit -n "$(ulimit -Hn)" 2>/dev/null
+
+./bench_sshd -p "$UPSTREAM_PORT" &
+UPSTREAM=$!
+./sshdump -L 1 -p "$PROXY_PORT" -H 127.0.0.1 -P "$UPSTREAM_PORT" $SSHDUMP_ARGS &
+PROXY=$!
+trap 'kill $UPSTREAM $PROXY 2>/dev/null; wait' EXIT INT TERM
+
+# Both listen almost at once, don't race them
+sleep 1
+
+case "$1" in
+load)
+    ./bench_load -P "$PROXY_PORT" -p "$PROXY" -o "$LOAD_RESULTS" $LOAD_ARGS || exit 1
+    echo "Results appended to $LOAD_RESULTS"
+    ;;
+*)
+    ./bench_client -n direct -P "$UPSTREAM_PORT" -o "$RESULTS" $BENCH_ARGS || exit 1
+    ./bench_client -n sshdump -P "$PROXY_PORT" -o "$RESULTS" $BENCH_ARGS || exit 1
+    echo "Results appended to $RESULTS"
+    ;;
+esac
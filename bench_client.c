@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <libssh/libssh.h>
+
+#include "histogram.h"
+
+/*
+ * Drives an sshd, or sshdump in front of one, and appends a line of JSON
+ * with the results to a file so builds can be compared:
+ *
+ *   download   head -c <bytes> /dev/zero, MB/s
+ *   upload     cat > /dev/null, MB/s
+ *   echo       one byte at a time through a pty shell that echoes, round trip
+ *   sessions   connect, authenticate, exec true, close, per second
+ *
+ * bench_sshd serves exactly these, so bench.sh needs nothing but loopback.
+ */
+
+#define BENCH_CHUNK (32 * 1024)
+
+struct bench_config {
+    const char *host;
+    int port;
+    const char *user;
+    const char *password;
+};
+
+static ssh_session bench_connect(struct bench_config *config)
+{
+    ssh_session session;
+
+    session = ssh_new();
+    if (session == NULL) return NULL;
+
+    ssh_options_set(session, SSH_OPTIONS_HOST, config->host);
+    ssh_options_set(session, SSH_OPTIONS_PORT, &config->port);
+    ssh_options_set(session, SSH_OPTIONS_USER, config->user);
+
+    // Loopback to a throwaway key, nothing to verify
+    if (ssh_connect(session) != SSH_OK) {
+        fprintf(stderr, "Error connecting to %s:%d: %s\n", config->host, config->port, ssh_get_error(session));
+        ssh_free(session);
+        return NULL;
+    }
+
+    if (ssh_userauth_password(session, NULL, config->password) != SSH_AUTH_SUCCESS) {
+        fprintf(stderr, "Error authenticating: %s\n", ssh_get_error(session));
+        ssh_disconnect(session);
+        ssh_free(session);
+        return NULL;
+    }
+
+    return session;
+}
+
+static ssh_channel bench_exec(ssh_session session, const char *command)
+{
+    ssh_channel channel;
+
+    channel = ssh_channel_new(session);
+    if (channel == NULL) return NULL;
+
+    do {
+        if (ssh_channel_open_session(channel) != SSH_OK) break;
+
+        if (command) {
+            if (ssh_channel_request_exec(channel, command) != SSH_OK) break;
+        } else {
+            if (ssh_channel_request_pty(channel) != SSH_OK) break;
+            if (ssh_channel_request_shell(channel) != SSH_OK) break;
+        }
+
+        return channel;
+    } while (0);
+
+    fprintf(stderr, "Error starting %s: %s\n", command ? command : "shell", ssh_get_error(session));
+    ssh_channel_free(channel);
+
+    return NULL;
+}
+
+static void bench_close(ssh_session session, ssh_channel channel)
+{
+    if (channel) {
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+    }
+
+    ssh_disconnect(session);
+    ssh_free(session);
+}
+
+static double download(struct bench_config *config, uint64_t bytes)
+{
+    ssh_session session;
+    ssh_channel channel;
+    char command[64];
+    char *buffer;
+    uint64_t start, received = 0;
+    int n;
+
+    session = bench_connect(config);
+    if (session == NULL) return -1;
+
+    buffer = malloc(BENCH_CHUNK);
+    snprintf(command, sizeof(command), "head -c %llu /dev/zero", (unsigned long long) bytes);
+
+    start = histogram_now();
+    channel = bench_exec(session, command);
+
+    while (channel && buffer && (n = ssh_channel_read(channel, buffer, BENCH_CHUNK, 0)) > 0) {
+        received += n;
+    }
+
+    start = histogram_now() - start;
+
+    free(buffer);
+    bench_close(session, channel);
+
+    if (received != bytes) {
+        fprintf(stderr, "Download received %llu of %llu bytes\n", (unsigned long long) received,
+            (unsigned long long) bytes);
+        return -1;
+    }
+
+    return bytes / 1048576.0 / (start / 1e9);
+}
+
+static double upload(struct bench_config *config, uint64_t bytes)
+{
+    ssh_session session;
+    ssh_channel channel;
+    char *buffer;
+    uint64_t start, sent = 0;
+    int len;
+
+    session = bench_connect(config);
+    if (session == NULL) return -1;
+
+    buffer = calloc(1, BENCH_CHUNK);
+
+    start = histogram_now();
+    channel = bench_exec(session, "cat > /dev/null");
+
+    while (channel && buffer && sent < bytes) {
+        len = bytes - sent > BENCH_CHUNK ? BENCH_CHUNK : bytes - sent;
+        if (ssh_channel_write(channel, buffer, len) != len) break;
+        sent += len;
+    }
+
+    // Only done once the far end has read it all
+    if (channel) {
+        ssh_channel_send_eof(channel);
+        while (ssh_channel_read(channel, buffer, BENCH_CHUNK, 0) > 0);
+    }
+
+    start = histogram_now() - start;
+
+    free(buffer);
+    bench_close(session, channel);
+
+    if (sent != bytes) {
+        fprintf(stderr, "Upload sent %llu of %llu bytes\n", (unsigned long long) sent, (unsigned long long) bytes);
+        return -1;
+    }
+
+    return bytes / 1048576.0 / (start / 1e9);
+}
+
+static int echo(struct bench_config *config, int count, struct histogram *rtt)
+{
+    ssh_session session;
+    ssh_channel channel;
+    uint64_t start;
+    char c;
+    int i;
+
+    session = bench_connect(config);
+    if (session == NULL) return -1;
+
+    channel = bench_exec(session, NULL);
+
+    for (i = 0; channel && i < count; i++) {
+        c = 'a' + i % 26;
+
+        start = histogram_now();
+        if (ssh_channel_write(channel, &c, 1) != 1) break;
+        if (ssh_channel_read(channel, &c, 1, 0) != 1) break;
+        histogram_record(rtt, histogram_now() - start);
+    }
+
+    bench_close(session, channel);
+
+    if (i != count) {
+        fprintf(stderr, "Echo stopped after %d of %d round trips\n", i, count);
+        return -1;
+    }
+
+    return 0;
+}
+
+static double sessions(struct bench_config *config, int seconds, uint64_t *failures)
+{
+    ssh_session session;
+    ssh_channel channel;
+    uint64_t start, end, count = 0;
+    char buffer[256];
+
+    start = histogram_now();
+    end = start + (uint64_t) seconds * 1000000000;
+
+    while (histogram_now() < end) {
+        session = bench_connect(config);
+        if (session == NULL) {
+            ++*failures;
+            continue;
+        }
+
+        channel = bench_exec(session, "true");
+        if (channel) {
+            while (ssh_channel_read(channel, buffer, sizeof(buffer), 0) > 0);
+            ++count;
+        } else {
+            ++*failures;
+        }
+
+        bench_close(session, channel);
+    }
+
+    return count / ((histogram_now() - start) / 1e9);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stdout, "Usage:\n");
+    fprintf(stdout, "%s <args>\n", prog);
+    fprintf(stdout, "Where args are:\n");
+    fprintf(stdout, " -H | --host <name>        Host to connect to. Default 127.0.0.1\n");
+    fprintf(stdout, " -P | --port <num>         Port to connect to. Default 9000\n");
+    fprintf(stdout, " -u | --user <name>        User to log in as. Default bench\n");
+    fprintf(stdout, " -w | --password <text>    Password to log in with. Default bench\n");
+    fprintf(stdout, " -m | --megabytes <num>    Megabytes to download and upload. Default 1024\n");
+    fprintf(stdout, " -e | --echoes <num>       Round trips through the pty. Default 10000\n");
+    fprintf(stdout, " -s | --seconds <num>      How long to open sessions for. Default 5\n");
+    fprintf(stdout, " -n | --name <text>        Name for this run in the results. Default sshdump\n");
+    fprintf(stdout, " -o | --output <file>      File to append the results to. Default bench-results.json\n");
+}
+
+int main(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        {"host",        required_argument, 0, 'H'},
+        {"port",        required_argument, 0, 'P'},
+        {"user",        required_argument, 0, 'u'},
+        {"password",    required_argument, 0, 'w'},
+        {"megabytes",   required_argument, 0, 'm'},
+        {"echoes",      required_argument, 0, 'e'},
+        {"seconds",     required_argument, 0, 's'},
+        {"name",        required_argument, 0, 'n'},
+        {"output",      required_argument, 0, 'o'},
+        {"help",        no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    struct bench_config config = { "127.0.0.1", 9000, "bench", "bench" };
+    const char *name = "sshdump";
+    const char *output = "bench-results.json";
+    struct histogram *rtt;
+    uint64_t bytes, failures = 0;
+    double down, up, rate;
+    int megabytes = 1024, echoes = 10000, seconds = 5;
+    int c, rc = 0;
+    FILE *f;
+
+    while ((c = getopt_long(argc, argv, "H:P:u:w:m:e:s:n:o:h", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'H': config.host = optarg; break;
+        case 'P': config.port = atoi(optarg); break;
+        case 'u': config.user = optarg; break;
+        case 'w': config.password = optarg; break;
+        case 'm': megabytes = atoi(optarg); break;
+        case 'e': echoes = atoi(optarg); break;
+        case 's': seconds = atoi(optarg); break;
+        case 'n': name = optarg; break;
+        case 'o': output = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.port < 1 || config.port > 65535 || megabytes < 1 || echoes < 1 || seconds < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    rtt = calloc(1, sizeof(struct histogram));
+    if (rtt == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    ssh_init();
+
+    bytes = (uint64_t) megabytes * 1024 * 1024;
+
+    down = download(&config, bytes);
+    up = upload(&config, bytes);
+    if (echo(&config, echoes, rtt) != 0) rc = 1;
+    rate = sessions(&config, seconds, &failures);
+
+    if (down < 0 || up < 0) rc = 1;
+
+    printf("%-8s  download %.1f MB/s  upload %.1f MB/s  echo us p50 %.1f p99 %.1f max %.1f  sessions %.1f/s"
+        "  failed %llu\n", name, down, up, histogram_percentile(rtt, 50) / 1e3, histogram_percentile(rtt, 99) / 1e3,
+        rtt->max / 1e3, rate, (unsigned long long) failures);
+
+    // One object per line, a failed measurement is -1
+    f = fopen(output, "a");
+    if (f == NULL) {
+        perror(output);
+        rc = 1;
+    } else {
+        fprintf(f, "{\"name\": \"%s\", \"megabytes\": %d, \"download_mb_s\": %.1f, \"upload_mb_s\": %.1f, "
+            "\"echoes\": %llu, \"echo_p50_us\": %.1f, \"echo_p99_us\": %.1f, \"echo_max_us\": %.1f, "
+            "\"sessions_per_s\": %.1f, \"session_failures\": %llu}\n",
+            name, megabytes, down, up, (unsigned long long) rtt->count, histogram_percentile(rtt, 50) / 1e3,
+            histogram_percentile(rtt, 99) / 1e3, rtt->max / 1e3, rate, (unsigned long long) failures);
+        fclose(f);
+    }
+
+    free(rtt);
+    ssh_finalize();
+
+    return rc;
+}
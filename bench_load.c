@@ -0,0 +1,535 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include <libssh/libssh.h>
+
+#include "histogram.h"
+
+/*
+ * Opens sessions at a fixed arrival rate, up to a limit on how many are
+ * open at once, and keeps them busy in a mix of ways:
+ *
+ *   interactive  pty shell, one keystroke echoed every think interval
+ *   exec         a burst of exec channels, each downloading a little
+ *   idle         pty shell that does nothing
+ *
+ * Every second it appends a line of JSON with connect and auth latency,
+ * echo round trips, failures at each stage and, given sshdump's pid, its
+ * resident memory and CPU per open session. A summary line follows at the
+ * end. Each session is a thread with a blocking libssh session, so thousands
+ * at once need raised fd limits on both ends.
+ */
+
+#define KIND_INTERACTIVE 0
+#define KIND_EXEC        1
+#define KIND_IDLE        2
+#define KINDS            3
+
+#define STAGE_CONNECT 0
+#define STAGE_AUTH    1
+#define STAGE_CHANNEL 2
+#define STAGES        3
+
+#define EXEC_BURST   8                  // Channels per exec session
+#define EXEC_COMMAND "head -c 65536 /dev/zero"
+#define THREAD_STACK (256 * 1024)
+
+struct load_config {
+    const char *host;
+    int port;
+    const char *user;
+    const char *password;
+    ssh_key key;                        // Log in with this instead of the password
+    int mix[KINDS];                     // Weights
+    int hold;                           // Seconds interactive and idle sessions stay open
+    int think;                          // Milliseconds between keystrokes
+};
+
+struct load_stats {
+    struct histogram connect;
+    struct histogram auth;
+    struct histogram echo;
+    uint64_t started;
+    uint64_t completed;
+    uint64_t failures[STAGES];
+};
+
+static struct load_config config = { "127.0.0.1", 9000, "bench", "bench", NULL, { 60, 30, 10 }, 30, 200 };
+
+// Sessions add to interval, the reporter folds it into total every second
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct load_stats interval;
+static struct load_stats total;
+static int active = 0;
+
+static const char *stage_names[STAGES] = { "connect", "auth", "channel" };
+
+static void sleep_until(uint64_t ns)
+{
+    struct timespec until;
+
+    until.tv_sec = ns / 1000000000;
+    until.tv_nsec = ns % 1000000000;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) != 0);
+}
+
+static void record(struct histogram *histogram, uint64_t value)
+{
+    pthread_mutex_lock(&stats_lock);
+    histogram_record(histogram, value);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void fail(int stage)
+{
+    pthread_mutex_lock(&stats_lock);
+    ++interval.failures[stage];
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static ssh_channel open_channel(ssh_session session, const char *command)
+{
+    ssh_channel channel;
+
+    channel = ssh_channel_new(session);
+    if (channel == NULL) return NULL;
+
+    do {
+        if (ssh_channel_open_session(channel) != SSH_OK) break;
+
+        if (command) {
+            if (ssh_channel_request_exec(channel, command) != SSH_OK) break;
+        } else {
+            if (ssh_channel_request_pty(channel) != SSH_OK) break;
+            if (ssh_channel_request_shell(channel) != SSH_OK) break;
+        }
+
+        return channel;
+    } while (0);
+
+    ssh_channel_free(channel);
+
+    return NULL;
+}
+
+static void close_channel(ssh_channel channel)
+{
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+}
+
+static int run_interactive(ssh_session session)
+{
+    ssh_channel channel;
+    uint64_t start, end;
+    char c = 'x';
+
+    channel = open_channel(session, NULL);
+    if (channel == NULL) return -1;
+
+    end = histogram_now() + (uint64_t) config.hold * 1000000000;
+
+    while ((start = histogram_now()) < end) {
+        if (ssh_channel_write(channel, &c, 1) != 1) break;
+        if (ssh_channel_read(channel, &c, 1, 0) != 1) break;
+        record(&interval.echo, histogram_now() - start);
+
+        sleep_until(start + (uint64_t) config.think * 1000000);
+    }
+
+    close_channel(channel);
+
+    return start < end ? -1 : 0;
+}
+
+static int run_exec(ssh_session session)
+{
+    ssh_channel channel;
+    char buffer[16 * 1024];
+    int i;
+
+    for (i = 0; i < EXEC_BURST; i++) {
+        channel = open_channel(session, EXEC_COMMAND);
+        if (channel == NULL) return -1;
+
+        while (ssh_channel_read(channel, buffer, sizeof(buffer), 0) > 0);
+
+        close_channel(channel);
+    }
+
+    return 0;
+}
+
+static int run_idle(ssh_session session)
+{
+    ssh_channel channel;
+
+    channel = open_channel(session, NULL);
+    if (channel == NULL) return -1;
+
+    sleep_until(histogram_now() + (uint64_t) config.hold * 1000000000);
+
+    close_channel(channel);
+
+    return 0;
+}
+
+static void *session_main(void *arg)
+{
+    ssh_session session;
+    uint64_t start, connected;
+    int kind = (int) (intptr_t) arg;
+    int rc;
+
+    session = ssh_new();
+
+    do {
+        if (session == NULL) {
+            fail(STAGE_CONNECT);
+            break;
+        }
+
+        ssh_options_set(session, SSH_OPTIONS_HOST, config.host);
+        ssh_options_set(session, SSH_OPTIONS_PORT, &config.port);
+        ssh_options_set(session, SSH_OPTIONS_USER, config.user);
+
+        // TCP connect, banners and key exchange, all of which wait on sshdump accepting
+        start = histogram_now();
+        if (ssh_connect(session) != SSH_OK) {
+            fail(STAGE_CONNECT);
+            break;
+        }
+        connected = histogram_now();
+        record(&interval.connect, connected - start);
+
+        // Proxied to the upstream by auth_password or auth_pubkey
+        if (config.key) {
+            rc = ssh_userauth_publickey(session, NULL, config.key);
+        } else {
+            rc = ssh_userauth_password(session, NULL, config.password);
+        }
+        if (rc != SSH_AUTH_SUCCESS) {
+            fail(STAGE_AUTH);
+            break;
+        }
+        record(&interval.auth, histogram_now() - connected);
+
+        switch (kind) {
+        case KIND_INTERACTIVE: rc = run_interactive(session); break;
+        case KIND_EXEC: rc = run_exec(session); break;
+        default: rc = run_idle(session); break;
+        }
+
+        if (rc != 0) {
+            fail(STAGE_CHANNEL);
+            break;
+        }
+
+        pthread_mutex_lock(&stats_lock);
+        ++interval.completed;
+        pthread_mutex_unlock(&stats_lock);
+    } while (0);
+
+    if (session) {
+        ssh_disconnect(session);
+        ssh_free(session);
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    --active;
+    pthread_mutex_unlock(&stats_lock);
+
+    return NULL;
+}
+
+static int start_session(pthread_attr_t *attr, unsigned *seed)
+{
+    pthread_t thread;
+    int kind, pick;
+
+    pick = rand_r(seed) % (config.mix[KIND_INTERACTIVE] + config.mix[KIND_EXEC] + config.mix[KIND_IDLE]);
+    for (kind = 0; kind < KINDS - 1 && pick >= config.mix[kind]; kind++) pick -= config.mix[kind];
+
+    pthread_mutex_lock(&stats_lock);
+    ++active;
+    ++interval.started;
+    pthread_mutex_unlock(&stats_lock);
+
+    if (pthread_create(&thread, attr, session_main, (void *) (intptr_t) kind) != 0) {
+        pthread_mutex_lock(&stats_lock);
+        --active;
+        ++interval.failures[STAGE_CONNECT];
+        pthread_mutex_unlock(&stats_lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Resident kB and CPU ticks used so far, 0 if there's no process to watch
+static void process_usage(int pid, uint64_t *rss_kb, uint64_t *cpu_ticks)
+{
+    char path[64], line[1024], *p;
+    unsigned long long utime, stime;
+    FILE *f;
+
+    *rss_kb = 0;
+    *cpu_ticks = 0;
+
+    if (pid <= 0) return;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    f = fopen(path, "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "VmRSS: %llu", &utime) == 1) *rss_kb = utime;
+        }
+        fclose(f);
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    f = fopen(path, "r");
+    if (f) {
+        // The command name can hold anything, fields start after its closing bracket
+        if (fgets(line, sizeof(line), f) && (p = strrchr(line, ')')) != NULL &&
+                sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) == 2) {
+            *cpu_ticks = utime + stime;
+        }
+        fclose(f);
+    }
+}
+
+static void write_stats(FILE *f, const char *type, double seconds, const struct load_stats *stats, int open,
+    uint64_t rss_kb, uint64_t base_rss_kb, double cpu_percent)
+{
+    double per_session = open > 0 && rss_kb > base_rss_kb ? (double) (rss_kb - base_rss_kb) / open : 0;
+    int i;
+
+    fprintf(f, "{\"type\": \"%s\", \"seconds\": %.1f, \"active\": %d, \"started\": %llu, \"completed\": %llu",
+        type, seconds, open, (unsigned long long) stats->started, (unsigned long long) stats->completed);
+
+    for (i = 0; i < STAGES; i++) {
+        fprintf(f, ", \"%s_failures\": %llu", stage_names[i], (unsigned long long) stats->failures[i]);
+    }
+
+    fprintf(f, ", \"connect_p50_ms\": %.2f, \"connect_p99_ms\": %.2f, \"auth_p50_ms\": %.2f, \"auth_p99_ms\": %.2f"
+        ", \"echo_p50_ms\": %.2f, \"echo_p99_ms\": %.2f",
+        histogram_percentile(&stats->connect, 50) / 1e6, histogram_percentile(&stats->connect, 99) / 1e6,
+        histogram_percentile(&stats->auth, 50) / 1e6, histogram_percentile(&stats->auth, 99) / 1e6,
+        histogram_percentile(&stats->echo, 50) / 1e6, histogram_percentile(&stats->echo, 99) / 1e6);
+
+    fprintf(f, ", \"proxy_rss_kb\": %llu, \"proxy_kb_per_session\": %.1f, \"proxy_cpu_percent\": %.1f}\n",
+        (unsigned long long) rss_kb, per_session, cpu_percent);
+
+    fflush(f);
+}
+
+static void add_stats(struct load_stats *to, const struct load_stats *from)
+{
+    int i;
+
+    histogram_add(&to->connect, &from->connect);
+    histogram_add(&to->auth, &from->auth);
+    histogram_add(&to->echo, &from->echo);
+    to->started += from->started;
+    to->completed += from->completed;
+
+    for (i = 0; i < STAGES; i++) to->failures[i] += from->failures[i];
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stdout, "Usage:\n");
+    fprintf(stdout, "%s <args>\n", prog);
+    fprintf(stdout, "Where args are:\n");
+    fprintf(stdout, " -H | --host <name>        Host to connect to. Default 127.0.0.1\n");
+    fprintf(stdout, " -P | --port <num>         Port to connect to. Default 9000\n");
+    fprintf(stdout, " -u | --user <name>        User to log in as. Default bench\n");
+    fprintf(stdout, " -w | --password <text>    Password to log in with. Default bench\n");
+    fprintf(stdout, " -K | --privkey <file>     Log in with this private key instead of the password\n");
+    fprintf(stdout, " -r | --rate <num>         New sessions per second. Default 50\n");
+    fprintf(stdout, " -c | --concurrency <num>  Most sessions open at once. Default 2000\n");
+    fprintf(stdout, " -d | --duration <secs>    How long to start sessions for. Default 60\n");
+    fprintf(stdout, " -m | --mix <i,e,d>        Weights of interactive, exec and idle sessions. Default 60,30,10\n");
+    fprintf(stdout, " -t | --hold <secs>        How long interactive and idle sessions last. Default 30\n");
+    fprintf(stdout, " -k | --think <ms>         Time between keystrokes. Default 200\n");
+    fprintf(stdout, " -p | --pid <num>          sshdump process to report memory and CPU for\n");
+    fprintf(stdout, " -o | --output <file>      File to append the results to. Default load-results.json\n");
+}
+
+int main(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        {"host",        required_argument, 0, 'H'},
+        {"port",        required_argument, 0, 'P'},
+        {"user",        required_argument, 0, 'u'},
+        {"password",    required_argument, 0, 'w'},
+        {"privkey",     required_argument, 0, 'K'},
+        {"rate",        required_argument, 0, 'r'},
+        {"concurrency", required_argument, 0, 'c'},
+        {"duration",    required_argument, 0, 'd'},
+        {"mix",         required_argument, 0, 'm'},
+        {"hold",        required_argument, 0, 't'},
+        {"think",       required_argument, 0, 'k'},
+        {"pid",         required_argument, 0, 'p'},
+        {"output",      required_argument, 0, 'o'},
+        {"help",        no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    const char *key_file = NULL;
+    const char *output = "load-results.json";
+    struct load_stats *snapshot;
+    struct rlimit limit;
+    pthread_attr_t attr;
+    uint64_t begin, now, next, report, end, gap;
+    uint64_t rss, base_rss, peak_rss, cpu, first_cpu, last_cpu;
+    unsigned seed;
+    double cpu_percent = 0;
+    int rate = 50, concurrency = 2000, duration = 60, pid = 0;
+    int c, open, peak_open = 0, throttled = 0;
+    FILE *f;
+
+    while ((c = getopt_long(argc, argv, "H:P:u:w:K:r:c:d:m:t:k:p:o:h", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'H': config.host = optarg; break;
+        case 'P': config.port = atoi(optarg); break;
+        case 'u': config.user = optarg; break;
+        case 'w': config.password = optarg; break;
+        case 'K': key_file = optarg; break;
+        case 'r': rate = atoi(optarg); break;
+        case 'c': concurrency = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'm':
+            if (sscanf(optarg, "%d,%d,%d", &config.mix[0], &config.mix[1], &config.mix[2]) != 3) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't': config.hold = atoi(optarg); break;
+        case 'k': config.think = atoi(optarg); break;
+        case 'p': pid = atoi(optarg); break;
+        case 'o': output = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.port < 1 || config.port > 65535 || rate < 1 || concurrency < 1 || duration < 1 ||
+            config.hold < 0 || config.think < 1 || config.mix[0] < 0 || config.mix[1] < 0 || config.mix[2] < 0 ||
+            config.mix[0] + config.mix[1] + config.mix[2] == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    f = fopen(output, "a");
+    snapshot = calloc(1, sizeof(struct load_stats));
+    if (f == NULL || snapshot == NULL) {
+        perror(output);
+        return 1;
+    }
+
+    // Every session is a socket
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    ssh_init();
+
+    if (key_file && ssh_pki_import_privkey_file(key_file, NULL, NULL, NULL, &config.key) != SSH_OK) {
+        fprintf(stderr, "Error reading private key %s\n", key_file);
+        return 1;
+    }
+
+    // Sessions spend their lives blocked in libssh, they don't need much stack
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    seed = (unsigned) getpid();
+    process_usage(pid, &base_rss, &first_cpu);
+    last_cpu = first_cpu;
+    peak_rss = base_rss;
+
+    gap = 1000000000 / rate;
+    begin = histogram_now();
+    next = begin;
+    report = begin + 1000000000;
+    end = begin + (uint64_t) duration * 1000000000;
+
+    for (;;) {
+        now = histogram_now();
+
+        if (now < end && now >= next) {
+            pthread_mutex_lock(&stats_lock);
+            open = active;
+            pthread_mutex_unlock(&stats_lock);
+
+            // Arrivals keep to the rate, ones over the limit are skipped rather than bunched up later
+            if (open < concurrency) {
+                start_session(&attr, &seed);
+            } else {
+                ++throttled;
+            }
+            next += gap;
+            continue;
+        }
+
+        if (now >= report) {
+            pthread_mutex_lock(&stats_lock);
+            memcpy(snapshot, &interval, sizeof(struct load_stats));
+            memset(&interval, 0, sizeof(struct load_stats));
+            open = active;
+            pthread_mutex_unlock(&stats_lock);
+
+            add_stats(&total, snapshot);
+
+            process_usage(pid, &rss, &cpu);
+            cpu_percent = 100.0 * (cpu - last_cpu) / sysconf(_SC_CLK_TCK);
+            last_cpu = cpu;
+            if (rss > peak_rss) peak_rss = rss;
+            if (open > peak_open) peak_open = open;
+
+            write_stats(f, "interval", (now - begin) / 1e9, snapshot, open, rss, base_rss, cpu_percent);
+            printf("%6.0fs  active %5d  started %4llu  failed %llu/%llu/%llu  connect p99 %.1fms  auth p99 %.1fms"
+                "  echo p99 %.1fms  sshdump %llu kB %.0f%% CPU\n", (now - begin) / 1e9, open,
+                (unsigned long long) snapshot->started, (unsigned long long) snapshot->failures[STAGE_CONNECT],
+                (unsigned long long) snapshot->failures[STAGE_AUTH],
+                (unsigned long long) snapshot->failures[STAGE_CHANNEL],
+                histogram_percentile(&snapshot->connect, 99) / 1e6, histogram_percentile(&snapshot->auth, 99) / 1e6,
+                histogram_percentile(&snapshot->echo, 99) / 1e6, (unsigned long long) rss, cpu_percent);
+            fflush(stdout);
+
+            report += 1000000000;
+
+            // Done once the last session has ended
+            if (now >= end && open == 0) break;
+            continue;
+        }
+
+        sleep_until(now < end && next < report ? next : report);
+    }
+
+    // Peak memory over peak sessions, and CPU averaged over the whole run
+    now = histogram_now() - begin;
+    write_stats(f, "summary", now / 1e9, &total, peak_open, peak_rss, base_rss,
+        100.0 * (last_cpu - first_cpu) / sysconf(_SC_CLK_TCK) / (now / 1e9));
+    printf("Skipped %d arrivals at the concurrency limit, results appended to %s\n", throttled, output);
+
+    fclose(f);
+    free(snapshot);
+    pthread_attr_destroy(&attr);
+    if (config.key) ssh_key_free(config.key);
+    ssh_finalize();
+
+    return 0;
+}
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <libssh/libssh.h>
+#include <libssh/server.h>
+
+/*
+ * Stand-in upstream sshd for the benchmark. Accepts any user with the bench
+ * password or any public key, and runs one session channel per connection, a
+ * forked child each.
+ * Understands just enough commands for bench_client, so the client works
+ * unchanged against a real sshd:
+ *
+ *   head -c <bytes> /dev/zero    writes that many zeros
+ *   cat > /dev/null              reads until EOF
+ *   true                         exits at once
+ *   a pty shell                  echoes every byte back
+ */
+
+#define BENCH_CHUNK (32 * 1024)
+
+#define MODE_NONE   0
+#define MODE_ECHO   1
+#define MODE_SOURCE 2
+#define MODE_SINK   3
+#define MODE_EXIT   4
+
+static const char *password = "bench";
+
+static int get_channel(ssh_session session, ssh_channel *channel)
+{
+    ssh_message message;
+    int authenticated = 0;
+
+    while (*channel == NULL && (message = ssh_message_get(session)) != NULL) {
+        switch (ssh_message_type(message)) {
+        case SSH_REQUEST_AUTH:
+            if (ssh_message_subtype(message) == SSH_AUTH_METHOD_PASSWORD &&
+                    strcmp(ssh_message_auth_password(message), password) == 0) {
+                ssh_message_auth_reply_success(message, 0);
+                authenticated = 1;
+            } else if (ssh_message_subtype(message) == SSH_AUTH_METHOD_PUBLICKEY) {
+                // libssh has already checked the signature, whose key it is doesn't matter
+                if (ssh_message_auth_publickey_state(message) == SSH_PUBLICKEY_STATE_VALID) {
+                    ssh_message_auth_reply_success(message, 0);
+                    authenticated = 1;
+                } else {
+                    ssh_message_auth_reply_pk_ok_simple(message);
+                }
+            } else {
+                ssh_message_auth_set_methods(message, SSH_AUTH_METHOD_PASSWORD | SSH_AUTH_METHOD_PUBLICKEY);
+                ssh_message_reply_default(message);
+            }
+            break;
+
+        case SSH_REQUEST_CHANNEL_OPEN:
+            if (authenticated && ssh_message_subtype(message) == SSH_CHANNEL_SESSION) {
+                *channel = ssh_message_channel_request_open_reply_accept(message);
+            } else {
+                ssh_message_reply_default(message);
+            }
+            break;
+
+        default:
+            ssh_message_reply_default(message);
+        }
+
+        ssh_message_free(message);
+    }
+
+    return *channel ? 0 : -1;
+}
+
+static int get_mode(ssh_session session, unsigned long long *bytes)
+{
+    ssh_message message;
+    const char *command;
+    int mode = MODE_NONE;
+
+    while (mode == MODE_NONE && (message = ssh_message_get(session)) != NULL) {
+        if (ssh_message_type(message) != SSH_REQUEST_CHANNEL) {
+            ssh_message_reply_default(message);
+            ssh_message_free(message);
+            continue;
+        }
+
+        switch (ssh_message_subtype(message)) {
+        case SSH_CHANNEL_REQUEST_PTY:
+        case SSH_CHANNEL_REQUEST_ENV:
+        case SSH_CHANNEL_REQUEST_WINDOW_CHANGE:
+            ssh_message_channel_request_reply_success(message);
+            break;
+
+        case SSH_CHANNEL_REQUEST_SHELL:
+            ssh_message_channel_request_reply_success(message);
+            mode = MODE_ECHO;
+            break;
+
+        case SSH_CHANNEL_REQUEST_EXEC:
+            command = ssh_message_channel_request_command(message);
+            ssh_message_channel_request_reply_success(message);
+
+            if (sscanf(command, "head -c %llu /dev/zero", bytes) == 1) {
+                mode = MODE_SOURCE;
+            } else if (strcmp(command, "cat > /dev/null") == 0) {
+                mode = MODE_SINK;
+            } else {
+                // true, and anything we don't know
+                mode = MODE_EXIT;
+            }
+            break;
+
+        default:
+            ssh_message_reply_default(message);
+        }
+
+        ssh_message_free(message);
+    }
+
+    return mode;
+}
+
+static void serve(ssh_session session)
+{
+    ssh_channel channel = NULL;
+    unsigned long long bytes = 0;
+    char *buffer;
+    int mode, n, len;
+
+    if (ssh_handle_key_exchange(session) != SSH_OK) {
+        fprintf(stderr, "Key exchange failed: %s\n", ssh_get_error(session));
+        return;
+    }
+
+    if (get_channel(session, &channel) != 0) return;
+
+    mode = get_mode(session, &bytes);
+
+    buffer = calloc(1, BENCH_CHUNK);
+    if (buffer == NULL) return;
+
+    switch (mode) {
+    case MODE_ECHO:
+        while ((n = ssh_channel_read(channel, buffer, BENCH_CHUNK, 0)) > 0) {
+            if (ssh_channel_write(channel, buffer, n) != n) break;
+        }
+        break;
+
+    case MODE_SOURCE:
+        while (bytes > 0) {
+            len = bytes > BENCH_CHUNK ? BENCH_CHUNK : bytes;
+            if (ssh_channel_write(channel, buffer, len) != len) break;
+            bytes -= len;
+        }
+        break;
+
+    case MODE_SINK:
+        while (ssh_channel_read(channel, buffer, BENCH_CHUNK, 0) > 0);
+        break;
+    }
+
+    free(buffer);
+
+    if (mode != MODE_NONE) {
+        ssh_channel_request_send_exit_status(channel, 0);
+        ssh_channel_send_eof(channel);
+    }
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stdout, "Usage:\n");
+    fprintf(stdout, "%s <args>\n", prog);
+    fprintf(stdout, "Where args are:\n");
+    fprintf(stdout, " -p | --port <num>         TCP/IP port to listen on, loopback only. Default 9022\n");
+    fprintf(stdout, " -r | --rsa <file>         RSA host key. Default ./keys/ssh_host_rsa_key\n");
+    fprintf(stdout, " -w | --password <text>    Password every user logs in with. Default bench\n");
+}
+
+int main(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        {"port",        required_argument, 0, 'p'},
+        {"rsa",         required_argument, 0, 'r'},
+        {"password",    required_argument, 0, 'w'},
+        {"help",        no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    const char *rsa_key = "./keys/ssh_host_rsa_key";
+    ssh_bind bind;
+    ssh_session session;
+    int port = 9022;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "p:r:w:h", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'p': port = atoi(optarg); break;
+        case 'r': rsa_key = optarg; break;
+        case 'w': password = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (port < 1 || port > 65535) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Children are never waited for
+    signal(SIGCHLD, SIG_IGN);
+
+    ssh_init();
+
+    bind = ssh_bind_new();
+    ssh_bind_options_set(bind, SSH_BIND_OPTIONS_BINDADDR, "127.0.0.1");
+    ssh_bind_options_set(bind, SSH_BIND_OPTIONS_BINDPORT, &port);
+    ssh_bind_options_set(bind, SSH_BIND_OPTIONS_RSAKEY, rsa_key);
+
+    if (ssh_bind_listen(bind) < 0) {
+        fprintf(stderr, "Error listening on port %d: %s\n", port, ssh_get_error(bind));
+        return 1;
+    }
+
+    for (;;) {
+        session = ssh_new();
+        if (ssh_bind_accept(bind, session) != SSH_OK) {
+            fprintf(stderr, "Error accepting connection: %s\n", ssh_get_error(bind));
+            ssh_free(session);
+            continue;
+        }
+
+        switch (fork()) {
+        case 0:
+            ssh_bind_free(bind);
+            serve(session);
+            ssh_disconnect(session);
+            ssh_free(session);
+            _exit(0);
+
+        case -1:
+            perror("fork");
+            break;
+        }
+
+        // The child has its own copy
+        ssh_free(session);
+    }
+
+    return 0;
+}
@@ -0,0 +1,863 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "capture.h"
+#include "output.h"
+#include "compress.h"
+#include "log.h"
+
+
+// The file currently being written for one leg
+struct capture_file {
+    int fd;                 // -1 until the first record arrives
+    uint64_t size;
+    time_t opened;          // Monotonic
+    int sequence;
+};
+
+// A pipe libssh writes one leg's pcap into
+struct capture_stream {
+    struct capture_stream *next;
+    int fd;                 // Read end
+    int session_id;
+    const char *leg;
+    int failed;             // Couldn't open a file, discard the rest
+
+    char header[PCAP_HEADER_SIZE];
+    int have_header;
+
+    struct capture_file file;
+
+    size_t len;
+    char buffer[CAPTURE_BUFFER_SIZE];
+};
+
+// Everything the capture thread is writing to one open file, indexed by fd
+struct capture_sink {
+    int open;
+    uint64_t offset;            // Where the next write goes
+    struct compress_job *frame; // Raw data collecting for the next frame
+    time_t frame_started;
+    uint32_t *seek;             // Compressed and raw size of each frame written so far
+    uint32_t frames;
+    uint32_t seek_size;         // Frames the seek table has room for
+};
+
+static char name_template[1024];
+static uint64_t rotate_size = 0;    // Bytes, 0 for no limit
+static int rotate_age = 0;          // Seconds, 0 for no limit
+
+static pthread_t capture_thread;
+static int capture_started = 0;
+static int wake_fd = -1;
+static int stopping = 0;
+
+// Streams opened by the workers, not yet picked up by the capture thread
+static pthread_mutex_t new_streams_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct capture_stream *new_streams = NULL;
+
+// Blocks handed over by the workers, written in order
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct capture_block *queued_head = NULL;
+static struct capture_block *queued_tail = NULL;
+static struct capture_block *free_blocks = NULL;
+static int queued_count = 0;
+
+// Only touched by the capture thread
+static int compressing = 0;
+static struct capture_sink *sinks = NULL;
+static int sinks_size = 0;
+static int jobs_pending = 0;        // With the compression thread
+static time_t frames_due = 0;          // Earliest a waiting frame has to go out, 0 for none
+
+static time_t monotonic_seconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec;
+}
+
+static void format_name(struct capture_stream *stream, char *name, size_t size)
+{
+    const char *p;
+    size_t len = 0;
+    int n = 0;
+    struct tm tm;
+    time_t now;
+
+    for (p = name_template; *p && len + 1 < size; p++) {
+        if (*p != '%' || p[1] == '\x0') {
+            name[len++] = *p;
+            continue;
+        }
+
+        switch (*++p) {
+        case 'i':
+            n = snprintf(name + len, size - len, "%d.%d", (int) getpid(), stream->session_id);
+            break;
+        case 'l':
+            n = snprintf(name + len, size - len, "%s", stream->leg);
+            break;
+        case 'n':
+            n = snprintf(name + len, size - len, "%d", stream->file.sequence);
+            break;
+        case 't':
+            now = time(NULL);
+            localtime_r(&now, &tm);
+            n = strftime(name + len, size - len, "%Y%m%d-%H%M%S", &tm);
+            break;
+        default:
+            name[len] = *p;
+            n = 1;
+            break;
+        }
+
+        len += n;
+        if (len >= size) len = size - 1;
+    }
+
+    name[len] = '\x0';
+}
+
+static struct capture_sink *get_sink(int fd)
+{
+    struct capture_sink *grown;
+    int size;
+
+    if (fd >= sinks_size) {
+        size = sinks_size ? sinks_size : 256;
+        while (size <= fd) size *= 2;
+
+        grown = realloc(sinks, size * sizeof(struct capture_sink));
+        if (grown == NULL) {
+            log_error("Unable to allocate capture file table");
+            return NULL;
+        }
+
+        memset(grown + sinks_size, 0, (size - sinks_size) * sizeof(struct capture_sink));
+        sinks = grown;
+        sinks_size = size;
+    }
+
+    return &sinks[fd];
+}
+
+static void sink_open(int fd, uint64_t offset)
+{
+    struct capture_sink *sink = get_sink(fd);
+
+    if (sink == NULL) return;
+
+    memset(sink, 0, sizeof(struct capture_sink));
+    sink->open = 1;
+    sink->offset = offset;
+}
+
+static void submit_frame(int fd, struct capture_sink *sink, int close)
+{
+    struct compress_job *job = sink->frame;
+
+    sink->frame = NULL;
+
+    if (job == NULL) {
+        job = compress_job_new(fd);
+        if (job == NULL) {
+            log_error("Unable to allocate compression job");
+            return;
+        }
+    }
+
+    job->close = close;
+    ++jobs_pending;
+
+    compress_submit(job);
+}
+
+static void sink_write(int fd, const void *data, size_t len)
+{
+    struct capture_sink *sink = get_sink(fd);
+
+    if (sink == NULL || !sink->open) return;
+
+    if (!compressing) {
+        output_write(fd, sink->offset, data, len);
+        sink->offset += len;
+        return;
+    }
+
+    // Frames end between writes, so each holds whole records
+    if (sink->frame && sink->frame->len + len > COMPRESS_FRAME_SIZE) {
+        submit_frame(fd, sink, 0);
+    }
+
+    if (sink->frame == NULL) {
+        sink->frame = compress_job_new(fd);
+        if (sink->frame == NULL) {
+            log_error("Unable to allocate compression job, dropping %lu bytes", (unsigned long) len);
+            return;
+        }
+        sink->frame_started = monotonic_seconds();
+
+        if (frames_due == 0 || sink->frame_started + COMPRESS_FRAME_SECS < frames_due) {
+            frames_due = sink->frame_started + COMPRESS_FRAME_SECS;
+        }
+    }
+
+    if (compress_job_append(sink->frame, data, len) != 0) {
+        log_error("Unable to grow compression frame, dropping %lu bytes", (unsigned long) len);
+    }
+}
+
+static void sink_close(int fd)
+{
+    struct capture_sink *sink = get_sink(fd);
+
+    if (sink == NULL || !sink->open) {
+        close(fd);
+        return;
+    }
+
+    if (compressing) {
+        // The seek table and close follow once the last frame is written
+        submit_frame(fd, sink, 1);
+        return;
+    }
+
+    output_close(fd, 1);
+    sink->open = 0;
+}
+
+// Send off frames that have waited long enough, so quiet sessions still reach the disk
+static void sink_service(void)
+{
+    time_t now = monotonic_seconds();
+    int fd;
+
+    if (!compressing || frames_due == 0 || now < frames_due) return;
+    frames_due = 0;
+
+    for (fd = 0; fd < sinks_size; fd++) {
+        if (!sinks[fd].open || !sinks[fd].frame) continue;
+
+        if (now >= sinks[fd].frame_started + COMPRESS_FRAME_SECS) {
+            submit_frame(fd, &sinks[fd], 0);
+        } else if (frames_due == 0 || sinks[fd].frame_started + COMPRESS_FRAME_SECS < frames_due) {
+            frames_due = sinks[fd].frame_started + COMPRESS_FRAME_SECS;
+        }
+    }
+}
+
+// Only wakes for frames that are waiting, everything else wakes the poll itself
+static int poll_timeout(void)
+{
+    time_t now;
+    int timeout = -1;
+
+    if (frames_due) {
+        now = monotonic_seconds();
+        timeout = frames_due > now ? (frames_due - now) * 1000 : 0;
+    }
+
+    // In case the compression thread's wakeup goes missing, finished frames wait no longer than this
+    if (jobs_pending > 0 && (timeout < 0 || timeout > CAPTURE_JOBS_POLL_MS)) {
+        timeout = CAPTURE_JOBS_POLL_MS;
+    }
+
+    return timeout;
+}
+
+static void put32(char *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static void add_seek_entry(struct capture_sink *sink, uint32_t compressed, uint32_t raw)
+{
+    uint32_t *grown;
+    uint32_t size;
+
+    if (sink->frames == sink->seek_size) {
+        size = sink->seek_size ? sink->seek_size * 2 : 16;
+
+        grown = realloc(sink->seek, size * 2 * sizeof(uint32_t));
+        if (grown == NULL) {
+            // Still decompresses, it just can't be seeked
+            log_error("Unable to grow seek table");
+            return;
+        }
+
+        sink->seek = grown;
+        sink->seek_size = size;
+    }
+
+    sink->seek[sink->frames * 2] = compressed;
+    sink->seek[sink->frames * 2 + 1] = raw;
+    ++sink->frames;
+}
+
+static void write_seek_table(int fd, struct capture_sink *sink)
+{
+    size_t len = 8 + sink->frames * 8 + 9;
+    char *table, *p;
+    uint32_t i;
+
+    table = malloc(len);
+    if (table == NULL) {
+        log_error("Unable to allocate seek table");
+        return;
+    }
+
+    // A skippable frame, so plain zstd readers pass over it
+    put32(table, COMPRESS_SKIPPABLE_MAGIC);
+    put32(table + 4, len - 8);
+
+    for (i = 0, p = table + 8; i < sink->frames; i++, p += 8) {
+        put32(p, sink->seek[i * 2]);
+        put32(p + 4, sink->seek[i * 2 + 1]);
+    }
+
+    put32(p, sink->frames);
+    p[4] = 0;                   // Descriptor, no checksums
+    put32(p + 5, COMPRESS_SEEKABLE_MAGIC);
+
+    output_write(fd, sink->offset, table, len);
+    sink->offset += len;
+
+    free(table);
+}
+
+// Write out frames the compression thread has finished, in the order they were sent
+static void write_frames(void)
+{
+    struct compress_job *jobs, *job;
+    struct capture_sink *sink;
+
+    jobs = compress_done();
+
+    while (jobs) {
+        job = jobs;
+        jobs = job->next;
+        --jobs_pending;
+
+        sink = &sinks[job->fd];
+
+        if (job->len > 0) {
+            output_write(job->fd, sink->offset, job->data, job->len);
+            sink->offset += job->len;
+            add_seek_entry(sink, job->len, job->raw_len);
+        }
+
+        if (job->close) {
+            write_seek_table(job->fd, sink);
+            output_close(job->fd, 1);
+
+            free(sink->seek);
+            memset(sink, 0, sizeof(struct capture_sink));
+        }
+
+        compress_job_free(job);
+    }
+}
+
+static void close_file(struct capture_file *file)
+{
+    if (file->fd < 0) return;
+
+    // Waits for the file's writes, the sync happens on the closer thread
+    sink_close(file->fd);
+
+    file->fd = -1;
+    ++file->sequence;
+}
+
+static int open_file(struct capture_stream *stream)
+{
+    char file_name[1024];
+
+    format_name(stream, file_name, sizeof(file_name));
+    if (compressing) {
+        strncat(file_name, ".zst", sizeof(file_name) - strlen(file_name) - 1);
+    }
+
+    stream->file.fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (stream->file.fd < 0) {
+        log_error("[%d] Error opening pcap file %s: %s", stream->session_id, file_name, strerror(errno));
+        return -1;
+    }
+
+    stream->file.opened = monotonic_seconds();
+    sink_open(stream->file.fd, 0);
+
+    // Every file is a complete capture
+    sink_write(stream->file.fd, stream->header, sizeof(stream->header));
+    stream->file.size = sizeof(stream->header);
+
+    log_debug("[%d] Capturing %s leg to %s", stream->session_id, stream->leg, file_name);
+
+    return 0;
+}
+
+// unwritten is what's already due to go in the current file
+static int rotate_due(struct capture_file *file, size_t unwritten, size_t record_len)
+{
+    if (file->fd < 0) return 1;
+
+    // Only rotate once the file holds a record
+    if (file->size + unwritten <= PCAP_HEADER_SIZE) return 0;
+
+    if (rotate_size && file->size + unwritten + record_len > rotate_size) return 1;
+    if (rotate_age && monotonic_seconds() >= file->opened + rotate_age) return 1;
+
+    return 0;
+}
+
+static void write_run(struct capture_stream *stream, const char *data, size_t len)
+{
+    if (len == 0 || stream->failed) return;
+
+    sink_write(stream->file.fd, data, len);
+    stream->file.size += len;
+}
+
+// Write out the complete records in the buffer, rotating between records
+static void process(struct capture_stream *stream)
+{
+    size_t pos = 0, run = 0;
+    uint32_t incl_len;
+    size_t record_len;
+
+    if (!stream->have_header) {
+        if (stream->len < PCAP_HEADER_SIZE) return;
+
+        memcpy(stream->header, stream->buffer, PCAP_HEADER_SIZE);
+        stream->have_header = 1;
+        pos = run = PCAP_HEADER_SIZE;
+    }
+
+    while (stream->len - pos >= PCAP_RECORD_HEADER_SIZE && !stream->failed) {
+        memcpy(&incl_len, stream->buffer + pos + 8, sizeof(incl_len));
+        record_len = PCAP_RECORD_HEADER_SIZE + incl_len;
+
+        if (record_len > sizeof(stream->buffer)) {
+            log_error("[%d] Bad record in %s leg capture, discarding the rest", stream->session_id, stream->leg);
+            stream->failed = 1;
+            break;
+        }
+
+        if (stream->len - pos < record_len) break;
+
+        if (rotate_due(&stream->file, pos - run, record_len)) {
+            write_run(stream, stream->buffer + run, pos - run);
+            run = pos;
+
+            close_file(&stream->file);
+            if (!stream->failed && open_file(stream) != 0) {
+                stream->failed = 1;
+            }
+        }
+
+        pos += record_len;
+    }
+
+    write_run(stream, stream->buffer + run, pos - run);
+
+    if (stream->failed) {
+        pos = stream->len;
+    }
+
+    // Keep the partial record for next time
+    memmove(stream->buffer, stream->buffer + pos, stream->len - pos);
+    stream->len -= pos;
+}
+
+static void free_stream(struct capture_stream *stream)
+{
+    close_file(&stream->file);
+    close(stream->fd);
+    free(stream);
+}
+
+// Returns 0 once the writer has closed the pipe
+static int read_stream(struct capture_stream *stream)
+{
+    ssize_t got;
+
+    for (;;) {
+        got = read(stream->fd, stream->buffer + stream->len, sizeof(stream->buffer) - stream->len);
+
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return 1;
+            log_error("[%d] Error reading %s leg capture: %s", stream->session_id, stream->leg, strerror(errno));
+            return 0;
+        }
+
+        if (got == 0) {
+            process(stream);
+            return 0;
+        }
+
+        stream->len += got;
+
+        process(stream);
+    }
+}
+
+static void wake(void)
+{
+    uint64_t value = 1;
+
+    if (write(wake_fd, &value, sizeof(value)) < 0) {
+        // Already has a wakeup pending
+    }
+}
+
+static void release_block(struct capture_block *block)
+{
+    pthread_mutex_lock(&blocks_lock);
+    block->next = free_blocks;
+    free_blocks = block;
+    pthread_mutex_unlock(&blocks_lock);
+}
+
+static void write_blocks(void)
+{
+    struct capture_block *blocks, *block;
+
+    pthread_mutex_lock(&blocks_lock);
+    blocks = queued_head;
+    queued_head = queued_tail = NULL;
+    queued_count = 0;
+    pthread_mutex_unlock(&blocks_lock);
+
+    while (blocks) {
+        block = blocks;
+        blocks = block->next;
+
+        // The first block for a file says where it starts
+        if (block->fd >= sinks_size || !sinks[block->fd].open) {
+            sink_open(block->fd, block->offset);
+        }
+
+        if (block->len > 0) {
+            sink_write(block->fd, block->data, block->len);
+        }
+
+        if (block->close) {
+            sink_close(block->fd);
+        }
+
+        // The data has been copied or written by now
+        release_block(block);
+    }
+}
+
+static void *capture_main(void *arg)
+{
+    struct capture_stream *streams = NULL, *stream, **link;
+    struct pollfd *fds = NULL;
+    size_t fds_size = 0;
+    size_t count, i;
+    uint64_t value;
+    int stop;
+
+    (void)arg;
+
+    for (;;) {
+        // Read first, so everything handed over before the stop is picked up below
+        stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+
+        // Pick up new streams
+        pthread_mutex_lock(&new_streams_lock);
+        while (new_streams) {
+            stream = new_streams;
+            new_streams = stream->next;
+            stream->next = streams;
+            streams = stream;
+        }
+        pthread_mutex_unlock(&new_streams_lock);
+
+        write_frames();
+        write_blocks();
+
+        // Every session closes its pipes and files before we're stopped, so this drains them all
+        if (stop && streams == NULL && jobs_pending == 0) break;
+
+        count = 1;
+        for (stream = streams; stream; stream = stream->next) ++count;
+
+        if (count > fds_size) {
+            free(fds);
+            fds_size = count * 2;
+            fds = malloc(fds_size * sizeof(struct pollfd));
+            if (fds == NULL) {
+                log_error("Unable to allocate capture poll list");
+                fds_size = 0;
+                sleep(1);
+                continue;
+            }
+        }
+
+        fds[0].fd = wake_fd;
+        fds[0].events = POLLIN;
+        for (stream = streams, i = 1; stream; stream = stream->next, i++) {
+            fds[i].fd = stream->fd;
+            fds[i].events = POLLIN;
+        }
+
+        if (poll(fds, count, poll_timeout()) < 0 && errno != EINTR) {
+            log_error("Error polling capture pipes: %s", strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            if (read(wake_fd, &value, sizeof(value)) < 0) {
+                // Nothing to do, it's just a wakeup
+            }
+        }
+
+        for (link = &streams, i = 1; *link; i++) {
+            stream = *link;
+
+            if (fds[i].revents && !read_stream(stream)) {
+                *link = stream->next;
+                free_stream(stream);
+                continue;
+            }
+
+            link = &stream->next;
+        }
+
+        sink_service();
+
+        // One submission for everything this pass produced
+        output_submit();
+    }
+
+    while (streams) {
+        stream = streams;
+        streams = stream->next;
+        free_stream(stream);
+    }
+
+    free(fds);
+
+    return NULL;
+}
+
+int capture_start(const char *file_template, uint64_t max_size, int max_age, int backend, int compress_level)
+{
+    int rc;
+
+    // Without a pattern, keep the old naming and add the leg and sequence
+    if (file_template == NULL) {
+        name_template[0] = '\x0';
+    } else if (strchr(file_template, '%')) {
+        snprintf(name_template, sizeof(name_template), "%s", file_template);
+    } else {
+        snprintf(name_template, sizeof(name_template), "%s.%%i.%%l.%%n", file_template);
+    }
+
+    rotate_size = max_size;
+    rotate_age = max_age;
+    stopping = 0;
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        log_error("Unable to create capture wakeup: %s", strerror(errno));
+        return -1;
+    }
+
+    if (compress_level > 0) {
+        if (compress_start(compress_level, wake_fd) != 0) {
+            close(wake_fd);
+            wake_fd = -1;
+            return -1;
+        }
+        compressing = 1;
+    }
+
+    output_init(backend);
+
+    rc = pthread_create(&capture_thread, NULL, capture_main, NULL);
+    if (rc != 0) {
+        log_error("Unable to start capture thread: %s", strerror(rc));
+        output_cleanup();
+        compress_stop();
+        compressing = 0;
+        close(wake_fd);
+        wake_fd = -1;
+        return -1;
+    }
+
+    capture_started = 1;
+
+    return 0;
+}
+
+int capture_open_pipe(int session_id, const char *leg)
+{
+    struct capture_stream *stream;
+    int fds[2];
+
+    if (!capture_started) return -1;
+
+    stream = malloc(sizeof(struct capture_stream));
+    if (stream == NULL) {
+        log_error("[%d] Unable to allocate %s leg capture", session_id, leg);
+        return -1;
+    }
+
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        log_error("[%d] Unable to create %s leg capture pipe: %s", session_id, leg, strerror(errno));
+        free(stream);
+        return -1;
+    }
+
+    // Room for bursts while the capture thread is rotating
+    fcntl(fds[1], F_SETPIPE_SZ, CAPTURE_PIPE_SIZE);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    stream->fd = fds[0];
+    stream->session_id = session_id;
+    stream->leg = leg;
+    stream->failed = 0;
+    stream->have_header = 0;
+    stream->file.fd = -1;
+    stream->file.size = 0;
+    stream->file.opened = 0;
+    stream->file.sequence = 0;
+    stream->len = 0;
+
+    pthread_mutex_lock(&new_streams_lock);
+    stream->next = new_streams;
+    new_streams = stream;
+    pthread_mutex_unlock(&new_streams_lock);
+
+    wake();
+
+    return fds[1];
+}
+
+static struct capture_block *take_block(int limited)
+{
+    struct capture_block *block = NULL;
+
+    pthread_mutex_lock(&blocks_lock);
+    if (limited && queued_count >= CAPTURE_MAX_QUEUED) {
+        // The disk isn't keeping up, let the caller drop rather than wait
+        pthread_mutex_unlock(&blocks_lock);
+        return NULL;
+    }
+    if (free_blocks) {
+        block = free_blocks;
+        free_blocks = block->next;
+    }
+    pthread_mutex_unlock(&blocks_lock);
+
+    if (block == NULL) {
+        block = malloc(sizeof(struct capture_block));
+        if (block == NULL) return NULL;
+    }
+
+    block->next = NULL;
+    block->fd = -1;
+    block->close = 0;
+    block->offset = 0;
+    block->len = 0;
+
+    return block;
+}
+
+struct capture_block *capture_block_new(void)
+{
+    if (!capture_started) return NULL;
+
+    return take_block(1);
+}
+
+void capture_block_write(struct capture_block *block)
+{
+    block->next = NULL;
+
+    pthread_mutex_lock(&blocks_lock);
+    if (queued_tail) {
+        queued_tail->next = block;
+    } else {
+        queued_head = block;
+    }
+    queued_tail = block;
+    ++queued_count;
+    pthread_mutex_unlock(&blocks_lock);
+
+    wake();
+}
+
+void capture_close(int fd)
+{
+    struct capture_block *block;
+
+    if (!capture_started) {
+        close(fd);
+        return;
+    }
+
+    // Queued behind the file's writes, even when the queue is full
+    block = take_block(0);
+    if (block == NULL) {
+        log_error("Unable to queue capture file close");
+        return;
+    }
+
+    block->fd = fd;
+    block->close = 1;
+
+    capture_block_write(block);
+}
+
+void capture_stop(void)
+{
+    struct capture_block *block;
+
+    if (!capture_started) return;
+
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    wake();
+
+    pthread_join(capture_thread, NULL);
+
+    // Nothing left for it, every file has been closed
+    compress_stop();
+    compressing = 0;
+
+    output_cleanup();
+
+    free(sinks);
+    sinks = NULL;
+    sinks_size = 0;
+
+    while (free_blocks) {
+        block = free_blocks;
+        free_blocks = block->next;
+        free(block);
+    }
+
+    close(wake_fd);
+    wake_fd = -1;
+    capture_started = 0;
+}
@@ -0,0 +1,53 @@
+#include <stdint.h>
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/*
+ * Capture files are written by a dedicated thread. libssh writes each leg's
+ * pcap into a pipe, the capture thread splits the stream on record boundaries
+ * and writes it to files named from a template:
+ *
+ *   %i  connection id, as <pid>.<id> so a replacement process's names don't
+ *       collide with the old one's while it drains
+ *   %l  leg ("in" or "out")
+ *   %n  rotation sequence number
+ *   %t  time the file was opened (YYYYmmdd-HHMMSS)
+ *   %%  a percent sign
+ *
+ * A template without any % has ".%i.%l.%n" appended.
+ *
+ * Other output, like transcripts, is handed over a block at a time. Blocks are
+ * written in the order they're handed over and the file is closed once a
+ * close for it comes through. All file I/O goes through output.c.
+ *
+ * With compression on, file contents go through compress.c first and files
+ * get a .zst suffix. Rotation sizes count uncompressed bytes.
+ */
+
+#define CAPTURE_PIPE_SIZE (1024 * 1024)
+#define CAPTURE_BUFFER_SIZE (512 * 1024)    // Holds the largest libssh packet with room to spare
+#define PCAP_HEADER_SIZE 24
+#define PCAP_RECORD_HEADER_SIZE 16
+
+#define CAPTURE_BLOCK_SIZE (256 * 1024)
+#define CAPTURE_MAX_QUEUED 256          // Blocks waiting for the capture thread, beyond this writers drop
+#define CAPTURE_JOBS_POLL_MS 1000       // Longest compressed frames wait to be written if a wakeup goes missing
+
+struct capture_block {
+    struct capture_block *next;
+    int fd;
+    int close;                  // Close fd once this block is written
+    uint64_t offset;            // Where in the file data goes
+    size_t len;
+    char data[CAPTURE_BLOCK_SIZE];
+};
+
+int capture_start(const char *file_template, uint64_t max_size, int max_age, int backend, int compress_level);
+int capture_open_pipe(int session_id, const char *leg);
+struct capture_block *capture_block_new(void);
+void capture_block_write(struct capture_block *block);
+void capture_close(int fd);
+void capture_stop(void);
+
+#endif
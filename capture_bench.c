@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "capture.h"
+#include "output.h"
+#include "transcript.h"
+#include "log.h"
+
+/*
+ * Stands in for an event loop with many capturing sessions. Each session gets
+ * a pcap pipe written through stdio, the way libssh writes it, and a
+ * transcript. Reports sustained MB/s, including the final drain to disk, and
+ * how long the loop spent in capture calls per packet.
+ */
+
+#define BENCH_PREFIX "capbench"
+
+struct bench_session {
+    FILE *pcap;
+    transcriptptr transcript;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void remove_files(const char *dir)
+{
+    char path[1024];
+    struct dirent *entry;
+    DIR *d = opendir(dir);
+
+    if (d == NULL) return;
+
+    while ((entry = readdir(d)) != NULL) {
+        if (strncmp(entry->d_name, BENCH_PREFIX, strlen(BENCH_PREFIX)) == 0) {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
+        }
+    }
+
+    closedir(d);
+}
+
+static int run(int backend, const char *dir, int sessions, int megabytes, int record_size, int level)
+{
+    struct bench_session *session;
+    char template[1024], path[1024];
+    char pcap_header[PCAP_HEADER_SIZE] = { 0 };
+    char *record;
+    uint32_t *samples;
+    uint64_t count, i, start, begin, elapsed, bytes, dropped = 0;
+    uint32_t incl_len = record_size - PCAP_RECORD_HEADER_SIZE;
+    int fd, s;
+
+    count = (uint64_t) megabytes * 1024 * 1024 / record_size * sessions;
+
+    session = calloc(sessions, sizeof(struct bench_session));
+    samples = malloc(count * sizeof(uint32_t));
+    record = malloc(record_size);
+    if (session == NULL || samples == NULL || record == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    // Compressible but not trivially so
+    for (i = 0; i < (uint64_t) record_size; i++) record[i] = "ls -l /var/log\n"[i % 15] + (i / 4096);
+    memcpy(record + 8, &incl_len, sizeof(incl_len));
+    memcpy(record + 12, &incl_len, sizeof(incl_len));
+
+    snprintf(template, sizeof(template), "%s/" BENCH_PREFIX ".%%i.%%l.%%n", dir);
+    if (capture_start(template, 0, 0, backend, level) != 0) return -1;
+
+    for (s = 0; s < sessions; s++) {
+        fd = capture_open_pipe(s, "in");
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        session[s].pcap = fopen(path, "wb");
+        close(fd);
+        fwrite(pcap_header, 1, sizeof(pcap_header), session[s].pcap);
+
+        snprintf(path, sizeof(path), "%s/" BENCH_PREFIX "-transcript.%d%s", dir, s, level ? ".zst" : "");
+        unlink(path);
+        session[s].transcript = transcript_open(path, s);
+    }
+
+    begin = now_ns();
+
+    for (i = 0; i < count; i++) {
+        s = i % sessions;
+
+        start = now_ns();
+        fwrite(record, 1, record_size, session[s].pcap);
+        transcript_write(session[s].transcript, TRANSCRIPT_OUT, TRANSCRIPT_DATA, 0,
+            record + PCAP_RECORD_HEADER_SIZE, incl_len);
+        if (s == 0) transcript_service(session[s].transcript);
+        elapsed = now_ns() - start;
+
+        samples[i] = elapsed > UINT32_MAX ? UINT32_MAX : elapsed;
+    }
+
+    for (s = 0; s < sessions; s++) {
+        fclose(session[s].pcap);
+        dropped += session[s].transcript->dropped;
+        transcript_close(session[s].transcript);
+    }
+
+    // Everything is on disk once the capture thread has stopped
+    capture_stop();
+    elapsed = now_ns() - begin;
+
+    // Transcript records are dropped rather than stall the loop, only count what was written
+    bytes = count * record_size + (count - dropped) * (incl_len + sizeof(struct transcript_record));
+    qsort(samples, count, sizeof(uint32_t), compare_u32);
+
+    printf("%-8s  sessions %d  %.1f MB  %.1f MB/s  dropped %.2f%%  loop ns/packet p50 %u p99 %u p99.9 %u max %u\n",
+        output_name(backend), sessions, bytes / 1048576.0, bytes / 1048576.0 / (elapsed / 1e9),
+        100.0 * dropped / count, samples[count / 2], samples[count * 99 / 100], samples[count * 999 / 1000],
+        samples[count - 1]);
+
+    remove_files(dir);
+
+    free(record);
+    free(samples);
+    free(session);
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stdout, "Usage:\n");
+    fprintf(stdout, "%s <args>\n", prog);
+    fprintf(stdout, "Where args are:\n");
+    fprintf(stdout, " -B | --writer <name>      Backend to measure: io_uring, write or both. Default both\n");
+    fprintf(stdout, " -d | --dir <path>         Directory to write to. Default /tmp\n");
+    fprintf(stdout, " -s | --sessions <num>     Number of capturing sessions. Default 64\n");
+    fprintf(stdout, " -m | --megabytes <num>    pcap megabytes per session. Default 16\n");
+    fprintf(stdout, " -r | --record <bytes>     Packet size. Default 1024\n");
+    fprintf(stdout, " -z | --compress <level>   Compress with zstd at this level. Default 0, off\n");
+}
+
+int main(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        {"writer",      required_argument, 0, 'B'},
+        {"dir",         required_argument, 0, 'd'},
+        {"sessions",    required_argument, 0, 's'},
+        {"megabytes",   required_argument, 0, 'm'},
+        {"record",      required_argument, 0, 'r'},
+        {"compress",    required_argument, 0, 'z'},
+        {"help",        no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    const char *writer = "both";
+    const char *dir = "/tmp";
+    int sessions = 64, megabytes = 16, record_size = 1024, level = 0;
+    int c, rc = 0;
+
+    while ((c = getopt_long(argc, argv, "B:d:s:m:r:z:h", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'B': writer = optarg; break;
+        case 'd': dir = optarg; break;
+        case 's': sessions = atoi(optarg); break;
+        case 'm': megabytes = atoi(optarg); break;
+        case 'r': record_size = atoi(optarg); break;
+        case 'z': level = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (sessions < 1 || megabytes < 1 || record_size <= PCAP_RECORD_HEADER_SIZE || record_size > 65536) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Drops are reported in the results
+    log_level = LOG_LEVEL_ERROR;
+    log_start();
+
+    if (strcmp(writer, "write") != 0) {
+        rc |= run(OUTPUT_URING, dir, sessions, megabytes, record_size, level);
+    }
+    if (strcmp(writer, "io_uring") != 0) {
+        rc |= run(OUTPUT_WRITE, dir, sessions, megabytes, record_size, level);
+    }
+
+    log_stop();
+
+    return rc ? 1 : 0;
+}
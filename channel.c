@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libssh/libssh.h>
+
+#include "state.h"
+#include "channel.h"
+#include "in_channel.h"
+#include "out_channel.h"
+#include "log.h"
+
+#define CHANNEL_TABLE_MIN 4
+
+channelptr channel_new(stateptr state)
+{
+    channelptr pair, *grown;
+    uint32_t id, size;
+
+    // Reuse the lowest free slot so ids stay small and the table dense
+    for (id = 0; id < state->channel_size && state->channels[id]; id++);
+
+    if (id == state->channel_size) {
+        size = state->channel_size ? state->channel_size * 2 : CHANNEL_TABLE_MIN;
+
+        grown = realloc(state->channels, size * sizeof(channelptr));
+        if (grown == NULL) {
+            log_error("[%d] Unable to grow channel table", state->id);
+            return NULL;
+        }
+
+        memset(grown + state->channel_size, 0, (size - state->channel_size) * sizeof(channelptr));
+        state->channels = grown;
+        state->channel_size = size;
+    }
+
+    pair = calloc(1, sizeof(struct channel_struct));
+    if (pair == NULL) {
+        log_error("[%d] Unable to allocate channel", state->id);
+        return NULL;
+    }
+
+    pair->state = state;
+    pair->id = id;
+
+    // Data is recorded as the forwarders consume it
+    pair->in_to_out.transcript = state->transcript;
+    pair->in_to_out.direction = TRANSCRIPT_IN;
+    pair->in_to_out.channel = id;
+    pair->out_to_in.transcript = state->transcript;
+    pair->out_to_in.direction = TRANSCRIPT_OUT;
+    pair->out_to_in.channel = id;
+
+    // Latency is kept per connection, not per channel
+    pair->in_to_out.latency = &state->latency[TRANSCRIPT_IN];
+    pair->out_to_in.latency = &state->latency[TRANSCRIPT_OUT];
+    pair->in_to_out.metrics = &state->server->metrics;
+    pair->out_to_in.metrics = &state->server->metrics;
+
+    state->channels[id] = pair;
+    ++state->channel_count;
+    ++state->server->metrics.channels;
+
+    return pair;
+}
+
+void channel_free(channelptr pair)
+{
+    stateptr state = pair->state;
+
+    if (pair->in_channel) {
+        ssh_channel_free(pair->in_channel);
+    }
+
+    if (pair->out_channel) {
+        ssh_channel_free(pair->out_channel);
+    }
+
+    forward_free(&pair->in_to_out);
+    forward_free(&pair->out_to_in);
+
+    state->channels[pair->id] = NULL;
+    --state->channel_count;
+    --state->server->metrics.channels;
+
+    free(pair);
+}
+
+void channel_service(channelptr pair)
+{
+    // Nothing goes to the client until it has accepted the channel
+    if (!in_channel_opened(pair)) return;
+
+    // Pick up any forwarding the wontblock callbacks didn't get to
+    if (pair->out_channel) {
+        forward_resume(&pair->in_to_out, pair->in_channel, pair->out_channel);
+    }
+
+    if (pair->in_channel) {
+        forward_resume(&pair->out_to_in, pair->out_channel, pair->in_channel);
+    }
+
+    // Once one side has closed and what it sent has been passed on, close both
+    if ((pair->in_to_out.close_pending && forward_idle(&pair->in_to_out)) ||
+        (pair->out_to_in.close_pending && forward_idle(&pair->out_to_in))) {
+        destroy_out_channel(pair);
+        destroy_in_channel(pair);
+    }
+
+    if (pair->in_channel == NULL && pair->out_channel == NULL) {
+        channel_free(pair);
+    }
+}
+
+void channels_free(stateptr state)
+{
+    uint32_t id;
+
+    for (id = 0; id < state->channel_size; id++) {
+        if (state->channels[id]) {
+            channel_free(state->channels[id]);
+        }
+    }
+
+    free(state->channels);
+    state->channels = NULL;
+    state->channel_size = 0;
+}
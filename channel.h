@@ -0,0 +1,34 @@
+#include <stdint.h>
+#include <libssh/libssh.h>
+#include <libssh/callbacks.h>
+
+#include "state.h"
+#include "forward.h"
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+// An inbound channel and its upstream twin
+struct channel_struct {
+    stateptr state;
+    uint32_t id;            // Slot in the connection's channel table, also used in the transcript
+
+    ssh_channel in_channel;
+    ssh_channel out_channel;
+    int in_opening;         // Type of the channel opened to the client, until the client answers
+
+    struct forward_struct in_to_out;    // Data from in_channel waiting for out_channel
+    struct forward_struct out_to_in;    // Data from out_channel waiting for in_channel
+
+    // Callback structures must outlive the channels they are set on
+    struct ssh_channel_callbacks_struct in_channel_callbacks;
+    struct ssh_channel_callbacks_struct out_channel_callbacks;
+};
+typedef struct channel_struct *channelptr;
+
+channelptr channel_new(stateptr state);
+void channel_free(channelptr pair);
+void channel_service(channelptr pair);
+void channels_free(stateptr state);
+
+#endif
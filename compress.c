@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+#include "log.h"
+
+static int level = 0;
+static int wake_fd = -1;
+
+static pthread_t compress_thread;
+static int compress_started = 0;
+static int stopping = 0;
+
+// Jobs waiting to be compressed, and compressed jobs waiting to be written, both in order
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+static struct compress_job *queued_head = NULL;
+static struct compress_job **queued_tail = &queued_head;
+static struct compress_job *done_head = NULL;
+static struct compress_job **done_tail = &done_head;
+
+struct compress_job *compress_job_new(int fd)
+{
+    struct compress_job *job;
+
+    job = calloc(1, sizeof(struct compress_job));
+    if (job == NULL) return NULL;
+
+    job->fd = fd;
+
+    return job;
+}
+
+int compress_job_append(struct compress_job *job, const void *data, size_t len)
+{
+    size_t size;
+    char *grown;
+
+    if (job->len + len > job->size) {
+        // Quiet sessions never need the whole frame
+        size = job->size ? job->size : 64 * 1024;
+        while (size < job->len + len) size *= 2;
+
+        grown = realloc(job->data, size);
+        if (grown == NULL) return -1;
+
+        job->data = grown;
+        job->size = size;
+    }
+
+    memcpy(job->data + job->len, data, len);
+    job->len += len;
+
+    return 0;
+}
+
+void compress_job_free(struct compress_job *job)
+{
+    free(job->data);
+    free(job);
+}
+
+void compress_submit(struct compress_job *job)
+{
+    job->next = NULL;
+
+    pthread_mutex_lock(&jobs_lock);
+    *queued_tail = job;
+    queued_tail = &job->next;
+    pthread_cond_signal(&jobs_cond);
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+struct compress_job *compress_done(void)
+{
+    struct compress_job *jobs;
+
+    pthread_mutex_lock(&jobs_lock);
+    jobs = done_head;
+    done_head = NULL;
+    done_tail = &done_head;
+    pthread_mutex_unlock(&jobs_lock);
+
+    return jobs;
+}
+
+#ifdef HAVE_ZSTD
+
+static void compress_job(ZSTD_CCtx *cctx, struct compress_job *job)
+{
+    size_t bound, written;
+    char *frame;
+
+    job->raw_len = 0;
+
+    if (job->len == 0) return;
+
+    bound = ZSTD_compressBound(job->len);
+    frame = malloc(bound);
+    if (frame == NULL) {
+        log_error("Unable to allocate compression buffer, dropping %lu bytes", (unsigned long) job->len);
+        job->len = 0;
+        return;
+    }
+
+    written = ZSTD_compressCCtx(cctx, frame, bound, job->data, job->len, level);
+    if (ZSTD_isError(written)) {
+        log_error("Error compressing capture: %s", ZSTD_getErrorName(written));
+        free(frame);
+        job->len = 0;
+        return;
+    }
+
+    free(job->data);
+    job->raw_len = job->len;
+    job->data = frame;
+    job->len = written;
+    job->size = bound;
+}
+
+static void *compress_main(void *arg)
+{
+    struct compress_job *jobs, *job;
+    ZSTD_CCtx *cctx;
+    uint64_t value = 1;
+
+    (void)arg;
+
+    // One context for every frame, so its tables are only allocated once
+    cctx = ZSTD_createCCtx();
+
+    for (;;) {
+        pthread_mutex_lock(&jobs_lock);
+        while (queued_head == NULL && !stopping) {
+            pthread_cond_wait(&jobs_cond, &jobs_lock);
+        }
+        jobs = queued_head;
+        queued_head = NULL;
+        queued_tail = &queued_head;
+        pthread_mutex_unlock(&jobs_lock);
+
+        if (jobs == NULL) break;
+
+        for (job = jobs; job; job = job->next) {
+            if (cctx) {
+                compress_job(cctx, job);
+            } else {
+                job->len = 0;
+                job->raw_len = 0;
+            }
+        }
+
+        pthread_mutex_lock(&jobs_lock);
+        *done_tail = jobs;
+        for (job = jobs; job->next; job = job->next);
+        done_tail = &job->next;
+        pthread_mutex_unlock(&jobs_lock);
+
+        // Let the capture thread write them
+        // Only fails once the count is too high to add to, when it's readable anyway
+        if (write(wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+            log_error("Unable to wake capture thread: %s", strerror(errno));
+        }
+    }
+
+    ZSTD_freeCCtx(cctx);
+
+    return NULL;
+}
+
+int compress_start(int compress_level, int capture_wake_fd)
+{
+    int rc;
+
+    level = compress_level;
+    wake_fd = capture_wake_fd;
+    stopping = 0;
+
+    rc = pthread_create(&compress_thread, NULL, compress_main, NULL);
+    if (rc != 0) {
+        log_error("Unable to start compression thread: %s", strerror(rc));
+        return -1;
+    }
+
+    compress_started = 1;
+    log_info("Compressing captures with zstd level %d", level);
+
+    return 0;
+}
+
+#else
+
+int compress_start(int compress_level, int capture_wake_fd)
+{
+    level = compress_level;
+    wake_fd = capture_wake_fd;
+
+    log_error("Built without zstd, captures can't be compressed");
+
+    return -1;
+}
+
+#endif
+
+void compress_stop(void)
+{
+    if (!compress_started) return;
+
+    pthread_mutex_lock(&jobs_lock);
+    stopping = 1;
+    pthread_cond_signal(&jobs_cond);
+    pthread_mutex_unlock(&jobs_lock);
+
+    pthread_join(compress_thread, NULL);
+
+    compress_started = 0;
+}
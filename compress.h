@@ -0,0 +1,44 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+/*
+ * Compresses capture output on its own thread. Each job becomes one
+ * independent zstd frame, and the capture thread ends every file with a seek
+ * table in the zstd seekable format:
+ *
+ *   skippable frame magic, frame size
+ *   compressed size, decompressed size     for each frame
+ *   number of frames, descriptor, seekable magic
+ *
+ * so readers can jump to any frame without decompressing what's before it.
+ * Needs building with ZSTD=1.
+ */
+
+#define COMPRESS_FRAME_SIZE (1024 * 1024)       // Raw bytes per frame
+#define COMPRESS_FRAME_SECS 5                   // Longest raw data waits for its frame to fill
+
+#define COMPRESS_SKIPPABLE_MAGIC 0x184D2A5E
+#define COMPRESS_SEEKABLE_MAGIC  0x8F92EAB1
+
+struct compress_job {
+    struct compress_job *next;
+    int fd;
+    int close;                  // Last job for the file
+    char *data;                 // Raw data, the compressed frame once done
+    size_t len;
+    size_t size;                // Allocated
+    uint32_t raw_len;           // Decompressed size of the frame once done
+};
+
+int compress_start(int level, int wake_fd);
+struct compress_job *compress_job_new(int fd);
+int compress_job_append(struct compress_job *job, const void *data, size_t len);
+void compress_submit(struct compress_job *job);
+struct compress_job *compress_done(void);
+void compress_job_free(struct compress_job *job);
+void compress_stop(void);
+
+#endif
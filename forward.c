@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libssh/libssh.h>
+
+#include "forward.h"
+#include "log.h"
+
+static int channel_write(ssh_channel dest, const void *data, uint32_t len, int is_stderr)
+{
+    if (is_stderr) {
+        return ssh_channel_write_stderr(dest, data, len);
+    }
+
+    return ssh_channel_write(dest, data, len);
+}
+
+static void record_latency(struct forward_struct *fwd, uint64_t received)
+{
+    if (fwd->latency) {
+        histogram_record(fwd->latency, histogram_now() - received);
+    }
+}
+
+static int queue_flush(struct forward_struct *fwd, struct forward_queue *queue, ssh_channel dest, int is_stderr)
+{
+    uint32_t window;
+    uint32_t len;
+    int written;
+
+    while (queue->len > 0) {
+        // Never write more than the destination window, libssh would buffer it for us
+        window = ssh_channel_window_size(dest);
+        if (window == 0) break;
+
+        len = (queue->len < window ? queue->len : window);
+
+        written = channel_write(dest, queue->data + queue->start, len, is_stderr);
+        if (written == SSH_ERROR) return SSH_ERROR;
+        if (written == 0) break;
+
+        queue->start += written;
+        queue->len -= written;
+
+        // Timed from the oldest data in the queue, so an upper bound for the rest of what went
+        record_latency(fwd, queue->since);
+    }
+
+    if (queue->len == 0) {
+        queue->start = 0;
+    }
+
+    return SSH_OK;
+}
+
+static char *queue_space(struct forward_queue *queue, uint32_t *room)
+{
+    *room = 0;
+
+    if (queue->data == NULL) {
+        queue->data = malloc(FORWARD_QUEUE_SIZE);
+        if (queue->data == NULL) {
+            log_error("Unable to allocate forwarding queue");
+            return NULL;
+        }
+    }
+
+    // Move queued data to the front if it is in the way
+    if (queue->start > 0 && queue->start + queue->len == FORWARD_QUEUE_SIZE) {
+        memmove(queue->data, queue->data + queue->start, queue->len);
+        queue->start = 0;
+    }
+
+    *room = FORWARD_QUEUE_SIZE - (queue->start + queue->len);
+
+    return queue->data + queue->start + queue->len;
+}
+
+static uint32_t queue_append(struct forward_queue *queue, const char *data, uint32_t len)
+{
+    char *tail;
+    uint32_t room;
+
+    if (len == 0) return 0;
+
+    tail = queue_space(queue, &room);
+    if (tail == NULL) return 0;
+
+    if (len > room) len = room;
+
+    memcpy(tail, data, len);
+    queue->len += len;
+
+    return len;
+}
+
+static void record(struct forward_struct *fwd, const void *data, uint32_t len, int is_stderr)
+{
+    if (len > 0) {
+        if (fwd->metrics) fwd->metrics->bytes[fwd->direction][is_stderr ? 1 : 0] += len;
+
+        transcript_write(fwd->transcript, fwd->direction, (is_stderr ? TRANSCRIPT_STDERR : TRANSCRIPT_DATA),
+            fwd->channel, data, len);
+    }
+}
+
+static int queue_pull(struct forward_struct *fwd, struct forward_queue *queue, ssh_channel src, int is_stderr)
+{
+    char *tail;
+    uint32_t room;
+    int buffered;
+    int avail;
+    int got;
+
+    if (!queue->pending || src == NULL) return SSH_OK;
+
+    // libssh's buffer isn't empty, so this doesn't touch the socket
+    buffered = ssh_channel_poll(src, is_stderr);
+    if (buffered == SSH_ERROR) return SSH_ERROR;
+
+    if (buffered <= 0) {
+        queue->pending = 0;
+        return SSH_OK;
+    }
+
+    tail = queue_space(queue, &room);
+    if (tail == NULL || room == 0) return SSH_OK;
+
+    avail = buffered;
+    if ((uint32_t) avail > room) avail = room;
+
+    // Reading from the buffer reopens the source window
+    got = ssh_channel_read(src, tail, avail, is_stderr);
+    if (got == SSH_ERROR) return SSH_ERROR;
+
+    record(fwd, tail, got, is_stderr);
+    if (queue->len == 0) queue->since = queue->pending_since;
+    queue->len += got;
+
+    // Polling an empty buffer would read the socket, so work it out from what we took
+    if (got >= buffered) {
+        queue->pending = 0;
+    }
+
+    return SSH_OK;
+}
+
+int forward_data(struct forward_struct *fwd, ssh_channel dest, void *data, uint32_t len, int is_stderr)
+{
+    struct forward_queue *queue = (is_stderr ? &fwd->stderr_queue : &fwd->stdout_queue);
+    uint64_t received = histogram_now();
+    uint32_t window;
+    uint32_t consumed = 0;
+    int written;
+
+    if (dest == NULL) return SSH_ERROR;
+
+    // Data libssh held on to was received when it was first offered
+    if (queue->pending) received = queue->pending_since;
+
+    // Anything already queued goes first
+    if (queue_flush(fwd, queue, dest, is_stderr) != SSH_OK) return SSH_ERROR;
+
+    if (queue->len == 0) {
+        window = ssh_channel_window_size(dest);
+
+        if (window > 0) {
+            written = channel_write(dest, data, (len < window ? len : window), is_stderr);
+            if (written == SSH_ERROR) return SSH_ERROR;
+
+            consumed = written;
+            if (written > 0) record_latency(fwd, received);
+        }
+    }
+
+    // Queue what we can of the rest. Anything left over stays with libssh and holds the source window shut
+    if (consumed < len) {
+        if (fwd->metrics) ++fwd->metrics->short_writes[fwd->direction];
+        if (queue->len == 0) queue->since = received;
+        consumed += queue_append(queue, (char *) data + consumed, len - consumed);
+    }
+
+    if (consumed < len && !queue->pending) queue->pending_since = received;
+    queue->pending = (consumed < len);
+
+    record(fwd, data, consumed, is_stderr);
+
+    return consumed;
+}
+
+int forward_resume(struct forward_struct *fwd, ssh_channel src, ssh_channel dest)
+{
+    if (dest == NULL) return SSH_ERROR;
+
+    if (queue_flush(fwd, &fwd->stdout_queue, dest, 0) != SSH_OK ||
+        queue_pull(fwd, &fwd->stdout_queue, src, 0) != SSH_OK ||
+        queue_flush(fwd, &fwd->stdout_queue, dest, 0) != SSH_OK) {
+        return SSH_ERROR;
+    }
+
+    if (queue_flush(fwd, &fwd->stderr_queue, dest, 1) != SSH_OK ||
+        queue_pull(fwd, &fwd->stderr_queue, src, 1) != SSH_OK ||
+        queue_flush(fwd, &fwd->stderr_queue, dest, 1) != SSH_OK) {
+        return SSH_ERROR;
+    }
+
+    // Deliver a held back EOF once everything before it has gone
+    if (fwd->eof_pending && forward_idle(fwd)) {
+        fwd->eof_pending = 0;
+        ssh_channel_send_eof(dest);
+    }
+
+    return SSH_OK;
+}
+
+void forward_eof(struct forward_struct *fwd, ssh_channel dest)
+{
+    if (forward_idle(fwd)) {
+        ssh_channel_send_eof(dest);
+    } else {
+        fwd->eof_pending = 1;
+    }
+}
+
+int forward_idle(struct forward_struct *fwd)
+{
+    return (fwd->stdout_queue.len == 0 && !fwd->stdout_queue.pending &&
+            fwd->stderr_queue.len == 0 && !fwd->stderr_queue.pending);
+}
+
+void forward_free(struct forward_struct *fwd)
+{
+    free(fwd->stdout_queue.data);
+    free(fwd->stderr_queue.data);
+
+    memset(fwd, 0, sizeof(struct forward_struct));
+}
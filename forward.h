@@ -0,0 +1,43 @@
+#include <stdint.h>
+#include <libssh/libssh.h>
+
+#include "transcript.h"
+#include "histogram.h"
+#include "metrics.h"
+
+#ifndef FORWARD_H
+#define FORWARD_H
+
+#define FORWARD_QUEUE_SIZE (64 * 1024)
+
+struct forward_queue {
+    char *data;             // Allocated on first use, interactive sessions never need it
+    uint32_t start;
+    uint32_t len;
+    int pending;            // Data left unconsumed in libssh's buffer for the source channel
+    uint64_t since;         // When the oldest queued data was received
+    uint64_t pending_since; // When the oldest data left with libssh was received
+};
+
+// One direction of a channel pair
+struct forward_struct {
+    struct forward_queue stdout_queue;
+    struct forward_queue stderr_queue;
+    int eof_pending;        // EOF received but queued data still to be sent
+    int close_pending;      // Source closed but queued data still to be sent
+
+    transcriptptr transcript;   // Where consumed data is recorded, if anywhere
+    int direction;
+    uint32_t channel;
+
+    struct histogram *latency;  // Receive to sent on the other leg, per chunk, if anywhere
+    metricsptr metrics;         // Worker counters for bytes and short writes, if any
+};
+
+int forward_data(struct forward_struct *fwd, ssh_channel dest, void *data, uint32_t len, int is_stderr);
+int forward_resume(struct forward_struct *fwd, ssh_channel src, ssh_channel dest);
+void forward_eof(struct forward_struct *fwd, ssh_channel dest);
+int forward_idle(struct forward_struct *fwd);
+void forward_free(struct forward_struct *fwd);
+
+#endif
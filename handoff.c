@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "handoff.h"
+#include "log.h"
+
+#define SD_LISTEN_FDS_START 3
+
+// Our control socket, so we never unlink one our replacement has bound since
+static char *socket_path = NULL;
+static dev_t socket_dev;
+static ino_t socket_ino;
+
+static int set_address(struct sockaddr_un *addr, const char *path)
+{
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        log_error("Handoff socket path %s is too long", path);
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+int handoff_receive(const char *path, int *fds, int max, int *conn)
+{
+    struct sockaddr_un addr;
+    struct timeval timeout = { HANDOFF_TIMEOUT_SECS, 0 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char more = 1;
+    int fd, i, n, extra, received, count = 0;
+
+    *conn = -1;
+
+    if (set_address(&addr, path) != 0) return -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("Unable to create handoff socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        // Nobody to take over from, the usual first start
+        log_info("No running sshdump at %s to take over from: %s", path, strerror(errno));
+        close(fd);
+        return 0;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // One byte per batch, zero on the last
+    while (more) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &more;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            log_error("Error receiving listen sockets from %s: %s", path, n < 0 ? strerror(errno) : "closed early");
+            break;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+            received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (i = 0; i < received; i++) {
+                if (count < max) {
+                    memcpy(&fds[count++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                } else {
+                    // More than LISTENER_MAX, their queues are lost
+                    memcpy(&extra, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                    close(extra);
+                }
+            }
+        }
+    }
+
+    if (more) {
+        // A partial set would leave some of the old workers' queues unserved
+        for (i = 0; i < count; i++) close(fds[i]);
+        close(fd);
+        return -1;
+    }
+
+    log_info("Took over %d listen sockets from %s", count, path);
+
+    // The old process keeps accepting until handoff_ack
+    *conn = fd;
+
+    return count;
+}
+
+void handoff_ack(int conn)
+{
+    char ack = 1;
+
+    if (conn < 0) return;
+
+    if (send(conn, &ack, 1, MSG_NOSIGNAL) != 1) {
+        log_error("Unable to tell the old process to drain: %s", strerror(errno));
+    }
+
+    close(conn);
+}
+
+int handoff_systemd(int *fds, int max)
+{
+    const char *pid = getenv("LISTEN_PID");
+    const char *listen_fds = getenv("LISTEN_FDS");
+    int i, count;
+
+    if (pid == NULL || listen_fds == NULL || atoi(pid) != getpid()) return 0;
+
+    count = atoi(listen_fds);
+    if (count > max) {
+        log_warn("Only using %d of the %d sockets from systemd", max, count);
+        count = max;
+    }
+
+    for (i = 0; i < count; i++) {
+        fds[i] = SD_LISTEN_FDS_START + i;
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    }
+
+    // Not for anything we might start
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    if (count > 0) log_info("Using %d listen sockets from systemd", count);
+
+    return count < 0 ? 0 : count;
+}
+
+int handoff_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if (set_address(&addr, path) != 0) return -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("Unable to create handoff socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // Whoever we took over from keeps their socket, the path is ours now
+    unlink(path);
+
+    // Anyone who can connect can take the listen sockets, so only our user
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || chmod(path, 0600) != 0 ||
+            listen(fd, 1) != 0 || stat(path, &st) != 0) {
+        log_error("Unable to listen on handoff socket %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    socket_path = strdup(path);
+    socket_dev = st.st_dev;
+    socket_ino = st.st_ino;
+
+    log_info("Listen sockets can be taken over at %s", path);
+
+    return fd;
+}
+
+int handoff_send(int listen_fd, const int *fds, int count)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char more;
+    int fd, batch, sent = 0, rc = -1;
+
+    fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            log_error("Error accepting a handoff connection: %s", strerror(errno));
+        }
+        return -1;
+    }
+
+    do {
+        batch = count - sent > HANDOFF_BATCH ? HANDOFF_BATCH : count - sent;
+        more = sent + batch < count;
+
+        memset(&msg, 0, sizeof(msg));
+        memset(&control, 0, sizeof(control));
+        iov.iov_base = &more;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        if (batch > 0) {
+            msg.msg_control = control.buf;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * batch);
+
+            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * batch);
+            memcpy(CMSG_DATA(cmsg), fds + sent, sizeof(int) * batch);
+        }
+
+        // Small enough for the socket buffer, so this never blocks for long
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1) {
+            log_error("Error sending listen sockets: %s", strerror(errno));
+            break;
+        }
+
+        sent += batch;
+        if (!more) rc = 0;
+    } while (more);
+
+    if (rc != 0) {
+        close(fd);
+        return -1;
+    }
+
+    log_info("Handed over %d listen sockets, waiting for the new process to start", count);
+
+    return fd;
+}
+
+int handoff_acked(int conn)
+{
+    char ack;
+    int n;
+
+    n = recv(conn, &ack, 1, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return -1;
+
+    // Closed without a word, it didn't start
+    return n == 1 && ack == 1;
+}
+
+void handoff_cleanup(int listen_fd)
+{
+    struct stat st;
+
+    if (listen_fd >= 0) close(listen_fd);
+
+    if (socket_path == NULL) return;
+
+    // Only remove the path if a replacement hasn't bound it since
+    if (stat(socket_path, &st) == 0 && st.st_dev == socket_dev && st.st_ino == socket_ino) {
+        unlink(socket_path);
+    }
+
+    free(socket_path);
+    socket_path = NULL;
+}
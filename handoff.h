@@ -0,0 +1,28 @@
+/*
+ * Passes listening sockets from a running sshdump to its replacement, so a
+ * restart never refuses a connection. The old process serves a Unix socket,
+ * the new one connects to it at startup and is sent every worker's listen
+ * socket over SCM_RIGHTS. Connections queued on them wait for the new
+ * process to accept them. Every socket is polled by one of the new workers,
+ * several each if the new process runs fewer workers than the old one. Once the new process is up it acknowledges, and
+ * the old one drains: it stops accepting and exits once its sessions have
+ * ended, or the drain deadline passes. If the new process dies before
+ * acknowledging, the old one carries on as if nothing happened.
+ *
+ * Sockets from systemd socket activation (LISTEN_FDS) are adopted the same
+ * way, with SIGUSR2 telling the old process to drain.
+ */
+
+#define HANDOFF_TIMEOUT_SECS 5      // Longest the new process waits for the old one to send its sockets
+#define HANDOFF_BATCH 64            // Sockets per message, well under the kernel's SCM_MAX_FD
+
+// New process
+int handoff_receive(const char *path, int *fds, int max, int *conn);
+void handoff_ack(int conn);
+int handoff_systemd(int *fds, int max);
+
+// Old process
+int handoff_listen(const char *path);
+int handoff_send(int listen_fd, const int *fds, int count);
+int handoff_acked(int conn);
+void handoff_cleanup(int listen_fd);
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "histogram.h"
+#include "log.h"
+
+#define SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HALF_COUNT (1 << (HISTOGRAM_SUB_BITS - 1))
+#define MAX_VALUE ((1ULL << HISTOGRAM_MAX_BITS) - 1)
+
+uint64_t histogram_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int bucket_index(uint64_t value)
+{
+    int shift;
+
+    if (value < SUB_COUNT) return (int) value;
+
+    // Keep the top HISTOGRAM_SUB_BITS bits, the leading one picks the power of two
+    shift = 63 - __builtin_clzll(value) - (HISTOGRAM_SUB_BITS - 1);
+
+    return SUB_COUNT + (shift - 1) * HALF_COUNT + (int) (value >> shift) - HALF_COUNT;
+}
+
+// Largest value that lands in the bucket
+static uint64_t bucket_value(int index)
+{
+    int shift;
+    uint64_t top;
+
+    if (index < SUB_COUNT) return index;
+
+    shift = (index - SUB_COUNT) / HALF_COUNT + 1;
+    top = (index - SUB_COUNT) % HALF_COUNT + HALF_COUNT;
+
+    return ((top + 1) << shift) - 1;
+}
+
+void histogram_record(struct histogram *histogram, uint64_t value)
+{
+    if (value > MAX_VALUE) value = MAX_VALUE;
+
+    ++histogram->buckets[bucket_index(value)];
+    ++histogram->count;
+    histogram->sum += value;
+
+    if (value > histogram->max) histogram->max = value;
+}
+
+void histogram_add(struct histogram *to, const struct histogram *from)
+{
+    int i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        to->buckets[i] += from->buckets[i];
+    }
+
+    to->count += from->count;
+    to->sum += from->sum;
+
+    if (from->max > to->max) to->max = from->max;
+}
+
+uint64_t histogram_percentile(const struct histogram *histogram, double percentile)
+{
+    uint64_t target, seen = 0;
+    uint64_t value;
+    int i;
+
+    if (histogram->count == 0) return 0;
+
+    target = (uint64_t) (percentile / 100.0 * histogram->count + 0.5);
+    if (target < 1) target = 1;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+
+        if (seen >= target) {
+            // Bucket tops can overshoot what was actually recorded
+            value = bucket_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+void histogram_log(const struct histogram *histogram, const char *name)
+{
+    if (histogram->count == 0) return;
+
+    log_info("%s latency: %llu chunks, mean %.1fus, p50 %.1fus, p90 %.1fus, p99 %.1fus, p99.9 %.1fus, "
+        "max %.1fus", name, (unsigned long long) histogram->count,
+        histogram->sum / 1000.0 / histogram->count,
+        histogram_percentile(histogram, 50) / 1000.0,
+        histogram_percentile(histogram, 90) / 1000.0,
+        histogram_percentile(histogram, 99) / 1000.0,
+        histogram_percentile(histogram, 99.9) / 1000.0,
+        histogram->max / 1000.0);
+}
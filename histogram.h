@@ -0,0 +1,32 @@
+#include <stdint.h>
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+/*
+ * Log-linear latency histogram in the style of HdrHistogram. Values below
+ * 2^HISTOGRAM_SUB_BITS nanoseconds get a bucket each, above that every power
+ * of two is split into 2^(HISTOGRAM_SUB_BITS - 1) buckets, so any recorded
+ * value is known to within about 3%. Fixed size, recording never allocates,
+ * and each histogram belongs to one worker thread so it needs no locking.
+ */
+
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_MAX_BITS 40       // Values are clamped to 2^40ns, about 18 minutes
+#define HISTOGRAM_BUCKETS ((1 << HISTOGRAM_SUB_BITS) + \
+    (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS) * (1 << (HISTOGRAM_SUB_BITS - 1)))
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+};
+
+uint64_t histogram_now(void);
+void histogram_record(struct histogram *histogram, uint64_t value);
+void histogram_add(struct histogram *to, const struct histogram *from);
+uint64_t histogram_percentile(const struct histogram *histogram, double percentile);
+void histogram_log(const struct histogram *histogram, const char *name);
+
+#endif
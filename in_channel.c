@@ -4,27 +4,33 @@
 #include <libssh/callbacks.h>
 
 #include "state.h"
+#include "channel.h"
 #include "out_channel.h"
 #include "in_channel.h"
+#include "session.h"
+#include "index.h"
+#include "log.h"
 
 int in_data (ssh_session session, ssh_channel channel, void *data, uint32_t len, int is_stderr, void *userdata)
 {
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
     int fwlen;
 
-    fprintf(stdout, "in_data callback called with %d bytes (stderr %d)\n", len, is_stderr);
+    log_debug("in_data callback called with %d bytes (stderr %d)", len, is_stderr);
 
-    // Forward data to out channel
-    if (is_stderr) {
-        fwlen = ssh_channel_write_stderr(state->out_channel, data, len);
-    } else {
-        fwlen = ssh_channel_write(state->out_channel, data, len);
+    // Forward data to out channel, consuming only what it or the queue can take
+    fwlen = forward_data(&pair->in_to_out, pair->out_channel, data, len, is_stderr);
+
+    if (fwlen == SSH_ERROR) {
+        // Nowhere to send it, so drop it rather than let it pile up
+        log_error("in_data callback unable to forward data");
+        fwlen = len;
     }
 
-    fprintf(stdout, "in_data callback wrote %d bytes\n", fwlen);
+    log_debug("in_data callback consumed %d bytes", fwlen);
 
     return fwlen;
 }
@@ -34,12 +40,14 @@ void in_eof (ssh_session session, ssh_channel channel, void *userdata)
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
 
-    fprintf(stdout, "in_eof callback called\n");
+    log_info("in_eof callback called");
 
-    // Forward eof to out channel
-    ssh_channel_send_eof(state->out_channel);
+    transcript_write(pair->state->transcript, TRANSCRIPT_IN, TRANSCRIPT_EOF, pair->id, NULL, 0);
+
+    // Forward eof to out channel once queued data has gone
+    forward_eof(&pair->in_to_out, pair->out_channel);
 }
 
 void in_close (ssh_session session, ssh_channel channel, void *userdata)
@@ -47,12 +55,15 @@ void in_close (ssh_session session, ssh_channel channel, void *userdata)
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
+
+    log_info("in_close callback called");
 
-    fprintf(stdout, "in_close callback called\n");
+    transcript_write(pair->state->transcript, TRANSCRIPT_IN, TRANSCRIPT_CLOSE, pair->id, NULL, 0);
 
-    // Close out channel
-    destroy_out_channel(state);
+    // Close the pair from channel_service once data queued for the out channel has gone, closing it
+    // here would free channels libssh is still using
+    pair->in_to_out.close_pending = 1;
 }
 
 void in_signal (ssh_session session, ssh_channel channel, const char *signal, void *userdata)
@@ -60,12 +71,14 @@ void in_signal (ssh_session session, ssh_channel channel, const char *signal, vo
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
 
-    fprintf(stdout, "in_signal callback called with signal %s\n", signal);
+    log_info("in_signal callback called with signal %s", signal);
+
+    transcript_text(pair->state->transcript, TRANSCRIPT_IN, TRANSCRIPT_SIGNAL, pair->id, signal, "%s", "");
 
     // Forward to out channel
-    ssh_channel_request_send_signal(state->out_channel, signal);
+    ssh_channel_request_send_signal(pair->out_channel, signal);
 }
 
 void in_exit_status (ssh_session session, ssh_channel channel, int exit_status, void *userdata)
@@ -73,12 +86,14 @@ void in_exit_status (ssh_session session, ssh_channel channel, int exit_status,
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
+
+    log_info("in_exit_status callback called with status %d", exit_status);
 
-    fprintf(stdout, "in_exit_status callback called with status %d\n", exit_status);
+    transcript_text(pair->state->transcript, TRANSCRIPT_IN, TRANSCRIPT_EXIT_STATUS, pair->id, "exit-status", "%d", exit_status);
 
     // Forward to out channel
-    ssh_channel_request_send_exit_status(state->out_channel, exit_status);
+    ssh_channel_request_send_exit_status(pair->out_channel, exit_status);
 }
 
 void in_exit_signal (ssh_session session, ssh_channel channel, const char *signal, int core, const char *errmsg,
@@ -87,13 +102,16 @@ void in_exit_signal (ssh_session session, ssh_channel channel, const char *signa
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
 
-    fprintf(stdout, "in_exit_signal callback called with signal %s, core %d, error %s, lang %s\n",
+    log_info("in_exit_signal callback called with signal %s, core %d, error %s, lang %s",
         signal, core, errmsg, lang);
 
+    transcript_text(pair->state->transcript, TRANSCRIPT_IN, TRANSCRIPT_EXIT_SIGNAL, pair->id, signal, "core %d, error %s, lang %s",
+        core, errmsg, lang);
+
     // Forward to out channel
-    ssh_channel_request_send_exit_signal(state->out_channel, signal, core, errmsg, lang);
+    ssh_channel_request_send_exit_signal(pair->out_channel, signal, core, errmsg, lang);
 }
 
 int in_pty_request (ssh_session session, ssh_channel channel, const char *term, int width, int height,
@@ -102,17 +120,20 @@ int in_pty_request (ssh_session session, ssh_channel channel, const char *term,
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
     int rc = -1;
 
-    fprintf(stdout, "in_pty_request_callback callback called with term %s, char dim %dx%d, px dim %dx%d\n",
+    log_info("in_pty_request_callback callback called with term %s, char dim %dx%d, px dim %dx%d",
+        term, width, height, pxwidth, pxheight);
+
+    transcript_text(pair->state->transcript, TRANSCRIPT_IN, TRANSCRIPT_REQUEST, pair->id, "pty-req", "%s %dx%d %dx%d",
         term, width, height, pxwidth, pxheight);
 
-    if (ssh_channel_request_pty_size(state->out_channel, term, width, height) == SSH_OK){
+    if (ssh_channel_request_pty_size(pair->out_channel, term, width, height) == SSH_OK){
         rc = 0;
     }
 
-    fprintf(stdout, "in_pty_window_change returning %d\n", rc);
+    log_info("in_pty_window_change returning %d", rc);
 
     return rc;
 }
@@ -122,16 +143,19 @@ int in_shell_request (ssh_session session, ssh_channel channel, void *userdata)
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
     int rc = 1;
 
-    fprintf(stdout, "in_shell_request callback called\n");
+    log_info("in_shell_request callback called");
+
+    transcript_text(pair->state->transcript, TRANSCRIPT_IN, TRANSCRIPT_REQUEST, pair->id, "shell", "%s", "");
+    index_event(pair->state, INDEX_SHELL, "");
 
-    if (ssh_channel_request_shell(state->out_channel) == SSH_OK) {
+    if (ssh_channel_request_shell(pair->out_channel) == SSH_OK) {
         rc = 0;
     }
 
-    fprintf(stdout, "in_shell_request returning %d\n", rc);
+    log_info("in_shell_request returning %d", rc);
 
     return rc;
 }
@@ -141,12 +165,14 @@ void in_auth_agent_req (ssh_session session, ssh_channel channel, void *userdata
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
 
-    fprintf(stdout, "in_auth_agent_req callback called\n");
+    log_info("in_auth_agent_req callback called");
+
+    transcript_text(pair->state->transcript, TRANSCRIPT_IN, TRANSCRIPT_REQUEST, pair->id, "auth-agent-req", "%s", "");
 
     // Forward to out channel
-    ssh_channel_request_auth_agent(state->out_channel);
+    ssh_channel_request_auth_agent(pair->out_channel);
 }
 
 void in_x11_req (ssh_session session, ssh_channel channel, int single_connection, const char *auth_protocol,
@@ -155,13 +181,16 @@ void in_x11_req (ssh_session session, ssh_channel channel, int single_connection
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
 
-    fprintf(stdout, "in_x11_req callback called, single_connection %d, auth protocol %s, auth cookie %s, screen %d\n",
+    log_info("in_x11_req callback called, single_connection %d, auth protocol %s, auth cookie %s, screen %d",
         single_connection, auth_protocol, auth_cookie, screen_number);
 
+    transcript_text(pair->state->transcript, TRANSCRIPT_IN, TRANSCRIPT_REQUEST, pair->id, "x11-req", "%d %s %d",
+        single_connection, auth_protocol, screen_number);
+
     // Forward to out channel
-    ssh_channel_request_x11(state->out_channel, single_connection, auth_protocol, auth_cookie, screen_number);
+    ssh_channel_request_x11(pair->out_channel, single_connection, auth_protocol, auth_cookie, screen_number);
 }
 
 int in_pty_window_change (ssh_session session, ssh_channel channel, int width, int height, int pxwidth, int pxheight,
@@ -170,17 +199,20 @@ int in_pty_window_change (ssh_session session, ssh_channel channel, int width, i
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
     int rc = -1;
 
-    fprintf(stdout, "in_pty_window_change callback called with char dim %dx%d, px dim %dx%d\n",
+    log_info("in_pty_window_change callback called with char dim %dx%d, px dim %dx%d",
         width, height, pxwidth, pxheight);
 
-    if (ssh_channel_change_pty_size (state->out_channel, width, height) == SSH_OK){
+    transcript_text(pair->state->transcript, TRANSCRIPT_IN, TRANSCRIPT_REQUEST, pair->id, "window-change", "%dx%d %dx%d",
+        width, height, pxwidth, pxheight);
+
+    if (ssh_channel_change_pty_size (pair->out_channel, width, height) == SSH_OK){
         rc = 0;
     }
 
-    fprintf(stdout, "in_pty_window_change callback returning %d\n", rc);
+    log_info("in_pty_window_change callback returning %d", rc);
 
     return rc;
 }
@@ -190,13 +222,16 @@ int in_exec_request (ssh_session session, ssh_channel channel, const char *comma
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
     int rc = 1;
 
-    fprintf(stdout, "in_exec_request callback called, command %s\n", command);
+    log_info("in_exec_request callback called, command %s", command);
+
+    transcript_text(pair->state->transcript, TRANSCRIPT_IN, TRANSCRIPT_REQUEST, pair->id, "exec", "%s", command);
+    index_event(pair->state, INDEX_EXEC, command);
 
     // Forward to out channel
-    if (ssh_channel_request_exec(state->out_channel, command) ==  SSH_OK) {
+    if (ssh_channel_request_exec(pair->out_channel, command) ==  SSH_OK) {
         rc = 0;
     }
 
@@ -208,16 +243,22 @@ int in_env_request (ssh_session session, ssh_channel channel, const char *env_na
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
     int rc = 1;
+    char pair_text[1024];
+
+    log_info("in_env_request callback called, %s = '%s'", env_name, env_value);
 
-    fprintf(stdout, "in_env_request callback called, %s = '%s'\n", env_name, env_value);
+    transcript_text(pair->state->transcript, TRANSCRIPT_IN, TRANSCRIPT_REQUEST, pair->id, "env", "%s=%s", env_name, env_value);
 
-    if (ssh_channel_request_env(state->out_channel, env_name, env_value) == SSH_OK) {
+    snprintf(pair_text, sizeof(pair_text), "%s=%s", env_name, env_value);
+    index_event(pair->state, INDEX_ENV, pair_text);
+
+    if (ssh_channel_request_env(pair->out_channel, env_name, env_value) == SSH_OK) {
         rc = 0;
     }
 
-    fprintf(stdout, "in_env_request callback returning %d\n", rc);
+    log_info("in_env_request callback returning %d", rc);
 
     return rc;
 }
@@ -227,17 +268,20 @@ int in_subsystem_request (ssh_session session, ssh_channel channel, const char *
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
     int rc = 1;
 
-    fprintf(stdout, "in_subsystem_request callback called for %s\n", subsystem);
+    log_info("in_subsystem_request callback called for %s", subsystem);
+
+    transcript_text(pair->state->transcript, TRANSCRIPT_IN, TRANSCRIPT_REQUEST, pair->id, "subsystem", "%s", subsystem);
+    index_event(pair->state, INDEX_SUBSYSTEM, subsystem);
 
     // Forward to out channel
-    if (ssh_channel_request_subsystem(state->out_channel, subsystem) == SSH_OK) {
+    if (ssh_channel_request_subsystem(pair->out_channel, subsystem) == SSH_OK) {
         rc = 0;
     }
 
-    fprintf(stdout, "in_subsystem_request callback returning %d\n", rc);
+    log_info("in_subsystem_request callback returning %d", rc);
 
     return rc;
 }
@@ -248,9 +292,13 @@ int in_write_wontblock (ssh_session session, ssh_channel channel, uint32_t bytes
 {
     (void)session;
     (void)channel;
-    (void)userdata;
 
-    fprintf(stdout, "in_write_wontblock callback called with bytes = %d\n", bytes);
+    channelptr pair = (channelptr) userdata;
+
+    log_debug("in_write_wontblock callback called with bytes = %d", bytes);
+
+    // In channel has window again, drain anything held back from the out channel
+    forward_resume(&pair->out_to_in, pair->out_channel, pair->in_channel);
 
     return 0;
 }
@@ -261,16 +309,20 @@ int in_write_wontblock (ssh_session session, ssh_channel channel, size_t bytes,
 {
     (void)session;
     (void)channel;
-    (void)userdata;
 
-    fprintf(stdout, "in_write_wontblock callback called with bytes = %ld\n", bytes);
+    channelptr pair = (channelptr) userdata;
+
+    log_debug("in_write_wontblock callback called with bytes = %ld", bytes);
+
+    // In channel has window again, drain anything held back from the out channel
+    forward_resume(&pair->out_to_in, pair->out_channel, pair->in_channel);
 
     return 0;
 }
 
 #endif
 
-struct ssh_channel_callbacks_struct in_channel_callbacks = {
+static const struct ssh_channel_callbacks_struct in_channel_callbacks = {
     .channel_data_function = in_data,
     .channel_eof_function = in_eof,
     .channel_close_function = in_close,
@@ -288,40 +340,123 @@ struct ssh_channel_callbacks_struct in_channel_callbacks = {
     .channel_write_wontblock_function = in_write_wontblock
 };
 
-ssh_channel create_in_channel(stateptr state)
+void set_in_channel(channelptr pair, ssh_channel channel)
 {
-    ssh_channel channel = NULL;
+    // Initialise this channel's copy of the callbacks struct
+    pair->in_channel_callbacks = in_channel_callbacks;
+    ssh_callbacks_init(&pair->in_channel_callbacks);
+    pair->in_channel_callbacks.userdata = pair;
 
-    // Initialise the callbacks struct
-    ssh_callbacks_init(&in_channel_callbacks);
-    in_channel_callbacks.userdata = state;
+    // Set callbacks
+    ssh_set_channel_callbacks(channel, &pair->in_channel_callbacks);
 
-    // Create the new channel
-    channel = ssh_channel_new(state->in_session);
-    if (channel == NULL) {
-        fprintf(stderr, "Failed to create inbound channel\n");
+    // Set channel in pair
+    pair->in_channel = channel;
+}
+
+ssh_channel create_in_channel(channelptr pair)
+{
+    ssh_channel channel = NULL;
 
+    // Create the new channel, libssh opens it once the callback returns it
+    channel = ssh_channel_new(pair->state->in_session);
+    if (channel == NULL) {
+        log_error("Failed to create inbound channel");
     } else {
-        // Set callbacks
-        ssh_set_channel_callbacks(channel, &in_channel_callbacks);
+        set_in_channel(pair, channel);
+    }
 
-        // Set channel in state
-        state->in_channel = channel;
+    return channel;
+}
 
+// Sends the open of a channel to the client, or picks up its answer. SSH_AGAIN until it has one
+static int send_in_open(channelptr pair, const char *host, int port, const char *orig_host, int orig_port)
+{
+    // The inbound session doesn't block, and libssh only sends the arguments the first time
+    switch (pair->in_opening) {
+    case SSH_CHANNEL_FORWARDED_TCPIP:
+        return ssh_channel_open_reverse_forward(pair->in_channel, host, port, orig_host, orig_port);
+    case SSH_CHANNEL_X11:
+        return ssh_channel_open_x11(pair->in_channel, orig_host, orig_port);
+    case SSH_CHANNEL_AUTH_AGENT:
+        return ssh_channel_open_auth_agent(pair->in_channel);
+    default:
+        return SSH_ERROR;
     }
+}
 
-    return channel;
+static void in_open_refused(channelptr pair)
+{
+    log_error("open_in_channel: client refused channel of type %d: %s", pair->in_opening,
+        ssh_get_error(pair->state->in_session));
+
+    pair->in_opening = 0;
+    destroy_in_channel(pair);
+}
+
+// Opens a channel towards the client for one the upstream opened. The upstream is told yes without waiting
+// for the client, in_channel_opened picks up its answer from the event loop
+static ssh_channel open_in_channel(channelptr pair, int type, const char *host, int port, const char *orig_host,
+    int orig_port)
+{
+    int rc;
+
+    if (create_in_channel(pair) == NULL) return NULL;
+
+    pair->in_opening = type;
+    rc = send_in_open(pair, host ? host : "", port, orig_host ? orig_host : "", orig_port);
+
+    if (rc == SSH_OK) {
+        pair->in_opening = 0;
+    } else if (rc != SSH_AGAIN) {
+        in_open_refused(pair);
+    }
+
+    return pair->in_channel;
+}
+
+// 1 once the client has answered the open, after which the pair may have lost its inbound channel
+int in_channel_opened(channelptr pair)
+{
+    int rc;
+
+    if (!pair->in_opening) return 1;
+
+    rc = send_in_open(pair, "", 0, "", 0);
+    if (rc == SSH_AGAIN) return 0;
+
+    if (rc == SSH_OK) {
+        pair->in_opening = 0;
+    } else {
+        // The upstream was told yes, so close its side instead
+        in_open_refused(pair);
+        transcript_write(pair->state->transcript, TRANSCRIPT_IN, TRANSCRIPT_CLOSE, pair->id, NULL, 0);
+        destroy_out_channel(pair);
+    }
+
+    return 1;
+}
+
+ssh_channel create_in_forward(channelptr pair, const char *host, int port, const char *orig_host, int orig_port)
+{
+    return open_in_channel(pair, SSH_CHANNEL_FORWARDED_TCPIP, host, port, orig_host, orig_port);
+}
+
+ssh_channel create_in_x11(channelptr pair, const char *orig_host, int orig_port)
+{
+    return open_in_channel(pair, SSH_CHANNEL_X11, NULL, 0, orig_host, orig_port);
+}
+
+ssh_channel create_in_auth_agent(channelptr pair)
+{
+    return open_in_channel(pair, SSH_CHANNEL_AUTH_AGENT, NULL, 0, NULL, 0);
 }
 
-void destroy_in_channel(stateptr state)
+void destroy_in_channel(channelptr pair)
 {
-    if (state->in_channel) {
-        ssh_channel_close(state->in_channel);
-        ssh_channel_free(state->in_channel);
-        state->in_channel = NULL;
-
-        if (state->out_channel == NULL) {
-            state->finished = 1;
-        }
+    if (pair->in_channel) {
+        ssh_channel_close(pair->in_channel);
+        ssh_channel_free(pair->in_channel);
+        pair->in_channel = NULL;
     }
 }
@@ -1,6 +1,11 @@
 #include <libssh/libssh.h>
 
-#include "state.h"
+#include "channel.h"
 
-ssh_channel create_in_channel(stateptr state);
-void destroy_in_channel(stateptr state);
+ssh_channel create_in_channel(channelptr pair);
+ssh_channel create_in_forward(channelptr pair, const char *host, int port, const char *orig_host, int orig_port);
+ssh_channel create_in_x11(channelptr pair, const char *orig_host, int orig_port);
+ssh_channel create_in_auth_agent(channelptr pair);
+void set_in_channel(channelptr pair, ssh_channel channel);
+int in_channel_opened(channelptr pair);
+void destroy_in_channel(channelptr pair);
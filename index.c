@@ -0,0 +1,739 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/eventfd.h>
+
+#include "index.h"
+#include "log.h"
+
+#define SEGMENT_NAME_LEN 37     // 16 hex digits, -, 16 hex digits, .idx
+
+static const char *kind_names[INDEX_KINDS] = { "login", "shell", "exec", "subsystem", "env" };
+
+// Rows waiting for the writer thread, added to by every worker
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct index_builder *pending = NULL;
+static uint64_t dropped = 0;
+
+static const char *index_dir = NULL;
+static uint64_t pid_key;
+
+static int wake_fd = -1;
+static int stop_fd = -1;
+static pthread_t index_thread;
+static int index_started = 0;
+
+const char *index_kind_name(int kind)
+{
+    return (kind >= 0 && kind < INDEX_KINDS) ? kind_names[kind] : "unknown";
+}
+
+// FNV-1a
+static uint32_t hash_string(const char *s)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*s) {
+        hash = (hash ^ (unsigned char) *s++) * 16777619u;
+    }
+
+    return hash;
+}
+
+static void builder_free(struct index_builder *builder)
+{
+    if (builder == NULL) return;
+
+    free(builder->time);
+    free(builder->session);
+    free(builder->user);
+    free(builder->source);
+    free(builder->upstream);
+    free(builder->text);
+    free(builder->kind);
+    free(builder->offset);
+    free(builder->slots);
+    free(builder->data);
+    free(builder);
+}
+
+static int grow(void **array, size_t size)
+{
+    void *grown = realloc(*array, size);
+
+    if (grown == NULL) return -1;
+    *array = grown;
+
+    return 0;
+}
+
+static int grow_rows(struct index_builder *builder)
+{
+    uint32_t size = builder->row_size ? builder->row_size * 2 : 1024;
+
+    if (grow((void **) &builder->time, size * sizeof(uint64_t)) != 0 ||
+            grow((void **) &builder->session, size * sizeof(uint64_t)) != 0 ||
+            grow((void **) &builder->user, size * sizeof(uint32_t)) != 0 ||
+            grow((void **) &builder->source, size * sizeof(uint32_t)) != 0 ||
+            grow((void **) &builder->upstream, size * sizeof(uint32_t)) != 0 ||
+            grow((void **) &builder->text, size * sizeof(uint32_t)) != 0 ||
+            grow((void **) &builder->kind, size) != 0) {
+        return -1;
+    }
+
+    builder->row_size = size;
+
+    return 0;
+}
+
+// Keeps the dictionary at most half full
+static int grow_strings(struct index_builder *builder)
+{
+    uint32_t size = builder->slots ? (builder->slot_mask + 1) * 2 : 256;
+    uint32_t *slots;
+    uint32_t id, i;
+
+    if (grow((void **) &builder->offset, size / 2 * sizeof(uint32_t)) != 0) return -1;
+
+    slots = calloc(size, sizeof(uint32_t));
+    if (slots == NULL) return -1;
+
+    for (id = 0; id < builder->strings; id++) {
+        for (i = hash_string(builder->data + builder->offset[id]) & (size - 1); slots[i]; i = (i + 1) & (size - 1));
+        slots[i] = id + 1;
+    }
+
+    free(builder->slots);
+    builder->slots = slots;
+    builder->slot_mask = size - 1;
+
+    return 0;
+}
+
+static int intern(struct index_builder *builder, const char *s, uint32_t *id)
+{
+    size_t len;
+    uint32_t i;
+
+    if (builder->slots == NULL || (builder->strings + 1) * 2 > builder->slot_mask + 1) {
+        if (grow_strings(builder) != 0) return -1;
+    }
+
+    for (i = hash_string(s) & builder->slot_mask; builder->slots[i]; i = (i + 1) & builder->slot_mask) {
+        if (strcmp(builder->data + builder->offset[builder->slots[i] - 1], s) == 0) {
+            *id = builder->slots[i] - 1;
+            return 0;
+        }
+    }
+
+    len = strlen(s) + 1;
+    while (builder->data_len + len > builder->data_size) {
+        if (grow((void **) &builder->data, builder->data_size ? builder->data_size * 2 : 4096) != 0) return -1;
+        builder->data_size = builder->data_size ? builder->data_size * 2 : 4096;
+    }
+
+    memcpy(builder->data + builder->data_len, s, len);
+    builder->offset[builder->strings] = builder->data_len;
+    builder->data_len += len;
+
+    *id = builder->strings++;
+    builder->slots[i] = builder->strings;
+
+    return 0;
+}
+
+static int builder_add(struct index_builder *builder, uint64_t time, uint64_t session, int kind,
+    const char *user, const char *source, const char *upstream, const char *text)
+{
+    uint32_t row = builder->rows;
+
+    if (row == builder->row_size && grow_rows(builder) != 0) return -1;
+
+    if (intern(builder, user, &builder->user[row]) != 0 || intern(builder, source, &builder->source[row]) != 0 ||
+            intern(builder, upstream, &builder->upstream[row]) != 0 || intern(builder, text, &builder->text[row]) != 0) {
+        return -1;
+    }
+
+    builder->time[row] = time;
+    builder->session[row] = session;
+    builder->kind[row] = kind;
+    ++builder->rows;
+
+    return 0;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    ssize_t written;
+
+    while (len > 0) {
+        written = write(fd, data, len);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return -1;
+
+        data = (const char *) data + written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+// Written beside its final name and renamed, so readers never see half a segment
+static int builder_write(struct index_builder *builder, const char *dir, uint64_t first, uint64_t last)
+{
+    struct index_header header;
+    char tmp_name[4096], name[4096];
+    uint32_t rows = builder->rows;
+    int fd, rc = -1;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.rows = rows;
+    header.strings = builder->strings;
+    header.strings_len = builder->data_len;
+    header.min_time = builder->time[0];
+    header.max_time = builder->time[rows - 1];
+
+    snprintf(tmp_name, sizeof(tmp_name), "%s/.%016llx-%016llx.tmp", dir, (unsigned long long) first,
+        (unsigned long long) last);
+    snprintf(name, sizeof(name), "%s/%016llx-%016llx.idx", dir, (unsigned long long) first,
+        (unsigned long long) last);
+
+    fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        log_error("Unable to create index segment %s: %s", tmp_name, strerror(errno));
+        return -1;
+    }
+
+    do {
+        if (write_all(fd, &header, sizeof(header)) != 0 ||
+                write_all(fd, builder->time, rows * sizeof(uint64_t)) != 0 ||
+                write_all(fd, builder->session, rows * sizeof(uint64_t)) != 0 ||
+                write_all(fd, builder->user, rows * sizeof(uint32_t)) != 0 ||
+                write_all(fd, builder->source, rows * sizeof(uint32_t)) != 0 ||
+                write_all(fd, builder->upstream, rows * sizeof(uint32_t)) != 0 ||
+                write_all(fd, builder->text, rows * sizeof(uint32_t)) != 0 ||
+                write_all(fd, builder->offset, builder->strings * sizeof(uint32_t)) != 0 ||
+                write_all(fd, builder->kind, rows) != 0 ||
+                write_all(fd, builder->data, builder->data_len) != 0) {
+            log_error("Unable to write index segment %s: %s", tmp_name, strerror(errno));
+            break;
+        }
+
+        // The inputs of a merge are deleted next, so this has to be on disk first
+        if (fsync(fd) != 0) {
+            log_error("Unable to sync index segment %s: %s", tmp_name, strerror(errno));
+            break;
+        }
+
+        rc = 0;
+    } while (0);
+
+    close(fd);
+
+    if (rc == 0 && rename(tmp_name, name) != 0) {
+        log_error("Unable to rename index segment to %s: %s", name, strerror(errno));
+        rc = -1;
+    }
+
+    if (rc != 0) unlink(tmp_name);
+
+    return rc;
+}
+
+int index_segment_open(struct index_segment *segment, const char *dir, const char *name)
+{
+    const struct index_header *header;
+    unsigned long long first, last;
+    char path[4096];
+    struct stat st;
+    size_t expected;
+    const char *p;
+    int fd, end = 0;
+
+    memset(segment, 0, sizeof(*segment));
+
+    if (strlen(name) != SEGMENT_NAME_LEN || sscanf(name, "%16llx-%16llx.idx%n", &first, &last, &end) != 2 ||
+            end != SEGMENT_NAME_LEN) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(struct index_header)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    segment->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (segment->map == MAP_FAILED) {
+        segment->map = NULL;
+        return -1;
+    }
+
+    segment->size = st.st_size;
+    segment->first = first;
+    segment->last = last;
+
+    header = segment->map;
+    expected = sizeof(*header) + (size_t) header->rows * (2 * sizeof(uint64_t) + 4 * sizeof(uint32_t) + 1) +
+        (size_t) header->strings * sizeof(uint32_t) + header->strings_len;
+
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 || header->version != INDEX_VERSION ||
+            expected != segment->size || header->strings == 0 || header->strings_len == 0) {
+        index_segment_close(segment);
+        errno = EINVAL;
+        return -1;
+    }
+
+    p = (const char *) (header + 1);
+    segment->header = header;
+    segment->time = (const uint64_t *) p;
+    segment->session = segment->time + header->rows;
+    segment->user = (const uint32_t *) (segment->session + header->rows);
+    segment->source = segment->user + header->rows;
+    segment->upstream = segment->source + header->rows;
+    segment->text = segment->upstream + header->rows;
+    segment->offset = segment->text + header->rows;
+    segment->kind = (const uint8_t *) (segment->offset + header->strings);
+    segment->strings = (const char *) (segment->kind + header->rows);
+
+    // Strings have to end inside the file, a bad id reads as empty rather than off the end
+    if (segment->strings[header->strings_len - 1] != '\x0') {
+        index_segment_close(segment);
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void index_segment_close(struct index_segment *segment)
+{
+    if (segment->map) munmap(segment->map, segment->size);
+    segment->map = NULL;
+}
+
+const char *index_string(const struct index_segment *segment, uint32_t id)
+{
+    if (id >= segment->header->strings || segment->offset[id] >= segment->header->strings_len) return "";
+
+    return segment->strings + segment->offset[id];
+}
+
+void index_segments_close(struct index_segment *segments, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        index_segment_close(&segments[i]);
+    }
+    free(segments);
+}
+
+static int by_range(const void *a, const void *b)
+{
+    const struct index_segment *x = a, *y = b;
+
+    if (x->first != y->first) return x->first < y->first ? -1 : 1;
+    if (x->last != y->last) return x->last > y->last ? -1 : 1;
+
+    return 0;
+}
+
+// Opens the live segments oldest first, leaving out any a merged segment covers. Returns how many
+int index_segments(const char *dir, struct index_segment **segments)
+{
+    struct index_segment *list = NULL, *grown;
+    struct dirent *entry;
+    DIR *d;
+    int count, size, i, kept, attempt, vanished;
+
+    // A merge finishing part way through the listing can delete a file we were about to open, so start again
+    for (attempt = 0; attempt < 3; attempt++) {
+        d = opendir(dir);
+        if (d == NULL) {
+            log_error("Unable to open index %s: %s", dir, strerror(errno));
+            return -1;
+        }
+
+        count = 0;
+        size = 0;
+        vanished = 0;
+
+        while ((entry = readdir(d)) != NULL) {
+            if (entry->d_name[0] == '.' || strlen(entry->d_name) != SEGMENT_NAME_LEN) continue;
+
+            if (count == size) {
+                size = size ? size * 2 : 64;
+                grown = realloc(list, size * sizeof(struct index_segment));
+                if (grown == NULL) {
+                    log_error("Unable to allocate index segment list");
+                    break;
+                }
+                list = grown;
+            }
+
+            if (index_segment_open(&list[count], dir, entry->d_name) == 0) {
+                ++count;
+            } else if (errno == ENOENT) {
+                vanished = 1;
+            } else {
+                log_warn("Skipping index segment %s/%s: %s", dir, entry->d_name, strerror(errno));
+            }
+        }
+
+        closedir(d);
+
+        if (!vanished || attempt == 2) break;
+
+        for (i = 0; i < count; i++) {
+            index_segment_close(&list[i]);
+        }
+    }
+
+    if (count > 0) qsort(list, count, sizeof(struct index_segment), by_range);
+
+    // Sorted by first then widest, so a covered segment follows the one covering it
+    for (i = 0, kept = 0; i < count; i++) {
+        if (kept > 0 && list[i].last <= list[kept - 1].last) {
+            index_segment_close(&list[i]);
+            continue;
+        }
+        list[kept++] = list[i];
+    }
+
+    *segments = list;
+
+    return kept;
+}
+
+// Writers of one directory take turns, which matters while a draining sshdump and its replacement both
+// write to it. Returns the lock's descriptor, closing it unlocks
+static int lock_dir(const char *dir)
+{
+    char path[4096];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/.lock", dir);
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        log_error("Unable to open index lock %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno == EINTR) continue;
+        log_error("Unable to lock index %s: %s", dir, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Merges neighbouring segments into one and deletes them. Segments from different processes can overlap in
+// time, so rows are merged in time order rather than appended
+static int compact_segments(const char *dir, struct index_segment *segments, int count)
+{
+    struct index_builder *builder;
+    const struct index_segment *segment;
+    char name[4096];
+    uint32_t *next, row;
+    int i, pick, rc = -1;
+
+    builder = calloc(1, sizeof(struct index_builder));
+    next = calloc(count, sizeof(uint32_t));
+    if (builder == NULL || next == NULL) {
+        free(builder);
+        free(next);
+        return -1;
+    }
+
+    do {
+        for (;;) {
+            pick = -1;
+            for (i = 0; i < count; i++) {
+                if (next[i] < segments[i].header->rows &&
+                        (pick < 0 || segments[i].time[next[i]] < segments[pick].time[next[pick]])) {
+                    pick = i;
+                }
+            }
+            if (pick < 0) break;
+
+            segment = &segments[pick];
+            row = next[pick]++;
+
+            if (builder_add(builder, segment->time[row], segment->session[row], segment->kind[row],
+                    index_string(segment, segment->user[row]), index_string(segment, segment->source[row]),
+                    index_string(segment, segment->upstream[row]), index_string(segment, segment->text[row])) != 0) {
+                break;
+            }
+        }
+        if (pick >= 0) {
+            log_error("Unable to allocate while merging index segments");
+            break;
+        }
+
+        if (builder_write(builder, dir, segments[0].first, segments[count - 1].last) != 0) break;
+
+        for (i = 0; i < count; i++) {
+            snprintf(name, sizeof(name), "%s/%016llx-%016llx.idx", dir, (unsigned long long) segments[i].first,
+                (unsigned long long) segments[i].last);
+            unlink(name);
+        }
+
+        log_info("Merged %d index segments into %llu rows", count, (unsigned long long) builder->rows);
+
+        rc = 0;
+    } while (0);
+
+    builder_free(builder);
+    free(next);
+
+    return rc;
+}
+
+int index_compact(const char *dir)
+{
+    struct index_segment *segments;
+    int count, lock_fd, rc = 0;
+
+    lock_fd = lock_dir(dir);
+    if (lock_fd < 0) return -1;
+
+    count = index_segments(dir, &segments);
+    if (count < 0) {
+        rc = -1;
+    } else {
+        if (count > 1) rc = compact_segments(dir, segments, count);
+        index_segments_close(segments, count);
+    }
+
+    close(lock_fd);
+
+    return rc;
+}
+
+static int size_class(const struct index_segment *segment)
+{
+    uint32_t rows = segment->header->rows;
+
+    if (rows < 4096) return 0;
+    if (rows < 65536) return 1;
+    if (rows < 1024 * 1024) return 2;
+
+    return INDEX_COMPACT_LEVELS;
+}
+
+// Each row is rewritten at most once per size class. Called with the directory locked
+static void compact(void)
+{
+    struct index_segment *segments;
+    int count, start, end, level;
+
+    count = index_segments(index_dir, &segments);
+    if (count < 0) return;
+
+    for (start = 0; start < count; start = end) {
+        level = size_class(&segments[start]);
+
+        for (end = start + 1; end < count && size_class(&segments[end]) == level &&
+                segments[end].first == segments[end - 1].last + 1; end++);
+
+        if (level < INDEX_COMPACT_LEVELS && end - start >= INDEX_COMPACT_SEGMENTS) {
+            compact_segments(index_dir, &segments[start], end - start);
+        }
+    }
+
+    index_segments_close(segments, count);
+}
+
+static void flush(void)
+{
+    struct index_builder *rows;
+    struct index_segment *segments;
+    uint64_t lost, first = 0;
+    int count, lock_fd;
+
+    pthread_mutex_lock(&index_lock);
+    rows = pending;
+    pending = NULL;
+    lost = dropped;
+    dropped = 0;
+    pthread_mutex_unlock(&index_lock);
+
+    if (lost) {
+        log_warn("Dropped %llu index rows", (unsigned long long) lost);
+    }
+
+    if (rows == NULL) return;
+
+    if (rows->rows > 0) {
+        // Row numbers come from what's on disk under the lock, so other writers' segments never overlap ours
+        lock_fd = lock_dir(index_dir);
+        count = lock_fd < 0 ? -1 : index_segments(index_dir, &segments);
+
+        if (count >= 0) {
+            if (count > 0) first = segments[count - 1].last + 1;
+            index_segments_close(segments, count);
+        }
+
+        if (count >= 0 && builder_write(rows, index_dir, first, first + rows->rows - 1) == 0) {
+            compact();
+        } else {
+            log_error("Lost %u index rows", rows->rows);
+        }
+
+        if (lock_fd >= 0) close(lock_fd);
+    }
+
+    builder_free(rows);
+}
+
+static void *index_main(void *arg)
+{
+    struct pollfd fds[2];
+    uint64_t value;
+    int rc;
+
+    (void)arg;
+
+    fds[0].fd = wake_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stop_fd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        rc = poll(fds, 2, INDEX_FLUSH_SECS * 1000);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            log_error("Index writer poll failed: %s", strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            if (read(wake_fd, &value, sizeof(value)) < 0) {
+                log_error("Unable to read index eventfd: %s", strerror(errno));
+            }
+        }
+
+        // On the way out too, so nothing is left behind
+        flush();
+
+        if (fds[1].revents) break;
+    }
+
+    return NULL;
+}
+
+void index_add(int kind, int session_id, const char *user, const char *source, const char *upstream,
+    const char *text)
+{
+    struct timespec now;
+    uint64_t value = 1;
+    int wake = 0;
+
+    if (!index_started) return;
+
+    pthread_mutex_lock(&index_lock);
+
+    if (pending == NULL) pending = calloc(1, sizeof(struct index_builder));
+
+    // Taken under the lock so each segment's times ascend
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    if (pending == NULL || pending->rows >= INDEX_MAX_PENDING ||
+            builder_add(pending, (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec, pid_key | (uint32_t) session_id,
+                kind, user ? user : "", source ? source : "", upstream ? upstream : "", text ? text : "") != 0) {
+        ++dropped;
+    } else if (pending->rows == INDEX_FLUSH_ROWS) {
+        wake = 1;
+    }
+
+    pthread_mutex_unlock(&index_lock);
+
+    if (wake && write(wake_fd, &value, sizeof(value)) < 0) {
+        log_error("Unable to wake index writer: %s", strerror(errno));
+    }
+}
+
+int index_start(const char *dir)
+{
+    int rc;
+
+    do {
+        if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+            log_error("Unable to create index %s: %s", dir, strerror(errno));
+            break;
+        }
+
+        index_dir = dir;
+        pid_key = (uint64_t) getpid() << 32;
+
+        wake_fd = eventfd(0, EFD_CLOEXEC);
+        stop_fd = eventfd(0, EFD_CLOEXEC);
+        if (wake_fd < 0 || stop_fd < 0) {
+            log_error("Unable to create index eventfd: %s", strerror(errno));
+            break;
+        }
+
+        rc = pthread_create(&index_thread, NULL, index_main, NULL);
+        if (rc != 0) {
+            log_error("Unable to start index thread: %s", strerror(rc));
+            break;
+        }
+
+        index_started = 1;
+        log_info("Indexing sessions in %s", dir);
+
+        return 0;
+    } while (0);
+
+    index_stop();
+
+    return -1;
+}
+
+void index_stop(void)
+{
+    uint64_t value = 1;
+
+    if (index_started) {
+        index_started = 0;
+
+        if (write(stop_fd, &value, sizeof(value)) < 0) {
+            log_error("Unable to stop index thread: %s", strerror(errno));
+        }
+        pthread_join(index_thread, NULL);
+    }
+
+    if (wake_fd >= 0) close(wake_fd);
+    if (stop_fd >= 0) close(stop_fd);
+    wake_fd = -1;
+    stop_fd = -1;
+
+    builder_free(pending);
+    pending = NULL;
+    index_dir = NULL;
+}
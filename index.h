@@ -0,0 +1,118 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef INDEX_H
+#define INDEX_H
+
+/*
+ * Searchable record of logins and what was run, kept as a directory of
+ * append-only columnar segments so queries read a few columns rather than
+ * captures. Each row is one event with the session's user, source address
+ * and upstream. Strings are stored once per segment and rows refer to them by
+ * id, so a query first finds the ids that match in the (small) dictionary and
+ * skips the segment if there are none. Segment layout, host byte order:
+ *
+ *   struct index_header
+ *   uint64_t time[rows]             ns since the epoch, ascending
+ *   uint64_t session[rows]          pid << 32 | connection id
+ *   uint32_t user[rows]             string ids
+ *   uint32_t source[rows]
+ *   uint32_t upstream[rows]
+ *   uint32_t text[rows]             auth method, command, subsystem or env pair
+ *   uint32_t offset[strings]        of each string in the string data
+ *   uint8_t kind[rows]
+ *   char strings[strings_len]       NUL terminated
+ *
+ * Files are named <first>-<last>.idx after the row sequence numbers they
+ * hold. The writer flushes a segment every INDEX_FLUSH_SECS, and merges runs
+ * of INDEX_COMPACT_SEGMENTS neighbouring segments of the same size class into
+ * one. A merged segment is renamed into place before its inputs go, and
+ * readers ignore any segment whose range another one covers. Writers hold
+ * an flock on .lock in the directory while they number, write and merge
+ * segments, so a draining sshdump and its replacement can share it.
+ */
+
+#define INDEX_MAGIC "SSHDIDX1"
+#define INDEX_VERSION 1
+
+#define INDEX_FLUSH_SECS 5
+#define INDEX_FLUSH_ROWS 4096               // Flush sooner than that when this many are waiting
+#define INDEX_MAX_PENDING (1024 * 1024)     // Rows dropped beyond this if the disk can't keep up
+#define INDEX_COMPACT_SEGMENTS 16
+#define INDEX_COMPACT_LEVELS 3              // Size classes merged, rows below 4096, 64K and 1M
+
+// Row kinds
+#define INDEX_LOGIN     0                   // Text is the auth method
+#define INDEX_SHELL     1
+#define INDEX_EXEC      2
+#define INDEX_SUBSYSTEM 3
+#define INDEX_ENV       4                   // Text is name=value
+#define INDEX_KINDS     5
+
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t rows;
+    uint32_t strings;
+    uint32_t strings_len;
+    uint64_t min_time;
+    uint64_t max_time;
+};
+
+// A segment mapped for reading
+struct index_segment {
+    uint64_t first;                 // Row sequence numbers, from the file name
+    uint64_t last;
+
+    void *map;
+    size_t size;
+
+    const struct index_header *header;
+    const uint64_t *time;
+    const uint64_t *session;
+    const uint32_t *user;
+    const uint32_t *source;
+    const uint32_t *upstream;
+    const uint32_t *text;
+    const uint32_t *offset;
+    const uint8_t *kind;
+    const char *strings;
+};
+
+// Rows collected in memory before they're written as a segment
+struct index_builder {
+    uint32_t rows;
+    uint32_t row_size;
+    uint64_t *time;
+    uint64_t *session;
+    uint32_t *user;
+    uint32_t *source;
+    uint32_t *upstream;
+    uint32_t *text;
+    uint8_t *kind;
+
+    // String dictionary, open addressing on id + 1
+    uint32_t strings;
+    uint32_t *offset;
+    uint32_t *slots;
+    uint32_t slot_mask;
+    char *data;
+    size_t data_len;
+    size_t data_size;
+};
+
+const char *index_kind_name(int kind);
+
+int index_start(const char *dir);
+void index_add(int kind, int session_id, const char *user, const char *source, const char *upstream,
+    const char *text);
+void index_stop(void);
+
+int index_segment_open(struct index_segment *segment, const char *dir, const char *name);
+void index_segment_close(struct index_segment *segment);
+int index_segments(const char *dir, struct index_segment **segments);
+void index_segments_close(struct index_segment *segments, int count);
+const char *index_string(const struct index_segment *segment, uint32_t id);
+int index_compact(const char *dir);
+
+#endif
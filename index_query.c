@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "index.h"
+#include "histogram.h"
+#include "log.h"
+
+/*
+ * Searches the index sshdump --index writes, for example every session that
+ * ran a command in the last week:
+ *
+ *   index_query -d /var/lib/sshdump/index -c 'rm -rf' -a 7d -S
+ *
+ * Segments outside the time range, or whose dictionary has nothing matching,
+ * are skipped without reading their rows.
+ */
+
+#define NO_MATCH 0xffffffff
+
+struct query {
+    const char *user;
+    const char *source;
+    const char *upstream;
+    const char *text;           // Substring
+    int kind;                   // -1 for any
+    uint64_t after;             // ns since the epoch, 0 for no limit
+    uint64_t before;
+    int sessions;               // Only the first matching row of each session
+
+    // Sessions already printed, open addressing on the session key
+    uint64_t *seen;
+    uint64_t seen_mask;
+    uint64_t seen_count;
+};
+
+static uint32_t find_string(const struct index_segment *segment, const char *value)
+{
+    uint32_t id;
+
+    for (id = 0; id < segment->header->strings; id++) {
+        if (strcmp(index_string(segment, id), value) == 0) return id;
+    }
+
+    return NO_MATCH;
+}
+
+// 1 if not seen before, so should be printed
+static int first_sighting(struct query *query, uint64_t session)
+{
+    uint64_t *grown, i, size;
+
+    if ((query->seen_count + 1) * 2 > query->seen_mask + 1) {
+        size = query->seen ? (query->seen_mask + 1) * 2 : 4096;
+
+        // Key 0 marks an empty slot, which no session has as pids are never 0
+        grown = calloc(size, sizeof(uint64_t));
+        if (grown == NULL) return 1;
+
+        for (i = 0; query->seen && i <= query->seen_mask; i++) {
+            if (query->seen[i]) {
+                uint64_t j = (query->seen[i] * 0x9e3779b97f4a7c15ull) >> 20 & (size - 1);
+                while (grown[j]) j = (j + 1) & (size - 1);
+                grown[j] = query->seen[i];
+            }
+        }
+
+        free(query->seen);
+        query->seen = grown;
+        query->seen_mask = size - 1;
+    }
+
+    for (i = (session * 0x9e3779b97f4a7c15ull) >> 20 & query->seen_mask; query->seen[i];
+            i = (i + 1) & query->seen_mask) {
+        if (query->seen[i] == session) return 0;
+    }
+
+    query->seen[i] = session;
+    ++query->seen_count;
+
+    return 1;
+}
+
+// First row at or after the time given, rows are in time order
+static uint32_t lower_bound(const struct index_segment *segment, uint64_t time)
+{
+    uint32_t low = 0, high = segment->header->rows, mid;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (segment->time[mid] < time) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+static void print_row(const struct index_segment *segment, uint32_t row)
+{
+    char when[32];
+    time_t seconds = segment->time[row] / 1000000000;
+    struct tm tm;
+
+    localtime_r(&seconds, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+
+    printf("%s  %u.%u  %s  %s  %s  %s  %s\n", when, (unsigned) (segment->session[row] >> 32),
+        (unsigned) segment->session[row], index_string(segment, segment->user[row]),
+        index_string(segment, segment->source[row]), index_string(segment, segment->upstream[row]),
+        index_kind_name(segment->kind[row]), index_string(segment, segment->text[row]));
+}
+
+static uint64_t search(struct query *query, const struct index_segment *segment)
+{
+    const struct index_header *header = segment->header;
+    uint32_t user = NO_MATCH, source = NO_MATCH, upstream = NO_MATCH;
+    uint32_t row, start, end, id;
+    uint8_t *text_match = NULL;
+    int any = 0;
+    uint64_t found = 0;
+
+    if (query->after && header->max_time < query->after) return 0;
+    if (query->before && header->min_time >= query->before) return 0;
+
+    // Exact matches are one string id, which has to be in the dictionary for any row to match
+    if (query->user && (user = find_string(segment, query->user)) == NO_MATCH) return 0;
+    if (query->source && (source = find_string(segment, query->source)) == NO_MATCH) return 0;
+    if (query->upstream && (upstream = find_string(segment, query->upstream)) == NO_MATCH) return 0;
+
+    if (query->text) {
+        text_match = calloc(header->strings, 1);
+        if (text_match == NULL) return 0;
+
+        for (id = 0; id < header->strings; id++) {
+            if (strstr(index_string(segment, id), query->text)) {
+                text_match[id] = 1;
+                any = 1;
+            }
+        }
+
+        if (!any) {
+            free(text_match);
+            return 0;
+        }
+    }
+
+    start = query->after ? lower_bound(segment, query->after) : 0;
+    end = query->before ? lower_bound(segment, query->before) : header->rows;
+
+    for (row = start; row < end; row++) {
+        if (query->kind >= 0 && segment->kind[row] != query->kind) continue;
+        if (query->user && segment->user[row] != user) continue;
+        if (query->source && segment->source[row] != source) continue;
+        if (query->upstream && segment->upstream[row] != upstream) continue;
+        if (text_match && (segment->text[row] >= header->strings || !text_match[segment->text[row]])) continue;
+        if (query->sessions && !first_sighting(query, segment->session[row])) continue;
+
+        print_row(segment, row);
+        ++found;
+    }
+
+    free(text_match);
+
+    return found;
+}
+
+// Seconds since the epoch, a date, or how long ago such as 90m, 24h or 7d
+static int parse_time(const char *text, uint64_t *ns)
+{
+    struct tm tm;
+    char *end;
+    const char *rest;
+    long long value;
+    time_t now = time(NULL);
+
+    memset(&tm, 0, sizeof(tm));
+    rest = strptime(text, "%Y-%m-%d", &tm);
+    if (rest && (*rest == '\x0' || strptime(rest, " %H:%M:%S", &tm) || strptime(rest, " %H:%M", &tm))) {
+        tm.tm_isdst = -1;
+        *ns = (uint64_t) mktime(&tm) * 1000000000;
+        return 0;
+    }
+
+    value = strtoll(text, &end, 10);
+    if (end == text || value < 0) return -1;
+
+    switch (*end) {
+    case '\x0': break;
+    case 's': value = now - value; break;
+    case 'm': value = now - value * 60; break;
+    case 'h': value = now - value * 3600; break;
+    case 'd': value = now - value * 86400; break;
+    case 'w': value = now - value * 7 * 86400; break;
+    default: return -1;
+    }
+
+    if (*end && end[1] != '\x0') return -1;
+
+    *ns = (uint64_t) value * 1000000000;
+
+    return 0;
+}
+
+static int parse_kind(const char *name)
+{
+    int kind;
+
+    for (kind = 0; kind < INDEX_KINDS; kind++) {
+        if (strcmp(name, index_kind_name(kind)) == 0) return kind;
+    }
+
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stdout, "Usage:\n");
+    fprintf(stdout, "%s <args>\n", prog);
+    fprintf(stdout, "Where args are:\n");
+    fprintf(stdout, " -d | --dir <dir>          Index directory, as given to sshdump --index\n");
+    fprintf(stdout, " -u | --user <name>        Only rows for this user\n");
+    fprintf(stdout, " -s | --source <address>   Only rows for sessions from this address\n");
+    fprintf(stdout, " -U | --upstream <host:port> Only rows for sessions relayed to this upstream\n");
+    fprintf(stdout, " -c | --command <text>     Only rows whose command, subsystem, env or auth method contains this\n");
+    fprintf(stdout, " -k | --kind <kind>        Only rows of this kind: login, shell, exec, subsystem or env\n");
+    fprintf(stdout, " -a | --after <time>       Only rows from this time on. Seconds since the epoch,\n");
+    fprintf(stdout, "                           YYYY-MM-DD[ HH:MM[:SS]], or how long ago such as 90m, 24h, 7d or 2w\n");
+    fprintf(stdout, " -b | --before <time>      Only rows from before this time\n");
+    fprintf(stdout, " -S | --sessions           Only the first matching row of each session\n");
+    fprintf(stdout, " -C | --compact            Merge every segment into one, rather than searching\n");
+    fprintf(stdout, "Rows are printed as: time, pid.connection, user, source, upstream, kind, text\n");
+}
+
+int main(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        {"dir",         required_argument, 0, 'd'},
+        {"user",        required_argument, 0, 'u'},
+        {"source",      required_argument, 0, 's'},
+        {"upstream",    required_argument, 0, 'U'},
+        {"command",     required_argument, 0, 'c'},
+        {"kind",        required_argument, 0, 'k'},
+        {"after",       required_argument, 0, 'a'},
+        {"before",      required_argument, 0, 'b'},
+        {"sessions",    no_argument,       0, 'S'},
+        {"compact",     no_argument,       0, 'C'},
+        {"help",        no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    struct query query;
+    struct index_segment *segments;
+    const char *dir = NULL;
+    uint64_t start, found = 0, rows = 0;
+    int c, i, count, compact = 0, ok = 1, rc = 0;
+
+    memset(&query, 0, sizeof(query));
+    query.kind = -1;
+
+    while ((c = getopt_long(argc, argv, "d:u:s:U:c:k:a:b:SCh", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'd': dir = optarg; break;
+        case 'u': query.user = optarg; break;
+        case 's': query.source = optarg; break;
+        case 'U': query.upstream = optarg; break;
+        case 'c': query.text = optarg; break;
+        case 'k': if ((query.kind = parse_kind(optarg)) < 0) ok = 0; break;
+        case 'a': if (parse_time(optarg, &query.after) != 0) ok = 0; break;
+        case 'b': if (parse_time(optarg, &query.before) != 0) ok = 0; break;
+        case 'S': query.sessions = 1; break;
+        case 'C': compact = 1; break;
+        default: ok = 0; break;
+        }
+    }
+
+    if (!ok || dir == NULL) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Errors go to stderr, where they don't mix with the results
+    log_level = LOG_LEVEL_WARN;
+    if (log_start() != 0) return 1;
+
+    start = histogram_now();
+
+    if (compact) {
+        rc = index_compact(dir) != 0;
+        log_stop();
+        return rc;
+    }
+
+    count = index_segments(dir, &segments);
+    if (count < 0) {
+        log_stop();
+        return 1;
+    }
+
+    for (i = 0; i < count; i++) {
+        rows += segments[i].header->rows;
+        found += search(&query, &segments[i]);
+    }
+
+    fprintf(stderr, "%llu of %llu rows from %d segments in %.1f ms\n", (unsigned long long) found,
+        (unsigned long long) rows, count, (histogram_now() - start) / 1e6);
+
+    index_segments_close(segments, count);
+    free(query.seen);
+
+    log_stop();
+
+    return 0;
+}
@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <libssh/libssh.h>
+
+#include "keys.h"
+#include "log.h"
+
+static pthread_mutex_t keys_lock = PTHREAD_MUTEX_INITIALIZER;
+static keyptr current = NULL;
+
+static const char *pub_key_file = NULL;
+static const char *priv_key_file = NULL;
+
+// Reloads are parsed on their own thread, workers only ever swap pointers
+static int reload_fd = -1;
+static int stop_fd = -1;
+static pthread_t keys_thread;
+static int keys_started = 0;
+
+static void free_keys(keyptr keys)
+{
+    ssh_key_free(keys->pub);
+    ssh_key_free(keys->priv);
+    free(keys);
+}
+
+int keys_load(const char *pub_file, const char *priv_file)
+{
+    keyptr keys, old;
+
+    pub_key_file = pub_file;
+    priv_key_file = priv_file;
+
+    keys = calloc(1, sizeof(struct key_pair));
+    if (keys == NULL) {
+        log_error("Unable to allocate keys");
+        return -1;
+    }
+
+    // Parse both up front, private keys are expensive to import
+    if (ssh_pki_import_pubkey_file(pub_file, &keys->pub) != SSH_OK) {
+        log_error("Failed to load public key %s", pub_file);
+        free_keys(keys);
+        return -1;
+    }
+
+    if (ssh_pki_import_privkey_file(priv_file, NULL, NULL, NULL, &keys->priv) != SSH_OK) {
+        log_error("Failed to load private key %s", priv_file);
+        free_keys(keys);
+        return -1;
+    }
+
+    keys->refs = 1;
+
+    // Sessions part way through auth keep the old pair until they're done with it
+    pthread_mutex_lock(&keys_lock);
+    old = current;
+    current = keys;
+    pthread_mutex_unlock(&keys_lock);
+
+    if (old) keys_put(old);
+
+    log_info("Loaded outbound keys %s and %s", pub_file, priv_file);
+
+    return 0;
+}
+
+void keys_request_reload(void)
+{
+    uint64_t value = 1;
+    int fd = reload_fd;
+
+    // Called from the signal handler, where write is safe
+    if (fd >= 0 && write(fd, &value, sizeof(value)) < 0) {
+        // Nothing safe to log with here, the next SIGHUP tries again
+    }
+}
+
+static void *keys_main(void *arg)
+{
+    struct pollfd fds[2];
+    uint64_t value;
+
+    (void)arg;
+
+    fds[0].fd = reload_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stop_fd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            log_error("Keys reload poll failed: %s", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents) break;
+
+        if (fds[0].revents & POLLIN) {
+            if (read(reload_fd, &value, sizeof(value)) < 0) continue;
+
+            // Sessions carry on authenticating with the old pair meanwhile
+            if (keys_load(pub_key_file, priv_key_file) != 0) {
+                log_error("Keeping the previous outbound keys");
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Call after the first keys_load
+int keys_start(void)
+{
+    int rc;
+
+    do {
+        reload_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        stop_fd = eventfd(0, EFD_CLOEXEC);
+        if (reload_fd < 0 || stop_fd < 0) {
+            log_error("Unable to create keys eventfd: %s", strerror(errno));
+            break;
+        }
+
+        rc = pthread_create(&keys_thread, NULL, keys_main, NULL);
+        if (rc != 0) {
+            log_error("Unable to start keys thread: %s", strerror(rc));
+            break;
+        }
+
+        keys_started = 1;
+
+        return 0;
+    } while (0);
+
+    keys_stop();
+
+    return -1;
+}
+
+void keys_stop(void)
+{
+    uint64_t value = 1;
+    int fd = reload_fd;
+
+    // Before it's closed, so a late SIGHUP doesn't write to whatever reuses the descriptor
+    reload_fd = -1;
+
+    if (keys_started) {
+        if (write(stop_fd, &value, sizeof(value)) < 0) {
+            log_error("Unable to stop keys thread: %s", strerror(errno));
+        }
+        pthread_join(keys_thread, NULL);
+        keys_started = 0;
+    }
+
+    if (fd >= 0) close(fd);
+    if (stop_fd >= 0) close(stop_fd);
+    stop_fd = -1;
+}
+
+keyptr keys_get(void)
+{
+    keyptr keys;
+
+    pthread_mutex_lock(&keys_lock);
+    keys = current;
+    if (keys) ++keys->refs;
+    pthread_mutex_unlock(&keys_lock);
+
+    return keys;
+}
+
+void keys_put(keyptr keys)
+{
+    int refs;
+
+    if (keys == NULL) return;
+
+    pthread_mutex_lock(&keys_lock);
+    refs = --keys->refs;
+    pthread_mutex_unlock(&keys_lock);
+
+    if (refs == 0) free_keys(keys);
+}
+
+void keys_cleanup(void)
+{
+    keyptr old;
+
+    pthread_mutex_lock(&keys_lock);
+    old = current;
+    current = NULL;
+    pthread_mutex_unlock(&keys_lock);
+
+    keys_put(old);
+}
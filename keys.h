@@ -0,0 +1,23 @@
+#include <libssh/libssh.h>
+
+#ifndef KEYS_H
+#define KEYS_H
+
+// Outbound auth keys, loaded once and shared read-only by every session. Reloaded
+// on SIGHUP by the keys thread, so no event loop waits for the private key to parse
+struct key_pair {
+    int refs;               // Sessions using it, plus one while it's current
+    ssh_key pub;
+    ssh_key priv;
+};
+typedef struct key_pair *keyptr;
+
+int keys_load(const char *pub_file, const char *priv_file);
+void keys_request_reload(void);
+int keys_start(void);
+void keys_stop(void);
+keyptr keys_get(void);
+void keys_put(keyptr keys);
+void keys_cleanup(void);
+
+#endif
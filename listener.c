@@ -0,0 +1,128 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "listener.h"
+#include "log.h"
+
+// Sockets taken over from a previous process, see handoff.h
+static const int *adopted = NULL;
+static int adopted_count = 0;
+
+void listener_adopt(const int *fds, int count)
+{
+    adopted = fds;
+    adopted_count = count;
+}
+
+static int open_adopted(int port, int index)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd;
+
+    // Each worker has its own descriptor to close
+    fd = fcntl(adopted[index], F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("Unable to take over listen socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if (getsockname(fd, (struct sockaddr *) &addr, &len) == 0 && addr.sin_family == AF_INET &&
+            ntohs(addr.sin_port) != port) {
+        log_warn("Listen socket taken over is on port %d, not %d", ntohs(addr.sin_port), port);
+    }
+
+    return fd;
+}
+
+// Every socket taken over has to be polled by some worker, or connections the kernel hashes to it hang.
+// With fewer than there are workers they're shared round robin, with more a worker takes several
+static int open_all_adopted(int port, int worker, int workers, int *fds, int max)
+{
+    int i, count = 0;
+
+    if (adopted_count <= workers) {
+        fds[0] = open_adopted(port, worker % adopted_count);
+        return fds[0] < 0 ? -1 : 1;
+    }
+
+    for (i = worker; i < adopted_count && count < max; i += workers) {
+        fds[count] = open_adopted(port, i);
+        if (fds[count] < 0) {
+            while (count > 0) close(fds[--count]);
+            return -1;
+        }
+        ++count;
+    }
+
+    return count;
+}
+
+// Fills fds with this worker's listen sockets, returns how many
+int listener_open(int port, int worker, int workers, int *fds, int max)
+{
+    int fd;
+    int on = 1;
+    struct sockaddr_in addr;
+
+    if (adopted_count > 0) {
+        return open_all_adopted(port, worker, workers, fds, max);
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("Unable to create listen socket: %s", strerror(errno));
+        return -1;
+    }
+
+    do {
+        // Every worker binds its own socket to the same port and the kernel spreads connections between them
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+            log_error("Unable to set listen socket options: %s", strerror(errno));
+            break;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+            log_error("Unable to bind to port %d: %s", port, strerror(errno));
+            break;
+        }
+
+        if (listen(fd, SOMAXCONN) != 0) {
+            log_error("Unable to listen on port %d: %s", port, strerror(errno));
+            break;
+        }
+
+        fds[0] = fd;
+        return 1;
+    } while (0);
+
+    close(fd);
+
+    return -1;
+}
+
+int listener_accept(int fd)
+{
+    int client_fd;
+
+    client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (client_fd < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        log_error("Error accepting a connection: %s", strerror(errno));
+    }
+
+    return client_fd;
+}
@@ -0,0 +1,10 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#define LISTENER_MAX 256        // Listen sockets per process, one per worker unless more were taken over
+
+void listener_adopt(const int *fds, int count);
+int listener_open(int port, int worker, int workers, int *fds, int max);
+int listener_accept(int fd);
+
+#endif
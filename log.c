@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+
+#define LOG_RING_SIZE (256 * 1024)      // Per thread, must be a power of two
+#define LOG_MAX_MESSAGE 1024
+#define LOG_OUT_BUFFER (64 * 1024)
+
+struct log_record {
+    uint64_t timestamp;     // Nanoseconds since the epoch
+    uint16_t len;           // Length of the message following the record
+    uint8_t level;
+    uint8_t pad[5];
+};
+
+// Single producer (the owning thread), single consumer (the writer thread)
+struct log_ring {
+    struct log_ring *next;
+    uint64_t head;          // Only written by the producer
+    uint64_t tail;          // Only written by the writer
+    uint64_t dropped;       // Records lost because the ring was full
+    uint64_t reported;      // Drops already reported by the writer
+    char data[LOG_RING_SIZE];
+};
+
+struct log_output {
+    int fd;
+    size_t len;
+    char data[LOG_OUT_BUFFER];
+};
+
+int log_level = LOG_LEVEL_DEBUG;
+
+static __thread struct log_ring *thread_ring = NULL;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *rings = NULL;
+
+static pthread_t writer_thread;
+static int writer_started = 0;
+static int writer_running = 0;
+static int stopped = 0;
+
+// The writer blocks on wake_fd once the rings are empty. Producers only write to it when the writer says
+// it's asleep, so a busy process makes no extra system calls
+static int wake_fd = -1;
+static int writer_sleeping = 0;
+
+static struct log_output out_stdout = { .fd = STDOUT_FILENO };
+static struct log_output out_stderr = { .fd = STDERR_FILENO };
+
+static struct log_ring *get_ring(void)
+{
+    struct log_ring *ring = thread_ring;
+
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(struct log_ring));
+        if (ring == NULL) return NULL;
+
+        // Only taken once per thread
+        pthread_mutex_lock(&rings_lock);
+        ring->next = rings;
+        rings = ring;
+        pthread_mutex_unlock(&rings_lock);
+
+        thread_ring = ring;
+    }
+
+    return ring;
+}
+
+static void ring_copy_in(struct log_ring *ring, uint64_t pos, const void *src, size_t len)
+{
+    size_t offset = pos & (LOG_RING_SIZE - 1);
+    size_t first = LOG_RING_SIZE - offset;
+
+    if (first >= len) {
+        memcpy(ring->data + offset, src, len);
+    } else {
+        memcpy(ring->data + offset, src, first);
+        memcpy(ring->data, (const char *) src + first, len - first);
+    }
+}
+
+static void ring_copy_out(struct log_ring *ring, uint64_t pos, void *dest, size_t len)
+{
+    size_t offset = pos & (LOG_RING_SIZE - 1);
+    size_t first = LOG_RING_SIZE - offset;
+
+    if (first >= len) {
+        memcpy(dest, ring->data + offset, len);
+    } else {
+        memcpy(dest, ring->data + offset, first);
+        memcpy((char *) dest + first, ring->data, len - first);
+    }
+}
+
+static void wake_writer(void)
+{
+    uint64_t value = 1;
+
+    if (write(wake_fd, &value, sizeof(value)) < 0) {
+        // Already has a wakeup pending
+    }
+}
+
+void log_write(int level, const char *format, ...)
+{
+    struct log_ring *ring;
+    struct log_record record;
+    struct timespec now;
+    char message[LOG_MAX_MESSAGE];
+    uint64_t head, tail;
+    va_list args;
+    int len;
+
+    va_start(args, format);
+
+    if (__atomic_load_n(&stopped, __ATOMIC_ACQUIRE) || (ring = get_ring()) == NULL) {
+        // No writer, write it out directly
+        vfprintf(stderr, format, args);
+        fputc('\n', stderr);
+        va_end(args);
+        return;
+    }
+
+    len = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    if (len < 0) return;
+    if (len >= (int) sizeof(message)) len = sizeof(message) - 1;
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail + sizeof(record) + len > LOG_RING_SIZE) {
+        // Never wait for the writer
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    memset(&record, 0, sizeof(record));
+    record.timestamp = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    record.len = len;
+    record.level = level;
+
+    ring_copy_in(ring, head, &record, sizeof(record));
+    ring_copy_in(ring, head + sizeof(record), message, len);
+
+    // Publish the record
+    __atomic_store_n(&ring->head, head + sizeof(record) + len, __ATOMIC_RELEASE);
+
+    // Ordered against the writer setting writer_sleeping then checking the rings, so one of us sees the other
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&writer_sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&writer_sleeping, 0, __ATOMIC_ACQ_REL)) {
+        wake_writer();
+    }
+}
+
+static void output_flush(struct log_output *out)
+{
+    size_t done = 0;
+    ssize_t written;
+
+    while (done < out->len) {
+        written = write(out->fd, out->data + done, out->len - done);
+
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        done += written;
+    }
+
+    out->len = 0;
+}
+
+static void output_line(struct log_output *out, uint64_t timestamp, const char *message, size_t len)
+{
+    struct tm tm;
+    time_t secs = timestamp / 1000000000;
+    int prefix;
+
+    if (out->len + len + 32 > sizeof(out->data)) {
+        output_flush(out);
+    }
+
+    localtime_r(&secs, &tm);
+
+    prefix = snprintf(out->data + out->len, sizeof(out->data) - out->len, "%02d:%02d:%02d.%06lu ",
+        tm.tm_hour, tm.tm_min, tm.tm_sec, (unsigned long) (timestamp % 1000000000) / 1000);
+    out->len += prefix;
+
+    memcpy(out->data + out->len, message, len);
+    out->len += len;
+
+    out->data[out->len++] = '\n';
+}
+
+static int drain_ring(struct log_ring *ring)
+{
+    struct log_record record;
+    struct log_output *out;
+    struct timespec now;
+    char message[LOG_MAX_MESSAGE + 64];
+    uint64_t head, tail, dropped;
+    int count = 0;
+    int len;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    tail = ring->tail;
+
+    while (tail != head) {
+        ring_copy_out(ring, tail, &record, sizeof(record));
+        ring_copy_out(ring, tail + sizeof(record), message, record.len);
+        tail += sizeof(record) + record.len;
+
+        out = (record.level <= LOG_LEVEL_WARN ? &out_stderr : &out_stdout);
+        output_line(out, record.timestamp, message, record.len);
+
+        ++count;
+    }
+
+    // Hand the space back to the producer
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->reported) {
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        len = snprintf(message, sizeof(message), "%lu log messages dropped", (unsigned long) (dropped - ring->reported));
+        output_line(&out_stderr, (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec, message, len);
+        ring->reported = dropped;
+    }
+
+    return count;
+}
+
+static int drain_rings(void)
+{
+    struct log_ring *ring;
+    int count = 0;
+
+    pthread_mutex_lock(&rings_lock);
+
+    for (ring = rings; ring != NULL; ring = ring->next) {
+        count += drain_ring(ring);
+    }
+
+    pthread_mutex_unlock(&rings_lock);
+
+    output_flush(&out_stderr);
+    output_flush(&out_stdout);
+
+    return count;
+}
+
+static void *log_thread(void *arg)
+{
+    (void)arg;
+
+    uint64_t value;
+
+    while (__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+        // Go straight round while busy
+        if (drain_rings() > 0) continue;
+
+        // Then once more after saying we're going to sleep, for records published before a producer could see it
+        __atomic_store_n(&writer_sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if (drain_rings() > 0) {
+            __atomic_store_n(&writer_sleeping, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // No timeout, an idle process doesn't wake at all
+        if (read(wake_fd, &value, sizeof(value)) < 0 && errno != EINTR) {
+            break;
+        }
+        __atomic_store_n(&writer_sleeping, 0, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+int log_start(void)
+{
+    int rc;
+
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        fprintf(stderr, "Unable to create log writer eventfd: %s\n", strerror(errno));
+        return -1;
+    }
+
+    __atomic_store_n(&writer_running, 1, __ATOMIC_RELEASE);
+
+    rc = pthread_create(&writer_thread, NULL, log_thread, NULL);
+    if (rc != 0) {
+        fprintf(stderr, "Unable to start log writer: %s\n", strerror(rc));
+        __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+        close(wake_fd);
+        wake_fd = -1;
+        return -1;
+    }
+
+    writer_started = 1;
+
+    return 0;
+}
+
+void log_stop(void)
+{
+    struct log_ring *ring;
+
+    if (writer_started) {
+        __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+        wake_writer();
+        pthread_join(writer_thread, NULL);
+        writer_started = 0;
+    }
+
+    if (wake_fd >= 0) close(wake_fd);
+    wake_fd = -1;
+
+    // Anything logged from here on is written directly
+    __atomic_store_n(&stopped, 1, __ATOMIC_RELEASE);
+
+    drain_rings();
+
+    pthread_mutex_lock(&rings_lock);
+    while ((ring = rings) != NULL) {
+        rings = ring->next;
+        free(ring);
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    thread_ring = NULL;
+}
@@ -0,0 +1,29 @@
+#ifndef LOG_H
+#define LOG_H
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+
+// Messages above this level are compiled out altogether
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+extern int log_level;       // Messages above this level are discarded at run time
+
+#define LOG_AT(level, ...) do { \
+    if ((level) <= LOG_COMPILE_LEVEL && (level) <= log_level) log_write((level), __VA_ARGS__); \
+} while (0)
+
+#define log_error(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...)  LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+int log_start(void);
+void log_stop(void);
+
+#endif
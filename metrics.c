@@ -0,0 +1,447 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "session.h"
+#include "transcript.h"
+#include "server.h"
+#include "upstream.h"
+#include "log.h"
+
+#define REQUEST_SIZE 4096
+#define REQUEST_TIMEOUT_SECS 1
+
+static metricsptr workers[SERVER_MAX_WORKERS];
+static int worker_count = 0;
+
+static int listen_fd = -1;
+static int stop_fd = -1;
+static char *socket_path = NULL;
+static ino_t socket_ino;                // Only unlinked if a replacement hasn't bound the path since
+
+static pthread_t metrics_thread;
+static int metrics_started = 0;
+static int metrics_stopping = 0;        // Otherwise stop_fd asks the thread to close the listener
+
+static const char *auth_methods[METRICS_AUTH_METHODS] = { "none", "password", "publickey", "gssapi-with-mic" };
+static const char *directions[2] = { "client_to_server", "server_to_client" };
+
+struct body {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+void metrics_register(metricsptr metrics)
+{
+    // Workers register before any of them start
+    if (worker_count < SERVER_MAX_WORKERS) {
+        workers[worker_count++] = metrics;
+    }
+}
+
+void metrics_auth(metricsptr metrics, int method, int result)
+{
+    if (result < -1 || result >= METRICS_AUTH_RESULTS - 1) return;
+
+    ++metrics->auth[method][result + 1];
+}
+
+// Workers keep writing while this runs, a counter read mid-increment is simply one behind
+static uint64_t load(const uint64_t *value)
+{
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+static int64_t load_gauge(const int64_t *value)
+{
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+static void append(struct body *body, const char *format, ...)
+{
+    va_list args;
+    char *grown;
+    int len;
+
+    for (;;) {
+        va_start(args, format);
+        len = vsnprintf(body->data + body->len, body->size - body->len, format, args);
+        va_end(args);
+
+        if (len < 0) return;
+        if (body->len + len < body->size) break;
+
+        grown = realloc(body->data, body->size * 2);
+        if (grown == NULL) return;
+
+        body->data = grown;
+        body->size *= 2;
+    }
+
+    body->len += len;
+}
+
+static void header(struct body *body, const char *name, const char *type, const char *help)
+{
+    append(body, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void scrape(struct body *body)
+{
+    struct metrics_struct total;
+    metricsptr worker;
+    upstreamptr upstream;
+    int d, s, m, r, i;
+
+    memset(&total, 0, sizeof(total));
+
+    for (i = 0; i < worker_count; i++) {
+        worker = workers[i];
+
+        for (d = 0; d < 2; d++) {
+            total.bytes[d][0] += load(&worker->bytes[d][0]);
+            total.bytes[d][1] += load(&worker->bytes[d][1]);
+            total.short_writes[d] += load(&worker->short_writes[d]);
+        }
+
+        for (m = 0; m < METRICS_AUTH_METHODS; m++) {
+            for (r = 0; r < METRICS_AUTH_RESULTS; r++) {
+                total.auth[m][r] += load(&worker->auth[m][r]);
+            }
+        }
+
+        total.kex_failures += load(&worker->kex_failures);
+        total.connect_failures += load(&worker->connect_failures);
+        total.login_timeouts += load(&worker->login_timeouts);
+        total.sessions_total += load(&worker->sessions_total);
+        total.sessions += load_gauge(&worker->sessions);
+        total.channels += load_gauge(&worker->channels);
+    }
+
+    header(body, "sshdump_forwarded_bytes_total", "counter", "Channel data forwarded between the legs.");
+    for (d = 0; d < 2; d++) {
+        for (s = 0; s < 2; s++) {
+            append(body, "sshdump_forwarded_bytes_total{direction=\"%s\",stream=\"%s\"} %llu\n", directions[d],
+                (s ? "stderr" : "stdout"), (unsigned long long) total.bytes[d][s]);
+        }
+    }
+
+    header(body, "sshdump_short_writes_total", "counter", "Chunks the other leg could not take in one write.");
+    for (d = 0; d < 2; d++) {
+        append(body, "sshdump_short_writes_total{direction=\"%s\"} %llu\n", directions[d],
+            (unsigned long long) total.short_writes[d]);
+    }
+
+    header(body, "sshdump_auth_total", "counter", "Inbound authentication attempts by method and upstream result.");
+    for (m = 0; m < METRICS_AUTH_METHODS; m++) {
+        for (r = 0; r < METRICS_AUTH_RESULTS; r++) {
+            append(body, "sshdump_auth_total{method=\"%s\",result=\"%s\"} %llu\n", auth_methods[m],
+                auth_result(r - 1), (unsigned long long) total.auth[m][r]);
+        }
+    }
+
+    header(body, "sshdump_kex_failures_total", "counter", "Inbound key exchanges that failed or timed out.");
+    append(body, "sshdump_kex_failures_total %llu\n", (unsigned long long) total.kex_failures);
+
+    header(body, "sshdump_connect_failures_total", "counter", "Upstream connections that failed or timed out.");
+    append(body, "sshdump_connect_failures_total %llu\n", (unsigned long long) total.connect_failures);
+
+    header(body, "sshdump_login_timeouts_total", "counter", "Inbound connections that timed out waiting for a login to route.");
+    append(body, "sshdump_login_timeouts_total %llu\n", (unsigned long long) total.login_timeouts);
+
+    header(body, "sshdump_sessions_total", "counter", "Connections accepted.");
+    append(body, "sshdump_sessions_total %llu\n", (unsigned long long) total.sessions_total);
+
+    header(body, "sshdump_sessions", "gauge", "Connections open.");
+    append(body, "sshdump_sessions %lld\n", (long long) total.sessions);
+
+    header(body, "sshdump_channels", "gauge", "Channel pairs open.");
+    append(body, "sshdump_channels %lld\n", (long long) total.channels);
+
+    header(body, "sshdump_upstream_up", "gauge", "Whether the upstream is being sent sessions.");
+    for (i = 0; i < upstream_count(); i++) {
+        upstream = upstream_get(i);
+        append(body, "sshdump_upstream_up{upstream=\"%s:%d\"} %d\n", upstream->host, upstream->port,
+            __atomic_load_n(&upstream->healthy, __ATOMIC_RELAXED));
+    }
+
+    header(body, "sshdump_upstream_sessions", "gauge", "Connections relayed to the upstream now.");
+    for (i = 0; i < upstream_count(); i++) {
+        upstream = upstream_get(i);
+        append(body, "sshdump_upstream_sessions{upstream=\"%s:%d\"} %d\n", upstream->host, upstream->port,
+            __atomic_load_n(&upstream->active, __ATOMIC_RELAXED));
+    }
+
+    header(body, "sshdump_upstream_connect_seconds", "gauge", "Moving average of connect and key exchange time.");
+    for (i = 0; i < upstream_count(); i++) {
+        upstream = upstream_get(i);
+        append(body, "sshdump_upstream_connect_seconds{upstream=\"%s:%d\"} %.6f\n", upstream->host, upstream->port,
+            load(&upstream->latency_us) / 1e6);
+    }
+}
+
+static void write_all(int fd, const char *data, size_t len)
+{
+    ssize_t written;
+
+    while (len > 0) {
+        written = write(fd, data, len);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return;
+
+        data += written;
+        len -= written;
+    }
+}
+
+static void respond(int fd)
+{
+    char request[REQUEST_SIZE];
+    char head[256];
+    struct body body;
+    struct timeval timeout = { .tv_sec = REQUEST_TIMEOUT_SECS };
+    ssize_t got;
+    size_t len = 0;
+    int head_len;
+
+    // A slow or silent client can only hold the endpoint up briefly
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Only the request line matters, but read the headers so the client sees its request consumed
+    while (len < sizeof(request) - 1) {
+        got = read(fd, request + len, sizeof(request) - 1 - len);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+
+        len += got;
+        request[len] = '\x0';
+        if (strstr(request, "\r\n\r\n")) break;
+    }
+    request[len] = '\x0';
+
+    if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET / ", 6) != 0) {
+        static const char not_found[] = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        write_all(fd, not_found, sizeof(not_found) - 1);
+        return;
+    }
+
+    body.size = 8192;
+    body.len = 0;
+    body.data = malloc(body.size);
+    if (body.data == NULL) return;
+    body.data[0] = '\x0';
+
+    scrape(&body);
+
+    head_len = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long) body.len);
+
+    write_all(fd, head, head_len);
+    write_all(fd, body.data, body.len);
+
+    free(body.data);
+}
+
+static void *metrics_main(void *arg)
+{
+    struct pollfd fds[2];
+    uint64_t value;
+    int fd;
+
+    (void)arg;
+
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stop_fd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            log_error("Metrics endpoint poll failed: %s", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents) {
+            // metrics_stop sets the flag before writing, so it's seen even if its write is read here
+            if (read(stop_fd, &value, sizeof(value)) < 0 && errno == EINTR) continue;
+            if (__atomic_load_n(&metrics_stopping, __ATOMIC_RELAXED)) break;
+
+            // Draining, our replacement serves scrapes from now on
+            if (listen_fd >= 0) {
+                close(listen_fd);
+                listen_fd = -1;
+                log_info("Stopped serving metrics, draining");
+            }
+            fds[0].fd = -1;
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+
+            respond(fd);
+            close(fd);
+        }
+    }
+
+    return NULL;
+}
+
+static int open_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("Metrics socket path %s is too long", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("Unable to create metrics socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // Left over from a previous run
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 16) != 0 || stat(path, &st) != 0) {
+        log_error("Unable to listen on metrics socket %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    socket_path = strdup(path);
+    socket_ino = st.st_ino;
+
+    return fd;
+}
+
+static int open_loopback(int port)
+{
+    struct sockaddr_in addr;
+    int fd;
+    int on = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("Unable to create metrics socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // Our replacement binds the port while we still hold it, ours is closed once we start draining
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+    // Loopback only, there's no authentication
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        log_error("Unable to listen on metrics port %d: %s", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int metrics_start(const char *address)
+{
+    int rc;
+
+    do {
+        if (address[0] == '/') {
+            listen_fd = open_unix(address);
+        } else {
+            listen_fd = open_loopback(atoi(address));
+        }
+        if (listen_fd < 0) break;
+
+        stop_fd = eventfd(0, EFD_CLOEXEC);
+        if (stop_fd < 0) {
+            log_error("Unable to create metrics eventfd: %s", strerror(errno));
+            break;
+        }
+
+        rc = pthread_create(&metrics_thread, NULL, metrics_main, NULL);
+        if (rc != 0) {
+            log_error("Unable to start metrics thread: %s", strerror(rc));
+            break;
+        }
+
+        metrics_started = 1;
+        log_info("Serving metrics on %s%s", (address[0] == '/' ? "" : "127.0.0.1:"), address);
+
+        return 0;
+    } while (0);
+
+    metrics_stop();
+
+    return -1;
+}
+
+// Closes the listener so scrapes only reach our replacement, whose counters carry on, rather than
+// alternating between the two. Called once, by worker 0 when it starts draining
+void metrics_drain(void)
+{
+    uint64_t value = 1;
+
+    if (metrics_started && write(stop_fd, &value, sizeof(value)) < 0) {
+        log_error("Unable to stop metrics listener: %s", strerror(errno));
+    }
+}
+
+void metrics_stop(void)
+{
+    struct stat st;
+    uint64_t value = 1;
+
+    if (metrics_started) {
+        __atomic_store_n(&metrics_stopping, 1, __ATOMIC_RELAXED);
+        if (write(stop_fd, &value, sizeof(value)) < 0) {
+            log_error("Unable to stop metrics thread: %s", strerror(errno));
+        }
+        pthread_join(metrics_thread, NULL);
+        metrics_started = 0;
+        metrics_stopping = 0;
+    }
+
+    if (listen_fd >= 0) close(listen_fd);
+    if (stop_fd >= 0) close(stop_fd);
+    listen_fd = -1;
+    stop_fd = -1;
+
+    if (socket_path) {
+        if (stat(socket_path, &st) == 0 && st.st_ino == socket_ino) unlink(socket_path);
+        free(socket_path);
+        socket_path = NULL;
+    }
+}
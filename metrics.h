@@ -0,0 +1,43 @@
+#include <stdint.h>
+
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+ * Counters kept by each worker in its own struct, bumped with plain
+ * increments, and only summed when the endpoint is scraped. The endpoint
+ * serves them in the Prometheus text format over HTTP, on a loopback port or
+ * a Unix socket, from its own thread.
+ */
+
+// Inbound auth methods proxied
+#define METRICS_AUTH_NONE      0
+#define METRICS_AUTH_PASSWORD  1
+#define METRICS_AUTH_PUBLICKEY 2
+#define METRICS_AUTH_GSSAPI    3
+#define METRICS_AUTH_METHODS   4
+
+// SSH_AUTH_ERROR (-1) to SSH_AUTH_AGAIN (4), stored offset by one
+#define METRICS_AUTH_RESULTS   6
+
+struct metrics_struct {
+    uint64_t bytes[2][2];           // Forwarded, by transcript direction then stdout/stderr
+    uint64_t short_writes[2];       // Chunks the other leg couldn't take in one write, by direction
+    uint64_t auth[METRICS_AUTH_METHODS][METRICS_AUTH_RESULTS];
+    uint64_t kex_failures;          // Inbound key exchanges that failed or timed out
+    uint64_t connect_failures;      // Upstream connections that failed or timed out
+    uint64_t login_timeouts;        // Inbound connections that sent no login to route before timing out
+    uint64_t sessions_total;
+
+    int64_t sessions;               // Gauges
+    int64_t channels;
+};
+typedef struct metrics_struct *metricsptr;
+
+void metrics_register(metricsptr metrics);
+void metrics_auth(metricsptr metrics, int method, int result);
+int metrics_start(const char *address);
+void metrics_drain(void);
+void metrics_stop(void);
+
+#endif
@@ -4,27 +4,31 @@
 #include <libssh/callbacks.h>
 
 #include "state.h"
+#include "channel.h"
 #include "out_channel.h"
 #include "in_channel.h"
+#include "log.h"
 
 int out_data (ssh_session session, ssh_channel channel, void *data, uint32_t len, int is_stderr, void *userdata)
 {
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
     int fwlen;
 
-    fprintf(stdout, "out_data callback called with %d bytes (stderr %d)\n", len, is_stderr);
+    log_debug("out_data callback called with %d bytes (stderr %d)", len, is_stderr);
 
-    // Forward data to in channel
-    if (is_stderr) {
-        fwlen = ssh_channel_write_stderr(state->in_channel, data, len);
-    } else {
-        fwlen = ssh_channel_write(state->in_channel, data, len);
+    // Forward data to in channel, consuming only what it or the queue can take
+    fwlen = forward_data(&pair->out_to_in, pair->in_channel, data, len, is_stderr);
+
+    if (fwlen == SSH_ERROR) {
+        // Nowhere to send it, so drop it rather than let it pile up
+        log_error("out_data callback unable to forward data");
+        fwlen = len;
     }
 
-    fprintf(stdout, "out_data callback wrote %d bytes\n", fwlen);
+    log_debug("out_data callback consumed %d bytes", fwlen);
 
     return fwlen;
 }
@@ -34,12 +38,18 @@ void out_eof (ssh_session session, ssh_channel channel, void *userdata)
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
 
-    fprintf(stdout, "out_eof callback called\n");
+    log_info("out_eof callback called");
 
-    // Forward eof to in channel
-    ssh_channel_send_eof(state->in_channel);
+    transcript_write(pair->state->transcript, TRANSCRIPT_OUT, TRANSCRIPT_EOF, pair->id, NULL, 0);
+
+    // Forward eof to in channel once queued data has gone, and the client has accepted it
+    if (pair->in_opening) {
+        pair->out_to_in.eof_pending = 1;
+    } else {
+        forward_eof(&pair->out_to_in, pair->in_channel);
+    }
 }
 
 void out_close (ssh_session session, ssh_channel channel, void *userdata)
@@ -47,12 +57,15 @@ void out_close (ssh_session session, ssh_channel channel, void *userdata)
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
+
+    log_info("out_close callback called");
 
-    fprintf(stdout, "out_close callback called\n");
+    transcript_write(pair->state->transcript, TRANSCRIPT_OUT, TRANSCRIPT_CLOSE, pair->id, NULL, 0);
 
-    // Close in channel
-    destroy_in_channel(state);
+    // Close the pair from channel_service once data queued for the in channel has gone, closing it
+    // here would free channels libssh is still using
+    pair->out_to_in.close_pending = 1;
 }
 
 void out_signal (ssh_session session, ssh_channel channel, const char *signal, void *userdata)
@@ -60,12 +73,14 @@ void out_signal (ssh_session session, ssh_channel channel, const char *signal, v
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
+
+    log_info("out_signal callback called with signal %s", signal);
 
-    fprintf(stdout, "out_signal callback called with signal %s\n", signal);
+    transcript_text(pair->state->transcript, TRANSCRIPT_OUT, TRANSCRIPT_SIGNAL, pair->id, signal, "%s", "");
 
     // Forward to out channel
-    ssh_channel_request_send_signal(state->in_channel, signal);
+    ssh_channel_request_send_signal(pair->in_channel, signal);
 }
 
 void out_exit_status (ssh_session session, ssh_channel channel, int exit_status, void *userdata)
@@ -73,12 +88,14 @@ void out_exit_status (ssh_session session, ssh_channel channel, int exit_status,
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
 
-    fprintf(stdout, "out_exit_status callback called with status %d\n", exit_status);
+    log_info("out_exit_status callback called with status %d", exit_status);
+
+    transcript_text(pair->state->transcript, TRANSCRIPT_OUT, TRANSCRIPT_EXIT_STATUS, pair->id, "exit-status", "%d", exit_status);
 
     // Forward to in channel
-    ssh_channel_request_send_exit_status(state->in_channel, exit_status);
+    ssh_channel_request_send_exit_status(pair->in_channel, exit_status);
 }
 
 void out_exit_signal (ssh_session session, ssh_channel channel, const char *signal, int core, const char *errmsg,
@@ -87,13 +104,16 @@ void out_exit_signal (ssh_session session, ssh_channel channel, const char *sign
     (void)session;
     (void)channel;
 
-    stateptr state = (stateptr) userdata;
+    channelptr pair = (channelptr) userdata;
 
-    fprintf(stdout, "out_exit_signal callback called with signal %s, core %d, error %s, lang %s\n",
+    log_info("out_exit_signal callback called with signal %s, core %d, error %s, lang %s",
         signal, core, errmsg, lang);
 
+    transcript_text(pair->state->transcript, TRANSCRIPT_OUT, TRANSCRIPT_EXIT_SIGNAL, pair->id, signal, "core %d, error %s, lang %s",
+        core, errmsg, lang);
+
     // Forward to in channel
-    ssh_channel_request_send_exit_signal(state->in_channel, signal, core, errmsg, lang);
+    ssh_channel_request_send_exit_signal(pair->in_channel, signal, core, errmsg, lang);
 }
 
 int out_pty_request (ssh_session session, ssh_channel channel, const char *term, int width, int height,
@@ -103,7 +123,7 @@ int out_pty_request (ssh_session session, ssh_channel channel, const char *term,
     (void)channel;
     (void)userdata;
 
-    fprintf(stdout, "out_pty_request_callback callback called with term %s, char dim %dx%d, px dim %dx%d (UNEXPECTED)\n",
+    log_info("out_pty_request_callback callback called with term %s, char dim %dx%d, px dim %dx%d (UNEXPECTED)",
         term, width, height, pxwidth, pxheight);
 
     return -1;
@@ -115,7 +135,7 @@ int out_shell_request (ssh_session session, ssh_channel channel, void *userdata)
     (void)channel;
     (void)userdata;
 
-    fprintf(stdout, "out_shell_request callback called (UNEXPECTED)\n");
+    log_info("out_shell_request callback called (UNEXPECTED)");
 
     return 1;
 }
@@ -126,7 +146,7 @@ void out_auth_agent_req (ssh_session session, ssh_channel channel, void *userdat
     (void)channel;
     (void)userdata;
 
-    fprintf(stdout, "out_auth_agent_req callback called (UNEXPECTED)\n");
+    log_info("out_auth_agent_req callback called (UNEXPECTED)");
 }
 
 void out_x11_req (ssh_session session, ssh_channel channel, int single_connection, const char *auth_protocol,
@@ -136,7 +156,7 @@ void out_x11_req (ssh_session session, ssh_channel channel, int single_connectio
     (void)channel;
     (void)userdata;
 
-    fprintf(stdout, "out_x11_req callback called, single_connection %d, auth protocol %s, auth cookie %s, screen %d (UNEXPECTED)\n",
+    log_info("out_x11_req callback called, single_connection %d, auth protocol %s, auth cookie %s, screen %d (UNEXPECTED)",
         single_connection, auth_protocol, auth_cookie, screen_number);
 }
 
@@ -147,7 +167,7 @@ int out_pty_window_change (ssh_session session, ssh_channel channel, int width,
     (void)channel;
     (void)userdata;
 
-    fprintf(stdout, "out_pty_window_change callback called with char dim %dx%d, px dim %dx%d (UNEXPECTED)\n",
+    log_info("out_pty_window_change callback called with char dim %dx%d, px dim %dx%d (UNEXPECTED)",
         width, height, pxwidth, pxheight);
 
     return -1;
@@ -159,7 +179,7 @@ int out_exec_request (ssh_session session, ssh_channel channel, const char *comm
     (void)channel;
     (void)userdata;
 
-    fprintf(stdout, "out_exec_request callback called, command %s (UNEXPECTED)\n", command);
+    log_info("out_exec_request callback called, command %s (UNEXPECTED)", command);
 
     return 1;
 }
@@ -170,7 +190,7 @@ int out_env_request (ssh_session session, ssh_channel channel, const char *env_n
     (void)channel;
     (void)userdata;
 
-    fprintf(stdout, "out_env_request callback called, %s = '%s' (UNEXPECTED)\n", env_name, env_value);
+    log_info("out_env_request callback called, %s = '%s' (UNEXPECTED)", env_name, env_value);
 
     return 1;
 }
@@ -181,23 +201,48 @@ int out_subsystem_request (ssh_session session, ssh_channel channel, const char
     (void)channel;
     (void)userdata;
 
-    fprintf(stdout, "out_subsystem_request callback called for %s (UNEXPECTED)\n", subsystem);
+    log_info("out_subsystem_request callback called for %s (UNEXPECTED)", subsystem);
 
     return 1;
 }
 
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 10, 0)
+
 int out_write_wontblock (ssh_session session, ssh_channel channel, uint32_t bytes, void *userdata)
 {
     (void)session;
     (void)channel;
-    (void)userdata;
 
-    fprintf(stdout, "out_write_wontblock callback called with bytes = %d\n", bytes);
+    channelptr pair = (channelptr) userdata;
+
+    log_debug("out_write_wontblock callback called with bytes = %d", bytes);
+
+    // Out channel has window again, drain anything held back from the in channel
+    forward_resume(&pair->in_to_out, pair->in_channel, pair->out_channel);
 
     return 0;
 }
 
-struct ssh_channel_callbacks_struct out_channel_callbacks = {
+#else
+
+int out_write_wontblock (ssh_session session, ssh_channel channel, size_t bytes, void *userdata)
+{
+    (void)session;
+    (void)channel;
+
+    channelptr pair = (channelptr) userdata;
+
+    log_debug("out_write_wontblock callback called with bytes = %ld", bytes);
+
+    // Out channel has window again, drain anything held back from the in channel
+    forward_resume(&pair->in_to_out, pair->in_channel, pair->out_channel);
+
+    return 0;
+}
+
+#endif
+
+static const struct ssh_channel_callbacks_struct out_channel_callbacks = {
     .channel_data_function = out_data,
     .channel_eof_function = out_eof,
     .channel_close_function = out_close,
@@ -215,58 +260,110 @@ struct ssh_channel_callbacks_struct out_channel_callbacks = {
     .channel_write_wontblock_function = out_write_wontblock
 };
 
-ssh_channel create_out_channel(stateptr state)
+void set_out_channel(channelptr pair, ssh_channel channel)
 {
-    int ok = 0;
+    // Initialise this channel's copy of the callbacks struct
+    pair->out_channel_callbacks = out_channel_callbacks;
+    ssh_callbacks_init(&pair->out_channel_callbacks);
+    pair->out_channel_callbacks.userdata = pair;
 
-    // Initialise the callbacks struct
-    ssh_callbacks_init(&out_channel_callbacks);
-    out_channel_callbacks.userdata = state;
+    // Set callbacks
+    ssh_set_channel_callbacks(channel, &pair->out_channel_callbacks);
+
+    // Set channel in pair
+    pair->out_channel = channel;
+}
+
+ssh_channel new_out_channel(channelptr pair)
+{
+    ssh_channel channel;
 
     // Already have one?
-    if (state->out_channel) {
-        fprintf(stderr, "create_out_channel: outbound channel already active\n");
+    if (pair->out_channel) {
+        log_error("create_out_channel: outbound channel already active");
+        return NULL;
+    }
+
+    // Create the channel
+    channel = ssh_channel_new(pair->state->out_session);
 
+    if (channel == NULL) {
+        log_error("create_out_channel: unable to create outbound channel");
     } else {
-        // Create the channel
-        state->out_channel = ssh_channel_new(state->out_session);
+        set_out_channel(pair, channel);
+    }
 
-        if (state->out_channel == NULL) {
-            fprintf(stderr, "create_out_channel: unable to create outbound channel\n");
+    return channel;
+}
+
+ssh_channel create_out_channel(channelptr pair)
+{
+    if (new_out_channel(pair) == NULL) return NULL;
 
-        } else {
-            // Set callbacks
-            ssh_set_channel_callbacks(state->out_channel, &out_channel_callbacks);
+    // Open the session
+    if (ssh_channel_open_session(pair->out_channel) != SSH_OK){
+        log_error("create_out_channel: outbound channel could not be established");
 
-            // Open the session
-            if (ssh_channel_open_session(state->out_channel) != SSH_OK){
-                fprintf(stderr, "create_out_channel: outbound channel could not be established\n");
+        // Make sure out channel is destroyed
+        destroy_out_channel(pair);
+    }
 
-            } else {
-                // Finished successfully
-                ok = 1;
+    return pair->out_channel;
+}
 
-            }
-        }
+// Opens an upstream channel for one the client opened, the upstream session is blocking by now
+static ssh_channel open_out_channel(channelptr pair, int type, const char *host, int port, const char *orig_host,
+    int orig_port)
+{
+    int rc;
+
+    if (new_out_channel(pair) == NULL) return NULL;
+
+    switch (type) {
+    case SSH_CHANNEL_DIRECT_TCPIP:
+        rc = ssh_channel_open_forward(pair->out_channel, host, port, orig_host, orig_port);
+        break;
+    case SSH_CHANNEL_X11:
+        rc = ssh_channel_open_x11(pair->out_channel, orig_host, orig_port);
+        break;
+    case SSH_CHANNEL_AUTH_AGENT:
+        rc = ssh_channel_open_auth_agent(pair->out_channel);
+        break;
+    default:
+        rc = SSH_ERROR;
+        break;
     }
 
-    if (!ok) {
-        // Make sure out channel is destroyed
-        destroy_out_channel(state);
+    if (rc != SSH_OK){
+        log_error("open_out_channel: upstream refused channel of type %d: %s", type,
+            ssh_get_error(pair->state->out_session));
+
+        destroy_out_channel(pair);
     }
 
-    return state->out_channel;
+    return pair->out_channel;
+}
+
+ssh_channel create_out_forward(channelptr pair, const char *host, int port, const char *orig_host, int orig_port)
+{
+    return open_out_channel(pair, SSH_CHANNEL_DIRECT_TCPIP, host, port, orig_host, orig_port);
+}
+
+ssh_channel create_out_x11(channelptr pair, const char *orig_host, int orig_port)
+{
+    return open_out_channel(pair, SSH_CHANNEL_X11, NULL, 0, orig_host, orig_port);
+}
+
+ssh_channel create_out_auth_agent(channelptr pair)
+{
+    return open_out_channel(pair, SSH_CHANNEL_AUTH_AGENT, NULL, 0, NULL, 0);
 }
 
-void destroy_out_channel(stateptr state)
+void destroy_out_channel(channelptr pair)
 {
-    if (state->out_channel) {
-        ssh_channel_close(state->out_channel);
-        ssh_channel_free(state->out_channel);
-        state->out_channel = NULL;
-
-        if (state->in_channel == NULL) {
-            state->finished = 1;
-        }
+    if (pair->out_channel) {
+        ssh_channel_close(pair->out_channel);
+        ssh_channel_free(pair->out_channel);
+        pair->out_channel = NULL;
     }
 }
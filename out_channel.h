@@ -1,6 +1,11 @@
 #include <libssh/libssh.h>
 
-#include "state.h"
+#include "channel.h"
 
-ssh_channel create_out_channel(stateptr state);
-void destroy_out_channel(stateptr state);
+ssh_channel create_out_channel(channelptr pair);
+ssh_channel create_out_forward(channelptr pair, const char *host, int port, const char *orig_host, int orig_port);
+ssh_channel create_out_x11(channelptr pair, const char *orig_host, int orig_port);
+ssh_channel create_out_auth_agent(channelptr pair);
+ssh_channel new_out_channel(channelptr pair);
+void set_out_channel(channelptr pair, ssh_channel channel);
+void destroy_out_channel(channelptr pair);
@@ -0,0 +1,552 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "output.h"
+#include "log.h"
+
+// No liburing, the raw interface is small enough for the one operation we need
+
+#define SLOT_FREE    0
+#define SLOT_FILLING 1
+#define SLOT_QUEUED  2
+
+struct output_slot {
+    int fd;
+    int state;
+    uint64_t offset;        // File offset of data[0]
+    uint32_t start;         // Bytes already written, after a short write
+    uint32_t len;
+    char *data;             // Registered buffer, index matches the slot
+};
+
+struct output_ring {
+    int fd;
+
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+
+    unsigned to_submit;     // Queued since the last io_uring_enter
+};
+
+static int backend = OUTPUT_WRITE;
+
+static struct output_ring ring = { .fd = -1 };
+static struct output_slot slots[OUTPUT_SLOTS];
+static char *slot_memory = NULL;
+
+static int free_slots[OUTPUT_SLOTS];
+static int free_count = 0;
+static int filling = -1;    // Slot collecting the current run of writes
+static int enter_failures = 0;  // In a row, gives up on io_uring at OUTPUT_ENTER_RETRIES
+
+// Files waiting to be synced and closed, off the capture thread so it keeps draining the pipes
+struct output_closing {
+    struct output_closing *next;
+    int fd;
+};
+
+static pthread_t closer_thread;
+static int closer_started = 0;
+static int closer_stopping = 0;
+static pthread_mutex_t closing_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t closing_cond = PTHREAD_COND_INITIALIZER;
+static struct output_closing *closing_head = NULL;
+static struct output_closing **closing_tail = &closing_head;
+
+const char *output_name(int which)
+{
+    switch (which) {
+    case OUTPUT_URING: return "io_uring";
+    case OUTPUT_WRITE: return "write";
+    default: return "auto";
+    }
+}
+
+static void uring_teardown(void)
+{
+    if (ring.sqes) munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_ptr && ring.cq_ptr != ring.sq_ptr) munmap(ring.cq_ptr, ring.cq_size);
+    if (ring.sq_ptr) munmap(ring.sq_ptr, ring.sq_size);
+    if (ring.fd >= 0) close(ring.fd);
+
+    free(slot_memory);
+
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+    slot_memory = NULL;
+}
+
+static void *map_ring(size_t size, off_t offset)
+{
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, offset);
+
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static int uring_setup(void)
+{
+    struct io_uring_params params;
+    struct iovec iov[OUTPUT_SLOTS];
+    char *sq, *cq;
+    int i;
+
+    memset(&params, 0, sizeof(params));
+
+    ring.fd = syscall(__NR_io_uring_setup, OUTPUT_SLOTS, &params);
+    if (ring.fd < 0) {
+        log_info("io_uring unavailable: %s", strerror(errno));
+        return -1;
+    }
+
+    ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_size > ring.sq_size) ring.sq_size = ring.cq_size;
+        ring.cq_size = ring.sq_size;
+    }
+
+    ring.sq_ptr = map_ring(ring.sq_size, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == NULL) {
+        log_warn("Unable to map io_uring: %s", strerror(errno));
+        uring_teardown();
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ptr = ring.sq_ptr;
+    } else {
+        ring.cq_ptr = map_ring(ring.cq_size, IORING_OFF_CQ_RING);
+    }
+
+    ring.sqes = map_ring(ring.sqes_size, IORING_OFF_SQES);
+
+    if (ring.cq_ptr == NULL || ring.sqes == NULL) {
+        log_warn("Unable to map io_uring: %s", strerror(errno));
+        uring_teardown();
+        return -1;
+    }
+
+    sq = ring.sq_ptr;
+    cq = ring.cq_ptr;
+    ring.sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring.cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring.cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    // Register the buffers once so the kernel doesn't pin pages on every write
+    slot_memory = aligned_alloc(4096, (size_t) OUTPUT_SLOTS * OUTPUT_SLOT_SIZE);
+    if (slot_memory == NULL) {
+        log_warn("Unable to allocate io_uring buffers");
+        uring_teardown();
+        return -1;
+    }
+
+    for (i = 0; i < OUTPUT_SLOTS; i++) {
+        slots[i].data = slot_memory + (size_t) i * OUTPUT_SLOT_SIZE;
+        slots[i].state = SLOT_FREE;
+        iov[i].iov_base = slots[i].data;
+        iov[i].iov_len = OUTPUT_SLOT_SIZE;
+        free_slots[i] = i;
+    }
+    free_count = OUTPUT_SLOTS;
+
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov, OUTPUT_SLOTS) < 0) {
+        log_warn("Unable to register io_uring buffers: %s", strerror(errno));
+        uring_teardown();
+        return -1;
+    }
+
+    return 0;
+}
+
+static void pwrite_all(int fd, uint64_t offset, const char *data, size_t len)
+{
+    ssize_t written;
+
+    while (len > 0) {
+        written = pwrite(fd, data, len, offset);
+
+        if (written <= 0) {
+            if (written < 0 && errno == EINTR) continue;
+            log_error("Error writing capture file: %s", written < 0 ? strerror(errno) : "no progress");
+            return;
+        }
+
+        data += written;
+        offset += written;
+        len -= written;
+    }
+}
+
+static void uring_queue(int i)
+{
+    struct output_slot *slot = &slots[i];
+    struct io_uring_sqe *sqe;
+    unsigned tail, index;
+
+    // There are as many ring entries as slots, so there's always room
+    tail = *ring.sq_tail;
+    index = tail & *ring.sq_mask;
+    sqe = &ring.sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = slot->fd;
+    sqe->addr = (uint64_t) (uintptr_t) (slot->data + slot->start);
+    sqe->len = slot->len - slot->start;
+    sqe->off = slot->offset + slot->start;
+    sqe->buf_index = i;
+    sqe->user_data = i;
+
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    slot->state = SLOT_QUEUED;
+    ++ring.to_submit;
+}
+
+static void uring_reap(void)
+{
+    struct io_uring_cqe *cqe;
+    struct output_slot *slot;
+    unsigned head, tail;
+    int i;
+
+    head = *ring.cq_head;
+    tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        cqe = &ring.cqes[head & *ring.cq_mask];
+        i = (int) cqe->user_data;
+        slot = &slots[i];
+        ++head;
+
+        if (cqe->res < 0) {
+            log_error("Error writing capture file: %s", strerror(-cqe->res));
+        } else if (cqe->res == 0 && slot->start < slot->len) {
+            log_error("Error writing capture file: no progress");
+        } else if (slot->start + (uint32_t) cqe->res < slot->len) {
+            // Short write, send the rest
+            slot->start += cqe->res;
+            uring_queue(i);
+            continue;
+        }
+
+        slot->state = SLOT_FREE;
+        free_slots[free_count++] = i;
+    }
+
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+// io_uring keeps failing, write out what it still holds and carry on with pwrite
+static void uring_abandon(void)
+{
+    int i;
+
+    log_error("Capture writes falling back to write after %d io_uring errors", enter_failures);
+
+    // Anything already in flight is written again with the same data, which is harmless
+    for (i = 0; i < OUTPUT_SLOTS; i++) {
+        if (slots[i].state != SLOT_FREE && slots[i].start < slots[i].len) {
+            pwrite_all(slots[i].fd, slots[i].offset + slots[i].start, slots[i].data + slots[i].start,
+                slots[i].len - slots[i].start);
+        }
+        slots[i].state = SLOT_FREE;
+    }
+
+    uring_teardown();
+    free_count = 0;
+    filling = -1;
+    enter_failures = 0;
+    backend = OUTPUT_WRITE;
+}
+
+static void uring_enter(unsigned min_complete)
+{
+    int rc;
+
+    // Given up on since the caller checked
+    if (backend != OUTPUT_URING) return;
+
+    do {
+        rc = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, min_complete,
+            min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+
+    if (rc < 0) {
+        log_error("Error submitting capture writes: %s", strerror(errno));
+        if (++enter_failures >= OUTPUT_ENTER_RETRIES) {
+            uring_abandon();
+            return;
+        }
+    } else {
+        enter_failures = 0;
+        ring.to_submit -= rc;
+    }
+
+    uring_reap();
+}
+
+// -1 once io_uring has been given up on
+static int uring_get_slot(void)
+{
+    // Out of buffers is the only time the caller waits for the disk
+    while (backend == OUTPUT_URING && free_count == 0) {
+        uring_enter(1);
+    }
+
+    if (backend != OUTPUT_URING) return -1;
+
+    return free_slots[--free_count];
+}
+
+static void uring_queue_filling(void)
+{
+    if (filling < 0) return;
+
+    uring_queue(filling);
+    filling = -1;
+
+    if (ring.to_submit >= OUTPUT_BATCH) {
+        uring_enter(0);
+    }
+}
+
+static void uring_write(int fd, uint64_t offset, const char *data, size_t len)
+{
+    struct output_slot *slot;
+    size_t n;
+
+    while (len > 0) {
+        // Runs of writes to the same place in the same file share a slot
+        if (filling >= 0) {
+            slot = &slots[filling];
+            if (slot->fd != fd || slot->offset + slot->len != offset || slot->len == OUTPUT_SLOT_SIZE) {
+                uring_queue_filling();
+            }
+        }
+
+        if (filling < 0) {
+            filling = uring_get_slot();
+            if (filling < 0) {
+                pwrite_all(fd, offset, data, len);
+                return;
+            }
+            slot = &slots[filling];
+            slot->fd = fd;
+            slot->offset = offset;
+            slot->start = 0;
+            slot->len = 0;
+            slot->state = SLOT_FILLING;
+        }
+
+        slot = &slots[filling];
+        n = OUTPUT_SLOT_SIZE - slot->len;
+        if (n > len) n = len;
+
+        memcpy(slot->data + slot->len, data, n);
+        slot->len += n;
+
+        data += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+static int uring_busy(int fd)
+{
+    int i;
+
+    for (i = 0; i < OUTPUT_SLOTS; i++) {
+        if (slots[i].state == SLOT_QUEUED && slots[i].fd == fd) return 1;
+    }
+
+    return 0;
+}
+
+static void *closer_main(void *arg)
+{
+    struct output_closing *files, *file;
+
+    (void)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&closing_lock);
+        while (closing_head == NULL && !closer_stopping) {
+            pthread_cond_wait(&closing_cond, &closing_lock);
+        }
+        files = closing_head;
+        closing_head = NULL;
+        closing_tail = &closing_head;
+        pthread_mutex_unlock(&closing_lock);
+
+        if (files == NULL) break;
+
+        while (files) {
+            file = files;
+            files = file->next;
+
+            fsync(file->fd);
+            close(file->fd);
+            free(file);
+        }
+    }
+
+    return NULL;
+}
+
+static void closer_start(void)
+{
+    int rc;
+
+    closer_stopping = 0;
+
+    rc = pthread_create(&closer_thread, NULL, closer_main, NULL);
+    if (rc != 0) {
+        // Files are synced on the capture thread instead
+        log_warn("Unable to start capture closer thread: %s", strerror(rc));
+        return;
+    }
+
+    closer_started = 1;
+}
+
+// Waits for every queued file to be synced and closed
+static void closer_stop(void)
+{
+    if (!closer_started) return;
+
+    pthread_mutex_lock(&closing_lock);
+    closer_stopping = 1;
+    pthread_cond_signal(&closing_cond);
+    pthread_mutex_unlock(&closing_lock);
+
+    pthread_join(closer_thread, NULL);
+
+    closer_started = 0;
+}
+
+// 0 if the closer thread has it
+static int closer_queue(int fd)
+{
+    struct output_closing *file;
+
+    if (!closer_started) return -1;
+
+    file = malloc(sizeof(struct output_closing));
+    if (file == NULL) return -1;
+
+    file->fd = fd;
+    file->next = NULL;
+
+    pthread_mutex_lock(&closing_lock);
+    *closing_tail = file;
+    closing_tail = &file->next;
+    pthread_cond_signal(&closing_cond);
+    pthread_mutex_unlock(&closing_lock);
+
+    return 0;
+}
+
+int output_init(int which)
+{
+    backend = OUTPUT_WRITE;
+
+    if (!closer_started) closer_start();
+
+    if (which != OUTPUT_WRITE) {
+        if (uring_setup() == 0) {
+            backend = OUTPUT_URING;
+        } else if (which == OUTPUT_URING) {
+            log_warn("Falling back to write for capture output");
+        }
+    }
+
+    log_info("Capture output using %s", output_name(backend));
+
+    return backend;
+}
+
+void output_write(int fd, uint64_t offset, const void *data, size_t len)
+{
+    if (backend == OUTPUT_URING) {
+        uring_write(fd, offset, data, len);
+    } else {
+        pwrite_all(fd, offset, data, len);
+    }
+}
+
+void output_submit(void)
+{
+    if (backend != OUTPUT_URING) return;
+
+    uring_queue_filling();
+
+    // Also picks up any completions, so slots come back without waiting
+    uring_enter(0);
+}
+
+void output_close(int fd, int sync)
+{
+    if (backend == OUTPUT_URING) {
+        if (filling >= 0 && slots[filling].fd == fd) {
+            uring_queue_filling();
+        }
+
+        while (backend == OUTPUT_URING && uring_busy(fd)) {
+            uring_enter(1);
+        }
+    }
+
+    // Every write has completed, only the sync can take long
+    if (sync && closer_queue(fd) == 0) return;
+
+    if (sync) fsync(fd);
+    close(fd);
+}
+
+void output_cleanup(void)
+{
+    closer_stop();
+
+    if (backend != OUTPUT_URING) return;
+
+    uring_queue_filling();
+
+    while (backend == OUTPUT_URING && free_count < OUTPUT_SLOTS) {
+        uring_enter(1);
+    }
+    if (backend != OUTPUT_URING) return;
+
+    uring_teardown();
+    backend = OUTPUT_WRITE;
+}
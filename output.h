@@ -0,0 +1,31 @@
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * File output for the capture thread. Not thread safe, only the capture
+ * thread (or a benchmark standing in for it) may call these.
+ *
+ * With io_uring, writes are copied into registered buffers, coalesced and
+ * submitted in batches, and output_write only waits when every buffer is in
+ * flight. Otherwise they're plain pwrite calls.
+ *
+ * output_close with sync hands the fsync and close to a closer thread once the
+ * file's writes are done, so rotating files never stalls the pipe reader.
+ * output_cleanup waits for it to finish them.
+ */
+
+#define OUTPUT_AUTO  0          // io_uring if the kernel allows it, else write
+#define OUTPUT_URING 1
+#define OUTPUT_WRITE 2
+
+#define OUTPUT_SLOTS 32                     // Registered buffers, and the ring size
+#define OUTPUT_SLOT_SIZE (128 * 1024)
+#define OUTPUT_BATCH 8                      // Submit once this many writes are queued
+#define OUTPUT_ENTER_RETRIES 8              // io_uring_enter failures in a row before falling back to write
+
+int output_init(int backend);
+const char *output_name(int backend);
+void output_write(int fd, uint64_t offset, const void *data, size_t len);
+void output_submit(void);
+void output_close(int fd, int sync);
+void output_cleanup(void);
@@ -1,26 +1,56 @@
 #include <stdio.h>
+#include <unistd.h>
 #include <libssh/libssh.h>
 
 #include "state.h"
+#include "capture.h"
+#include "log.h"
 
-void set_pcap(stateptr state){
-    if(!state->pcap_file) return;
+static ssh_pcap_file open_pcap(stateptr state, const char *leg){
+    char file_name[64];
+    ssh_pcap_file pcap;
+    int fd;
 
-    state->pcap = ssh_pcap_file_new();
+    if(!state->config->pcap_file) return NULL;
 
-    if(ssh_pcap_file_open(state->pcap, state->pcap_file) == SSH_ERROR){
-        fprintf(stderr, "Error opening pcap file %s\n", state->pcap_file);
-        ssh_pcap_file_free(state->pcap);
-        state->pcap = NULL;
-        return;
+    // libssh writes into a pipe, the capture thread does the file handling and rotation
+    fd = capture_open_pipe(state->id, leg);
+    if(fd < 0) return NULL;
+
+    snprintf(file_name, sizeof(file_name), "/proc/self/fd/%d", fd);
+
+    pcap = ssh_pcap_file_new();
+
+    if(pcap == NULL || ssh_pcap_file_open(pcap, file_name) == SSH_ERROR){
+        log_error("[%d] Error opening %s leg pcap pipe", state->id, leg);
+        if(pcap) ssh_pcap_file_free(pcap);
+        pcap = NULL;
     }
 
-    ssh_set_pcap_file(state->in_session, state->pcap);
+    // libssh has its own descriptor now, closing it ends the capture
+    close(fd);
+
+    return pcap;
+}
+
+void set_in_pcap(stateptr state){
+    state->in_pcap = open_pcap(state, "in");
+    if(state->in_pcap) ssh_set_pcap_file(state->in_session, state->in_pcap);
+}
+
+void set_out_pcap(stateptr state){
+    state->out_pcap = open_pcap(state, "out");
+    if(state->out_pcap) ssh_set_pcap_file(state->out_session, state->out_pcap);
 }
 
 void cleanup_pcap(stateptr state){
-    if (state->pcap) {
-        ssh_pcap_file_free(state->pcap);
-        state->pcap = NULL;
+    if (state->in_pcap) {
+        ssh_pcap_file_free(state->in_pcap);
+        state->in_pcap = NULL;
+    }
+
+    if (state->out_pcap) {
+        ssh_pcap_file_free(state->out_pcap);
+        state->out_pcap = NULL;
     }
 }
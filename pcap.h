@@ -1,4 +1,5 @@
 #include "state.h"
 
-void set_pcap(stateptr state);
+void set_in_pcap(stateptr state);
+void set_out_pcap(stateptr state);
 void cleanup_pcap(stateptr state);
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libssh/libssh.h>
+
+#include "pool.h"
+#include "log.h"
+
+static time_t monotonic_seconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec;
+}
+
+static int same_target(struct pool_entry *entry, const char *host, int port)
+{
+    return (entry->port == port && strcmp(entry->host, host) == 0);
+}
+
+static void free_entry(poolptr pool, struct pool_entry *entry)
+{
+    if (entry->session) {
+        ssh_event_remove_session(pool->event, entry->session);
+        ssh_disconnect(entry->session);
+        ssh_free(entry->session);
+    }
+
+    free(entry);
+}
+
+static struct pool_entry *new_entry(poolptr pool, const char *host, int port)
+{
+    struct pool_entry *entry;
+
+    entry = calloc(1, sizeof(struct pool_entry));
+    if (entry == NULL) {
+        log_error("Unable to allocate pool entry");
+        return NULL;
+    }
+
+    entry->host = host;
+    entry->port = port;
+    entry->created = monotonic_seconds();
+
+    do {
+        entry->session = ssh_new();
+        if (entry->session == NULL) {
+            log_error("Unable to create new session");
+            break;
+        }
+
+        ssh_options_set(entry->session, SSH_OPTIONS_LOG_VERBOSITY, &pool->log_level);
+        ssh_options_set(entry->session, SSH_OPTIONS_HOST, host);
+        ssh_options_set(entry->session, SSH_OPTIONS_PORT, &port);
+
+        // Start connecting, pool_service picks up the result
+        ssh_set_blocking(entry->session, 0);
+
+        if (ssh_connect(entry->session) == SSH_ERROR) {
+            log_error("Error making pooled connection to %s:%d: %s", host, port, ssh_get_error(entry->session));
+            break;
+        }
+
+        if (ssh_event_add_session(pool->event, entry->session) != SSH_OK) {
+            log_error("Error adding pooled session to polling context");
+            break;
+        }
+
+        return entry;
+    } while (0);
+
+    free_entry(pool, entry);
+
+    return NULL;
+}
+
+static int entry_dead(poolptr pool, struct pool_entry *entry, time_t now)
+{
+    int rc;
+
+    if (!entry->ready) {
+        // Still handshaking, see if it has finished
+        rc = ssh_connect(entry->session);
+
+        if (rc == SSH_OK) {
+            entry->ready = 1;
+        } else if (rc == SSH_ERROR) {
+            log_error("Pooled connection to %s:%d failed: %s", entry->host, entry->port,
+                ssh_get_error(entry->session));
+            return 1;
+        } else if (now >= entry->created + pool->connect_timeout) {
+            log_error("Pooled connection to %s:%d timed out", entry->host, entry->port);
+            return 1;
+        }
+    }
+
+    if (ssh_get_status(entry->session) & (SSH_CLOSED | SSH_CLOSED_ERROR)) return 1;
+
+    // Retire before the upstream gives up on us
+    if (now >= entry->created + POOL_MAX_AGE) return 1;
+
+    return 0;
+}
+
+void pool_init(poolptr pool, int size, int log_level, int connect_timeout, ssh_event event)
+{
+    pool->size = size;
+    pool->log_level = log_level;
+    pool->connect_timeout = connect_timeout;
+    pool->event = event;
+    pool->entries = NULL;
+}
+
+// Returns when it next needs calling even if nothing happens on the pooled connections, 0 for never
+time_t pool_service(poolptr pool, const char *host, int port)
+{
+    struct pool_entry **link = &pool->entries;
+    struct pool_entry *entry;
+    time_t now = monotonic_seconds();
+    time_t due = 0;
+    int count = 0;
+
+    if (pool->size == 0) return 0;
+
+    // Advance handshakes and drop dead or stale connections
+    while ((entry = *link) != NULL) {
+        if (same_target(entry, host, port) && entry_dead(pool, entry, now)) {
+            *link = entry->next;
+            free_entry(pool, entry);
+        } else {
+            if (same_target(entry, host, port)) ++count;
+            link = &entry->next;
+        }
+    }
+
+    // Top up
+    while (count < pool->size) {
+        entry = new_entry(pool, host, port);
+        if (entry == NULL) {
+            due = now + POOL_RETRY_SECS;
+            break;
+        }
+
+        entry->next = pool->entries;
+        pool->entries = entry;
+        ++count;
+    }
+
+    // Handshake timeouts and retirements, other targets have their own call
+    for (entry = pool->entries; entry; entry = entry->next) {
+        if (!same_target(entry, host, port)) continue;
+
+        if (!entry->ready && (due == 0 || entry->created + pool->connect_timeout < due)) {
+            due = entry->created + pool->connect_timeout;
+        }
+        if (due == 0 || entry->created + POOL_MAX_AGE < due) {
+            due = entry->created + POOL_MAX_AGE;
+        }
+    }
+
+    return due;
+}
+
+// Closes every connection to a target that is no longer being sent sessions
+void pool_drop(poolptr pool, const char *host, int port)
+{
+    struct pool_entry **link = &pool->entries;
+    struct pool_entry *entry;
+
+    while ((entry = *link) != NULL) {
+        if (same_target(entry, host, port)) {
+            *link = entry->next;
+            free_entry(pool, entry);
+        } else {
+            link = &entry->next;
+        }
+    }
+}
+
+ssh_session pool_take(poolptr pool, const char *host, int port)
+{
+    struct pool_entry **link = &pool->entries;
+    struct pool_entry *entry;
+    ssh_session session;
+    time_t now = monotonic_seconds();
+
+    while ((entry = *link) != NULL) {
+        // Ones past their age are left for pool_service to close
+        if (entry->ready && same_target(entry, host, port) && now < entry->created + POOL_MAX_AGE &&
+            !(ssh_get_status(entry->session) & (SSH_CLOSED | SSH_CLOSED_ERROR))) {
+            // Hand over the session, it stays in the event
+            *link = entry->next;
+
+            session = entry->session;
+            free(entry);
+
+            return session;
+        }
+
+        link = &entry->next;
+    }
+
+    return NULL;
+}
+
+void pool_cleanup(poolptr pool)
+{
+    struct pool_entry *entry;
+
+    while ((entry = pool->entries) != NULL) {
+        pool->entries = entry->next;
+        free_entry(pool, entry);
+    }
+}
@@ -0,0 +1,39 @@
+#include <time.h>
+#include <libssh/libssh.h>
+
+#ifndef POOL_H
+#define POOL_H
+
+// Pooled connections are recycled before the upstream's login grace time (120s for OpenSSH) drops them
+#define POOL_MAX_AGE 60
+
+#define POOL_RETRY_SECS 1       // Wait between attempts to top up after a failed connect
+
+struct pool_entry {
+    struct pool_entry *next;
+
+    ssh_session session;
+    const char *host;
+    int port;
+
+    int ready;              // Connected and keys exchanged
+    time_t created;
+};
+
+struct pool_struct {
+    int size;               // Number of connections to keep per target
+    int log_level;
+    int connect_timeout;
+    ssh_event event;
+
+    struct pool_entry *entries;
+};
+typedef struct pool_struct *poolptr;
+
+void pool_init(poolptr pool, int size, int log_level, int connect_timeout, ssh_event event);
+time_t pool_service(poolptr pool, const char *host, int port);
+ssh_session pool_take(poolptr pool, const char *host, int port);
+void pool_drop(poolptr pool, const char *host, int port);
+void pool_cleanup(poolptr pool);
+
+#endif
@@ -0,0 +1,710 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <libssh/libssh.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "transcript.h"
+#include "histogram.h"
+
+/*
+ * Replays the client side of sessions recorded with --transcript against an
+ * sshd, or sshdump in front of one: the channels the client opened, its
+ * requests and the data it sent, at the recorded pace, N times it, or as fast
+ * as the server takes it. What comes back is read and counted, and each file
+ * appends a line of JSON to a results file as bench_client does:
+ *
+ *   response   data sent on a channel until the first reply on it, which for
+ *              a pty is keystroke to echo
+ *   late       how far behind the recording each record went out, which grows
+ *              when the server can't keep up
+ *
+ * Packet captures are encrypted so can't be replayed, and transcripts don't
+ * record the login, so that is given here. X11, agent and remote forwarding
+ * need something on this end to answer them, so are skipped and counted.
+ */
+
+#define REPLAY_CHUNK (32 * 1024)
+#define REPLAY_SLICE_MS 10          // Longest between reads of what the server sends back
+#define REPLAY_MAX_CHANNELS 65536
+
+struct replay_config {
+    const char *host;
+    int port;
+    const char *user;
+    const char *password;           // Public key auth when NULL
+    double speed;                   // Times the recorded pace, 0 for as fast as possible
+    int linger;                     // Seconds to wait for output after the last record
+};
+
+struct replay_channel {
+    ssh_channel channel;
+    uint64_t awaiting;              // When data went out that hasn't had a reply yet, 0 if none
+};
+
+struct replay {
+    struct replay_config *config;
+    ssh_session session;
+
+    // Indexed by the channel id in the transcript
+    struct replay_channel *channels;
+    ssh_channel *readable;          // NULL terminated, for ssh_channel_select
+    uint32_t channel_size;
+    int open;
+
+    uint64_t records;
+    uint64_t skipped;
+    uint64_t sent;
+    uint64_t received;
+    struct histogram response;
+    struct histogram late;
+};
+
+static char *read_file(const char *file_name, size_t *len)
+{
+    FILE *f;
+    char *data, *grown;
+    size_t size = 1024 * 1024, got;
+
+    f = fopen(file_name, "r");
+    if (f == NULL) {
+        perror(file_name);
+        return NULL;
+    }
+
+    *len = 0;
+    data = malloc(size);
+
+    while (data && (got = fread(data + *len, 1, size - *len, f)) > 0) {
+        *len += got;
+
+        if (*len == size) {
+            grown = realloc(data, size * 2);
+            if (grown == NULL) {
+                free(data);
+                data = NULL;
+                break;
+            }
+
+            data = grown;
+            size *= 2;
+        }
+    }
+
+    if (data == NULL) {
+        fprintf(stderr, "Out of memory reading %s\n", file_name);
+    } else if (ferror(f)) {
+        perror(file_name);
+        free(data);
+        data = NULL;
+    }
+
+    fclose(f);
+
+    return data;
+}
+
+#ifdef HAVE_ZSTD
+// The frames one after another, the seek table is a skippable frame so it's passed over
+static char *decompress(const char *compressed, size_t compressed_len, size_t *len)
+{
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer in = { compressed, compressed_len, 0 };
+    ZSTD_outBuffer out;
+    char *data, *grown;
+    size_t size = compressed_len * 4 + REPLAY_CHUNK, rc;
+
+    dctx = ZSTD_createDCtx();
+    data = malloc(size);
+    out.dst = data;
+    out.size = size;
+    out.pos = 0;
+
+    while (dctx && data) {
+        if (out.pos == out.size) {
+            grown = realloc(data, size * 2);
+            if (grown == NULL) {
+                free(data);
+                data = NULL;
+                break;
+            }
+
+            data = grown;
+            size *= 2;
+            out.dst = data;
+            out.size = size;
+        }
+
+        rc = ZSTD_decompressStream(dctx, &out, &in);
+        if (ZSTD_isError(rc)) {
+            fprintf(stderr, "Error decompressing transcript: %s\n", ZSTD_getErrorName(rc));
+            free(data);
+            data = NULL;
+            break;
+        }
+
+        // Room left over means nothing is held back
+        if (in.pos == in.size && out.pos < out.size) break;
+    }
+
+    if (dctx == NULL || data == NULL) {
+        fprintf(stderr, "Unable to decompress transcript\n");
+        free(data);
+        data = NULL;
+    }
+
+    ZSTD_freeDCtx(dctx);
+    *len = out.pos;
+
+    return data;
+}
+#endif
+
+static char *load_transcript(const char *file_name, size_t *len)
+{
+    struct transcript_header header;
+    size_t name_len = strlen(file_name);
+    char *data;
+#ifdef HAVE_ZSTD
+    char *compressed;
+#endif
+
+    data = read_file(file_name, len);
+    if (data == NULL) return NULL;
+
+    if (name_len > 4 && strcmp(file_name + name_len - 4, ".zst") == 0) {
+#ifdef HAVE_ZSTD
+        compressed = data;
+        data = decompress(compressed, *len, len);
+        free(compressed);
+        if (data == NULL) return NULL;
+#else
+        fprintf(stderr, "%s is compressed, build with ZSTD=1 to replay it\n", file_name);
+        free(data);
+        return NULL;
+#endif
+    }
+
+    if (*len >= sizeof(header)) {
+        memcpy(&header, data, sizeof(header));
+    }
+
+    if (*len < sizeof(header) || memcmp(header.magic, TRANSCRIPT_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != TRANSCRIPT_VERSION) {
+        fprintf(stderr, "%s is not a version %d transcript\n", file_name, TRANSCRIPT_VERSION);
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+static ssh_session replay_connect(struct replay_config *config)
+{
+    ssh_session session;
+    int rc;
+
+    session = ssh_new();
+    if (session == NULL) return NULL;
+
+    ssh_options_set(session, SSH_OPTIONS_HOST, config->host);
+    ssh_options_set(session, SSH_OPTIONS_PORT, &config->port);
+    ssh_options_set(session, SSH_OPTIONS_USER, config->user);
+
+    // A test target, nothing to verify
+    if (ssh_connect(session) != SSH_OK) {
+        fprintf(stderr, "Error connecting to %s:%d: %s\n", config->host, config->port, ssh_get_error(session));
+        ssh_free(session);
+        return NULL;
+    }
+
+    if (config->password) {
+        rc = ssh_userauth_password(session, NULL, config->password);
+    } else {
+        rc = ssh_userauth_publickey_auto(session, NULL, NULL);
+    }
+
+    if (rc != SSH_AUTH_SUCCESS) {
+        fprintf(stderr, "Error authenticating: %s\n", ssh_get_error(session));
+        ssh_disconnect(session);
+        ssh_free(session);
+        return NULL;
+    }
+
+    return session;
+}
+
+static struct replay_channel *find_channel(struct replay *replay, uint32_t id, int create)
+{
+    struct replay_channel *grown;
+    ssh_channel *readable;
+    uint32_t size;
+
+    if (id >= REPLAY_MAX_CHANNELS) return NULL;
+
+    if (id >= replay->channel_size) {
+        if (!create) return NULL;
+
+        size = replay->channel_size ? replay->channel_size : 16;
+        while (size <= id) size *= 2;
+
+        grown = realloc(replay->channels, size * sizeof(struct replay_channel));
+        if (grown == NULL) return NULL;
+        memset(grown + replay->channel_size, 0, (size - replay->channel_size) * sizeof(struct replay_channel));
+        replay->channels = grown;
+
+        readable = realloc(replay->readable, (size + 1) * sizeof(ssh_channel));
+        if (readable == NULL) return NULL;
+        replay->readable = readable;
+
+        replay->channel_size = size;
+    }
+
+    if (!create && replay->channels[id].channel == NULL) return NULL;
+
+    return &replay->channels[id];
+}
+
+// Reads whatever the server has sent without waiting for more
+static void drain(struct replay *replay)
+{
+    static char buffer[REPLAY_CHUNK];
+    struct replay_channel *channel;
+    uint32_t id;
+    int is_stderr, n;
+
+    for (id = 0; id < replay->channel_size; id++) {
+        channel = &replay->channels[id];
+        if (channel->channel == NULL) continue;
+
+        for (is_stderr = 0; is_stderr < 2; is_stderr++) {
+            while ((n = ssh_channel_read_nonblocking(channel->channel, buffer, sizeof(buffer), is_stderr)) > 0) {
+                replay->received += n;
+
+                if (channel->awaiting) {
+                    histogram_record(&replay->response, histogram_now() - channel->awaiting);
+                    channel->awaiting = 0;
+                }
+            }
+        }
+    }
+}
+
+// Reads what the server sends until the time given, or briefly if there's nothing to wait for
+static void wait_until(struct replay *replay, uint64_t due)
+{
+    struct timeval timeout;
+    struct timespec pause;
+    uint64_t now, wait;
+    uint32_t id;
+    int count;
+
+    for (;;) {
+        drain(replay);
+
+        now = histogram_now();
+        if (now >= due) return;
+
+        wait = due - now;
+        if (wait > (uint64_t) REPLAY_SLICE_MS * 1000000) wait = (uint64_t) REPLAY_SLICE_MS * 1000000;
+
+        count = 0;
+        for (id = 0; id < replay->channel_size; id++) {
+            if (replay->channels[id].channel && !ssh_channel_is_eof(replay->channels[id].channel)) {
+                replay->readable[count++] = replay->channels[id].channel;
+            }
+        }
+
+        if (count == 0) {
+            pause.tv_sec = 0;
+            pause.tv_nsec = wait;
+            nanosleep(&pause, NULL);
+        } else {
+            replay->readable[count] = NULL;
+            timeout.tv_sec = 0;
+            timeout.tv_usec = wait / 1000;
+            ssh_channel_select(replay->readable, NULL, NULL, &timeout);
+        }
+    }
+}
+
+static void close_channel(struct replay *replay, struct replay_channel *channel)
+{
+    ssh_channel_close(channel->channel);
+    ssh_channel_free(channel->channel);
+    channel->channel = NULL;
+    channel->awaiting = 0;
+    --replay->open;
+}
+
+// "host:port", the last colon so IPv6 addresses survive
+static const char *split_port(char *text, int *port)
+{
+    char *colon = strrchr(text, ':');
+
+    if (colon == NULL) return NULL;
+
+    *colon = '\x0';
+    *port = atoi(colon + 1);
+
+    return text;
+}
+
+static ssh_channel open_channel(struct replay *replay, const char *type, char *args)
+{
+    ssh_channel channel;
+    char *orig;
+    const char *host, *orig_host;
+    int port, orig_port, rc = SSH_ERROR;
+
+    channel = ssh_channel_new(replay->session);
+    if (channel == NULL) return NULL;
+
+    if (strcmp(type, "session") == 0) {
+        rc = ssh_channel_open_session(channel);
+
+    } else {
+        // direct-tcpip, "host:port originator:port"
+        orig = strchr(args, ' ');
+        if (orig) *orig++ = '\x0';
+
+        host = split_port(args, &port);
+        orig_host = orig ? split_port(orig, &orig_port) : NULL;
+
+        if (host && orig_host) {
+            rc = ssh_channel_open_forward(channel, host, port, orig_host, orig_port);
+        }
+    }
+
+    if (rc != SSH_OK) {
+        fprintf(stderr, "Error opening %s channel: %s\n", type, ssh_get_error(replay->session));
+        ssh_channel_free(channel);
+        return NULL;
+    }
+
+    return channel;
+}
+
+static int request(struct replay *replay, ssh_channel channel, const char *name, char *args)
+{
+    char term[64];
+    char *value;
+    int width, height;
+
+    if (strcmp(name, "pty-req") == 0) {
+        if (sscanf(args, "%63s %dx%d", term, &width, &height) != 3) return SSH_ERROR;
+        return ssh_channel_request_pty_size(channel, term, width, height);
+    }
+
+    if (strcmp(name, "window-change") == 0) {
+        if (sscanf(args, "%dx%d", &width, &height) != 2) return SSH_ERROR;
+        return ssh_channel_change_pty_size(channel, width, height);
+    }
+
+    if (strcmp(name, "shell") == 0) return ssh_channel_request_shell(channel);
+    if (strcmp(name, "exec") == 0) return ssh_channel_request_exec(channel, args);
+    if (strcmp(name, "subsystem") == 0) return ssh_channel_request_subsystem(channel, args);
+
+    if (strcmp(name, "env") == 0) {
+        value = strchr(args, '=');
+        if (value == NULL) return SSH_ERROR;
+        *value++ = '\x0';
+        return ssh_channel_request_env(channel, args, value);
+    }
+
+    // x11-req and auth-agent-req
+    ++replay->skipped;
+
+    return SSH_OK;
+}
+
+static int apply(struct replay *replay, struct transcript_record *record, const char *payload)
+{
+    struct replay_channel *channel;
+    char text[1024] = "";
+    char *args = text;
+    size_t name_len;
+    int rc = SSH_OK;
+
+    channel = find_channel(replay, record->channel, record->type == TRANSCRIPT_OPEN);
+    if (channel == NULL) {
+        // Connection wide, or on a channel that was skipped
+        ++replay->skipped;
+        return 0;
+    }
+
+    // Everything but data is a name, a NUL and the arguments
+    if (record->type != TRANSCRIPT_DATA && record->type != TRANSCRIPT_STDERR) {
+        if (record->len >= sizeof(text)) return -1;
+
+        memcpy(text, payload, record->len);
+        text[record->len] = '\x0';
+
+        name_len = strlen(text);
+        args = name_len < record->len ? text + name_len + 1 : text + name_len;
+    }
+
+    switch (record->type) {
+    case TRANSCRIPT_OPEN:
+        if (strcmp(text, "session") != 0 && strcmp(text, "direct-tcpip") != 0) {
+            ++replay->skipped;
+            break;
+        }
+
+        if (channel->channel) close_channel(replay, channel);
+
+        channel->channel = open_channel(replay, text, args);
+        if (channel->channel == NULL) return -1;
+        ++replay->open;
+        break;
+
+    case TRANSCRIPT_REQUEST:
+        rc = request(replay, channel->channel, text, args);
+        break;
+
+    case TRANSCRIPT_DATA:
+    case TRANSCRIPT_STDERR:
+        if (record->type == TRANSCRIPT_DATA) {
+            rc = ssh_channel_write(channel->channel, payload, record->len);
+        } else {
+            rc = ssh_channel_write_stderr(channel->channel, payload, record->len);
+        }
+        if (rc != (int) record->len) return -1;
+
+        replay->sent += record->len;
+        if (channel->awaiting == 0) channel->awaiting = histogram_now();
+        rc = SSH_OK;
+        break;
+
+    case TRANSCRIPT_EOF:
+        rc = ssh_channel_send_eof(channel->channel);
+        break;
+
+    case TRANSCRIPT_CLOSE:
+        drain(replay);
+        close_channel(replay, channel);
+        break;
+
+    case TRANSCRIPT_SIGNAL:
+        rc = ssh_channel_request_send_signal(channel->channel, text);
+        break;
+
+    default:
+        ++replay->skipped;
+        break;
+    }
+
+    if (rc != SSH_OK) {
+        fprintf(stderr, "Error replaying %s: %s\n", record->type == TRANSCRIPT_REQUEST ? text : "record",
+            ssh_get_error(replay->session));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int all_eof(struct replay *replay)
+{
+    uint32_t id;
+
+    for (id = 0; id < replay->channel_size; id++) {
+        if (replay->channels[id].channel && !ssh_channel_is_eof(replay->channels[id].channel)) return 0;
+    }
+
+    return 1;
+}
+
+static int replay_file(struct replay *replay, const char *file_name, double *seconds)
+{
+    struct replay_config *config = replay->config;
+    struct transcript_record record;
+    char *data;
+    size_t len, offset;
+    uint64_t start, first = 0, due, now, deadline;
+    uint32_t id;
+    int rc = 0;
+
+    data = load_transcript(file_name, &len);
+    if (data == NULL) return -1;
+
+    replay->session = replay_connect(config);
+    if (replay->session == NULL) {
+        free(data);
+        return -1;
+    }
+
+    start = histogram_now();
+
+    for (offset = sizeof(struct transcript_header); offset + sizeof(record) <= len;
+            offset += sizeof(record) + record.len) {
+        memcpy(&record, data + offset, sizeof(record));
+
+        // A transcript copied while its session was still going
+        if (record.len > len - offset - sizeof(record)) {
+            fprintf(stderr, "%s is cut short, replaying what's there\n", file_name);
+            break;
+        }
+
+        if (record.direction != TRANSCRIPT_IN) continue;
+
+        if (first == 0) first = record.timestamp;
+
+        if (config->speed > 0) {
+            due = start + (uint64_t) ((record.timestamp - first) / config->speed);
+            wait_until(replay, due);
+
+            now = histogram_now();
+            histogram_record(&replay->late, now - due);
+        } else {
+            drain(replay);
+        }
+
+        if (apply(replay, &record, data + offset + sizeof(record)) != 0) {
+            rc = -1;
+            break;
+        }
+
+        ++replay->records;
+    }
+
+    // What the last of the input set off, a download say
+    deadline = histogram_now() + (uint64_t) config->linger * 1000000000;
+    while (rc == 0 && replay->open > 0 && !all_eof(replay) && histogram_now() < deadline) {
+        wait_until(replay, histogram_now() + (uint64_t) REPLAY_SLICE_MS * 1000000);
+    }
+    drain(replay);
+
+    *seconds = (histogram_now() - start) / 1e9;
+
+    for (id = 0; id < replay->channel_size; id++) {
+        if (replay->channels[id].channel) close_channel(replay, &replay->channels[id]);
+    }
+
+    ssh_disconnect(replay->session);
+    ssh_free(replay->session);
+    replay->session = NULL;
+
+    free(data);
+
+    return rc;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stdout, "Usage:\n");
+    fprintf(stdout, "%s <args> <transcript>...\n", prog);
+    fprintf(stdout, "Where args are:\n");
+    fprintf(stdout, " -H | --host <name>        Host to connect to. Default 127.0.0.1\n");
+    fprintf(stdout, " -P | --port <num>         Port to connect to. Default 9000\n");
+    fprintf(stdout, " -u | --user <name>        User to log in as. Default bench\n");
+    fprintf(stdout, " -w | --password <text>    Password to log in with. Default public key auth\n");
+    fprintf(stdout, " -s | --speed <factor>     Replay this many times faster than recorded. Default 1\n");
+    fprintf(stdout, " -f | --fast               Replay as fast as the server takes it\n");
+    fprintf(stdout, " -l | --linger <secs>      Time to wait for output after the last record. Default 5\n");
+    fprintf(stdout, " -n | --name <text>        Name for this run in the results. Default replay\n");
+    fprintf(stdout, " -o | --output <file>      File to append the results to. Default replay-results.json\n");
+}
+
+int main(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        {"host",        required_argument, 0, 'H'},
+        {"port",        required_argument, 0, 'P'},
+        {"user",        required_argument, 0, 'u'},
+        {"password",    required_argument, 0, 'w'},
+        {"speed",       required_argument, 0, 's'},
+        {"fast",        no_argument,       0, 'f'},
+        {"linger",      required_argument, 0, 'l'},
+        {"name",        required_argument, 0, 'n'},
+        {"output",      required_argument, 0, 'o'},
+        {"help",        no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+    struct replay_config config = { "127.0.0.1", 9000, "bench", NULL, 1, 5 };
+    const char *name = "replay";
+    const char *output = "replay-results.json";
+    struct replay *replay;
+    double seconds;
+    int c, failed, rc = 0;
+    FILE *f;
+
+    while ((c = getopt_long(argc, argv, "H:P:u:w:s:fl:n:o:h", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'H': config.host = optarg; break;
+        case 'P': config.port = atoi(optarg); break;
+        case 'u': config.user = optarg; break;
+        case 'w': config.password = optarg; break;
+        case 's': config.speed = atof(optarg); break;
+        case 'f': config.speed = 0; break;
+        case 'l': config.linger = atoi(optarg); break;
+        case 'n': name = optarg; break;
+        case 'o': output = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.port < 1 || config.port > 65535 || config.speed < 0 || config.linger < 0 || optind == argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    ssh_init();
+
+    for (; optind < argc; optind++) {
+        replay = calloc(1, sizeof(struct replay));
+        if (replay == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            rc = 1;
+            break;
+        }
+        replay->config = &config;
+
+        seconds = 0;
+        failed = replay_file(replay, argv[optind], &seconds) != 0;
+        if (failed) rc = 1;
+
+        printf("%-8s  %s  %.1fs  sent %llu  received %llu  response us p50 %.1f p99 %.1f  late us p99 %.1f"
+            "  skipped %llu%s\n", name, argv[optind], seconds, (unsigned long long) replay->sent,
+            (unsigned long long) replay->received, histogram_percentile(&replay->response, 50) / 1e3,
+            histogram_percentile(&replay->response, 99) / 1e3, histogram_percentile(&replay->late, 99) / 1e3,
+            (unsigned long long) replay->skipped, failed ? "  FAILED" : "");
+
+        // One object per line, speed 0 is as fast as possible
+        f = fopen(output, "a");
+        if (f == NULL) {
+            perror(output);
+            rc = 1;
+        } else {
+            fprintf(f, "{\"name\": \"%s\", \"file\": \"%s\", \"speed\": %.2f, \"failed\": %d, \"seconds\": %.3f, "
+                "\"records\": %llu, \"skipped\": %llu, \"sent_bytes\": %llu, \"received_bytes\": %llu, "
+                "\"received_mb_s\": %.2f, \"responses\": %llu, \"response_p50_us\": %.1f, "
+                "\"response_p99_us\": %.1f, \"response_max_us\": %.1f, \"late_p99_us\": %.1f, "
+                "\"late_max_us\": %.1f}\n",
+                name, argv[optind], config.speed, failed, seconds, (unsigned long long) replay->records,
+                (unsigned long long) replay->skipped, (unsigned long long) replay->sent,
+                (unsigned long long) replay->received, seconds > 0 ? replay->received / 1048576.0 / seconds : 0,
+                (unsigned long long) replay->response.count, histogram_percentile(&replay->response, 50) / 1e3,
+                histogram_percentile(&replay->response, 99) / 1e3, replay->response.max / 1e3,
+                histogram_percentile(&replay->late, 99) / 1e3, replay->late.max / 1e3);
+            fclose(f);
+        }
+
+        free(replay->channels);
+        free(replay->readable);
+        free(replay);
+    }
+
+    ssh_finalize();
+
+    return rc;
+}
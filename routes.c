@@ -0,0 +1,420 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "routes.h"
+#include "log.h"
+
+static pthread_mutex_t routes_lock = PTHREAD_MUTEX_INITIALIZER;
+static routesptr current = NULL;
+
+static const char *routes_file = NULL;
+static int routes_default_port = 22;
+
+// Reloads are parsed on their own thread, workers only ever swap pointers
+static int reload_fd = -1;
+static int stop_fd = -1;
+static pthread_t routes_thread;
+static int routes_started = 0;
+
+static void free_table(routesptr routes)
+{
+    free(routes->slots);
+    free(routes->names);
+    free(routes->targets);
+    free(routes);
+}
+
+static routesptr new_table(int capacity)
+{
+    routesptr routes;
+    uint32_t size = 16;
+
+    while (size < (uint32_t) capacity * ROUTES_MAX_LOAD) size <<= 1;
+
+    routes = calloc(1, sizeof(struct route_table));
+    if (routes == NULL) return NULL;
+
+    routes->slots = calloc(size, sizeof(struct route));
+    routes->mask = size - 1;
+    routes->names_size = 4096;
+    routes->names = malloc(routes->names_size);
+    routes->target_size = 16;
+    routes->targets = malloc(routes->target_size * sizeof(struct upstream_struct));
+
+    if (routes->slots == NULL || routes->names == NULL || routes->targets == NULL) {
+        free_table(routes);
+        return NULL;
+    }
+
+    return routes;
+}
+
+// FNV-1a, never 0 as that marks an empty slot
+static uint32_t hash_name(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    }
+
+    return hash ? hash : 1;
+}
+
+// The slot holding name, or the empty one it would go in
+static struct route *find_slot(routesptr routes, const char *name, size_t len, uint32_t hash)
+{
+    struct route *slot;
+    uint32_t i;
+
+    for (i = hash & routes->mask;; i = (i + 1) & routes->mask) {
+        slot = &routes->slots[i];
+
+        if (slot->hash == 0) return slot;
+
+        if (slot->hash == hash && memcmp(routes->names + slot->login, name, len) == 0 &&
+                routes->names[slot->login + len] == '\x0') {
+            return slot;
+        }
+    }
+}
+
+static int append_name(routesptr routes, const char *name, size_t len, uint32_t *offset)
+{
+    char *grown;
+
+    while (routes->names_len + len + 1 > routes->names_size) {
+        grown = realloc(routes->names, routes->names_size * 2);
+        if (grown == NULL) return -1;
+
+        routes->names = grown;
+        routes->names_size *= 2;
+    }
+
+    *offset = routes->names_len;
+    memcpy(routes->names + routes->names_len, name, len);
+    routes->names[routes->names_len + len] = '\x0';
+    routes->names_len += len + 1;
+
+    return 0;
+}
+
+// Index of the target, parsing it the first time it's seen. by_text maps target text to index
+static int add_target(routesptr routes, routesptr by_text, const char *text, size_t len, int default_port)
+{
+    struct upstream_struct *grown;
+    struct route *slot;
+    uint32_t hash;
+
+    hash = hash_name(text, len);
+    slot = find_slot(by_text, text, len, hash);
+    if (slot->hash) return slot->target;
+
+    if (routes->target_count == routes->target_size) {
+        grown = realloc(routes->targets, routes->target_size * 2 * sizeof(struct upstream_struct));
+        if (grown == NULL) return -1;
+
+        routes->targets = grown;
+        routes->target_size *= 2;
+    }
+
+    if (upstream_parse(&routes->targets[routes->target_count], text, len, default_port) != 0 ||
+            append_name(by_text, text, len, &slot->login) != 0) {
+        return -1;
+    }
+
+    slot->hash = hash;
+    slot->target = routes->target_count;
+
+    return routes->target_count++;
+}
+
+// Splits off the next whitespace separated word, NULL at the end of the line or a comment
+static const char *next_word(char **line, size_t *len)
+{
+    char *word = *line;
+
+    while (isspace((unsigned char) *word)) ++word;
+    if (*word == '\x0' || *word == '#') return NULL;
+
+    *line = word;
+    while (**line && !isspace((unsigned char) **line)) ++*line;
+    *len = *line - word;
+
+    return word;
+}
+
+static int parse_routes(FILE *file, routesptr routes, routesptr by_text, int default_port)
+{
+    char *line = NULL;
+    char *rest;
+    const char *login, *target;
+    size_t size = 0, login_len, target_len, extra_len;
+    struct route *slot;
+    uint32_t hash;
+    int number = 0, index, rc = 0;
+
+    while (rc == 0 && getline(&line, &size, file) >= 0) {
+        ++number;
+        rest = line;
+
+        login = next_word(&rest, &login_len);
+        if (login == NULL) continue;
+
+        target = next_word(&rest, &target_len);
+        if (target == NULL || next_word(&rest, &extra_len) != NULL) {
+            log_error("Line %d of %s should be a login and a host[:port]", number, routes_file);
+            rc = -1;
+            continue;
+        }
+
+        hash = hash_name(login, login_len);
+        slot = find_slot(routes, login, login_len, hash);
+        if (slot->hash) {
+            log_error("Line %d of %s routes %.*s again", number, routes_file, (int) login_len, login);
+            rc = -1;
+            continue;
+        }
+
+        index = add_target(routes, by_text, target, target_len, default_port);
+        if (index < 0 || append_name(routes, login, login_len, &slot->login) != 0) {
+            log_error("Unable to add the route on line %d of %s", number, routes_file);
+            rc = -1;
+            continue;
+        }
+
+        slot->hash = hash;
+        slot->target = index;
+        ++routes->count;
+    }
+
+    if (ferror(file)) {
+        log_error("Unable to read %s: %s", routes_file, strerror(errno));
+        rc = -1;
+    }
+
+    free(line);
+
+    return rc;
+}
+
+int routes_load(const char *file_name, int default_port)
+{
+    routesptr routes = NULL, by_text = NULL, old;
+    FILE *file;
+    int lines = 0, c, rc = -1;
+
+    routes_file = file_name;
+    routes_default_port = default_port;
+
+    file = fopen(file_name, "r");
+    if (file == NULL) {
+        log_error("Unable to open routes file %s: %s", file_name, strerror(errno));
+        return -1;
+    }
+
+    do {
+        // Size the table once from the line count, so it never has to grow
+        while ((c = getc(file)) != EOF) {
+            if (c == '\n') ++lines;
+        }
+        rewind(file);
+
+        routes = new_table(lines + 1);
+        by_text = new_table(lines + 1);
+        if (routes == NULL || by_text == NULL) {
+            log_error("Unable to allocate routes");
+            break;
+        }
+
+        if (parse_routes(file, routes, by_text, default_port) != 0) break;
+
+        routes->refs = 1;
+
+        // Lookups in progress keep the old table until they're done with it
+        pthread_mutex_lock(&routes_lock);
+        old = current;
+        current = routes;
+        pthread_mutex_unlock(&routes_lock);
+
+        if (old) routes_put(old);
+
+        log_info("Loaded %d routes to %d upstreams from %s", routes->count, routes->target_count, file_name);
+
+        routes = NULL;
+        rc = 0;
+    } while (0);
+
+    fclose(file);
+    if (routes) free_table(routes);
+    if (by_text) free_table(by_text);
+
+    return rc;
+}
+
+void routes_request_reload(void)
+{
+    uint64_t value = 1;
+    int fd = reload_fd;
+
+    // Called from the signal handler, where write is safe
+    if (fd >= 0 && write(fd, &value, sizeof(value)) < 0) {
+        // Nothing safe to log with here, the next SIGHUP tries again
+    }
+}
+
+static void *routes_main(void *arg)
+{
+    struct pollfd fds[2];
+    uint64_t value;
+
+    (void)arg;
+
+    fds[0].fd = reload_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stop_fd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            log_error("Routes reload poll failed: %s", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents) break;
+
+        if (fds[0].revents & POLLIN) {
+            if (read(reload_fd, &value, sizeof(value)) < 0) continue;
+
+            // Sessions carry on routing with the old table meanwhile
+            if (routes_load(routes_file, routes_default_port) != 0) {
+                log_error("Keeping the previous routes");
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Call after the first routes_load
+int routes_start(void)
+{
+    int rc;
+
+    do {
+        reload_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        stop_fd = eventfd(0, EFD_CLOEXEC);
+        if (reload_fd < 0 || stop_fd < 0) {
+            log_error("Unable to create routes eventfd: %s", strerror(errno));
+            break;
+        }
+
+        rc = pthread_create(&routes_thread, NULL, routes_main, NULL);
+        if (rc != 0) {
+            log_error("Unable to start routes thread: %s", strerror(rc));
+            break;
+        }
+
+        routes_started = 1;
+
+        return 0;
+    } while (0);
+
+    routes_stop();
+
+    return -1;
+}
+
+void routes_stop(void)
+{
+    uint64_t value = 1;
+    int fd = reload_fd;
+
+    // Before it's closed, so a late SIGHUP doesn't write to whatever reuses the descriptor
+    reload_fd = -1;
+
+    if (routes_started) {
+        if (write(stop_fd, &value, sizeof(value)) < 0) {
+            log_error("Unable to stop routes thread: %s", strerror(errno));
+        }
+        pthread_join(routes_thread, NULL);
+        routes_started = 0;
+    }
+
+    if (fd >= 0) close(fd);
+    if (stop_fd >= 0) close(stop_fd);
+    stop_fd = -1;
+}
+
+routesptr routes_get(void)
+{
+    routesptr routes;
+
+    pthread_mutex_lock(&routes_lock);
+    routes = current;
+    if (routes) ++routes->refs;
+    pthread_mutex_unlock(&routes_lock);
+
+    return routes;
+}
+
+void routes_put(routesptr routes)
+{
+    int refs;
+
+    if (routes == NULL) return;
+
+    pthread_mutex_lock(&routes_lock);
+    refs = --routes->refs;
+    pthread_mutex_unlock(&routes_lock);
+
+    if (refs == 0) free_table(routes);
+}
+
+upstreamptr routes_lookup(routesptr routes, const char *login, size_t *user_len)
+{
+    struct route *slot;
+    const char *at;
+    size_t len;
+
+    if (routes == NULL || login[0] == '@') return NULL;
+
+    len = strlen(login);
+    *user_len = len;
+
+    slot = find_slot(routes, login, len, hash_name(login, len));
+    if (slot->hash) return &routes->targets[slot->target];
+
+    // user@name, the @ is part of the key so it can't collide with a plain login
+    at = strrchr(login, '@');
+    if (at == NULL) return NULL;
+
+    slot = find_slot(routes, at, len - (at - login), hash_name(at, len - (at - login)));
+    if (slot->hash == 0) return NULL;
+
+    *user_len = at - login;
+
+    return &routes->targets[slot->target];
+}
+
+void routes_cleanup(void)
+{
+    routesptr old;
+
+    pthread_mutex_lock(&routes_lock);
+    old = current;
+    current = NULL;
+    pthread_mutex_unlock(&routes_lock);
+
+    routes_put(old);
+}
@@ -0,0 +1,58 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "upstream.h"
+
+#ifndef ROUTES_H
+#define ROUTES_H
+
+/*
+ * Picks the upstream from the login name. Each line of the routes file is
+ *
+ *     <login> <host[:port]>
+ *
+ * with # comments. A login of @name routes user@name logins, which are sent
+ * upstream as just user, so clients can only reach the targets listed. An
+ * exact login match wins over an @name one, and logins with no route go to
+ * --host as before. Reloaded on SIGHUP by swapping in a new table, parsed on
+ * the routes thread so no event loop waits for it. Sessions hold a reference
+ * to the table their upstream came from.
+ */
+
+#define ROUTES_MAX_LOAD 2           // Slots kept at least this many times the routes
+
+struct route {
+    uint32_t hash;                  // 0 for an empty slot
+    uint32_t login;                 // Offset into names
+    uint32_t target;                // Index into targets
+};
+
+struct route_table {
+    int refs;                       // Sessions using it, plus one while it's current
+    int count;
+
+    // Open addressing, linear probing, a power of two in size
+    struct route *slots;
+    uint32_t mask;
+
+    char *names;                    // NUL terminated logins back to back
+    size_t names_len;
+    size_t names_size;
+
+    // Shared by every login routed to the same place
+    struct upstream_struct *targets;
+    int target_count;
+    int target_size;
+};
+typedef struct route_table *routesptr;
+
+int routes_load(const char *file, int default_port);
+void routes_request_reload(void);
+int routes_start(void);
+void routes_stop(void);
+routesptr routes_get(void);
+void routes_put(routesptr routes);
+upstreamptr routes_lookup(routesptr routes, const char *login, size_t *user_len);
+void routes_cleanup(void);
+
+#endif
@@ -0,0 +1,1037 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <libssh/libssh.h>
+#include <libssh/server.h>
+
+#include "state.h"
+#include "pcap.h"
+#include "channel.h"
+#include "session.h"
+#include "listener.h"
+#include "handoff.h"
+#include "pool.h"
+#include "keys.h"
+#include "server.h"
+#include "log.h"
+
+static volatile sig_atomic_t terminate = 0;
+static volatile sig_atomic_t draining = 0;
+static volatile sig_atomic_t stats_requested = 0;     // Bumped for each SIGUSR1
+
+static int next_id = 0;     // Connection ids are unique across all workers
+
+// Every worker's latency for the last SIGUSR1, logged by the last worker to add its own
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct histogram stats_total[2];
+static int stats_round = 0;         // The stats_requested the totals are for
+static int stats_reported = 0;      // Workers that have added theirs
+static int stats_workers = 0;       // Workers in their poll loop
+static int stats_logged = 0;
+
+// Every worker's wake_fd, so a signal caught on any thread reaches them all
+static int wake_fds[SERVER_MAX_WORKERS];
+static volatile sig_atomic_t wake_count = 0;
+
+// Every worker's listen sockets, in worker order, for handing over to a replacement
+static int listen_fds[LISTENER_MAX];
+static int listen_count = 0;
+
+void server_wake(void)
+{
+    uint64_t value = 1;
+    int i;
+
+    // Called from signal handlers
+    for (i = 0; i < wake_count; i++) {
+        if (write(wake_fds[i], &value, sizeof(value)) < 0) {
+            // Already has a wakeup pending
+        }
+    }
+}
+
+void server_request_stats(void)
+{
+    // Called from signal handlers
+    ++stats_requested;
+    server_wake();
+}
+
+void server_stop(void)
+{
+    terminate = 1;
+    server_wake();
+}
+
+void server_drain(void)
+{
+    // Called from signal handlers
+    draining = 1;
+    server_wake();
+}
+
+static int wake_callback(socket_t fd, int revents, void *userdata)
+{
+    (void)userdata;
+
+    uint64_t value;
+
+    // Just clear it, the loop checks for work whenever it wakes
+    if (revents & POLLIN) {
+        if (read(fd, &value, sizeof(value)) < 0) {
+            // Nothing pending after all
+        }
+    }
+
+    return 0;
+}
+
+static void session_timer(timerptr timer, void *arg)
+{
+    (void)timer;
+
+    stateptr state = (stateptr) arg;
+
+    if (state->handshake) {
+        log_error("[%d] Timed out %s", state->id, (!state->in_ready ? "exchanging keys on inbound connection" :
+            !state->out_session ? "waiting for a login to route" : "connecting to upstream"));
+        if (state->in_ready && !state->out_session) {
+            // Keys were exchanged, the client never sent a login to route on
+            ++state->server->metrics.login_timeouts;
+        } else if (state->out_ready || !state->out_session) {
+            ++state->server->metrics.kex_failures;
+        } else {
+            ++state->server->metrics.connect_failures;
+            upstream_failed(state->upstream);
+        }
+        state->finished = 1;
+    } else {
+        transcript_service(state->transcript);
+    }
+}
+
+int open_outbound_connection(stateptr state)
+{
+    configptr config = state->config;
+    upstreamptr upstream = state->upstream;
+    int rc;
+
+    state->out_session = ssh_new();
+    if (state->out_session == NULL) {
+        log_error("Unable to create new session");
+        return -1;
+    }
+
+    ssh_options_set(state->out_session, SSH_OPTIONS_LOG_VERBOSITY, &config->log_level);
+    ssh_options_set(state->out_session, SSH_OPTIONS_HOST, upstream->host);
+    ssh_options_set(state->out_session, SSH_OPTIONS_PORT, &upstream->port);
+
+    // Capture the out leg from the first packet
+    set_out_pcap(state);
+
+    // Start connecting to server, handshake_step finishes the job
+    log_info("[%d] Connecting to %s:%d", state->id, upstream->host, upstream->port);
+
+    ssh_set_blocking(state->out_session, 0);
+
+    state->connect_started = histogram_now();
+
+    rc = ssh_connect(state->out_session);
+    if (rc == SSH_ERROR) {
+        log_error("[%d] Error making outbound connection: %s", state->id, ssh_get_error(state->out_session));
+        ++state->server->metrics.connect_failures;
+        upstream_failed(upstream);
+        return -1;
+    }
+
+    return 0;
+}
+
+// With routes, the upstream is picked once the first auth request names the user. Takes a pooled connection
+// or starts one, and handshake_step carries on connecting like any other
+static int route_session(stateptr state, const char *login)
+{
+    serverptr server = state->server;
+    upstreamptr upstream;
+    size_t user_len;
+
+    do {
+        state->login = strdup(login);
+        if (state->login == NULL) {
+            log_error("[%d] Unable to allocate login", state->id);
+            break;
+        }
+
+        // Logins without a route go to --host
+        state->routes = routes_get();
+        upstream = routes_lookup(state->routes, login, &user_len);
+        if (upstream) {
+            upstream_use(upstream);
+        } else {
+            upstream = upstream_pick();
+            user_len = strlen(login);
+        }
+        state->upstream = upstream;
+
+        state->out_user = strndup(login, user_len);
+        if (state->out_user == NULL) {
+            log_error("[%d] Unable to allocate login", state->id);
+            break;
+        }
+
+        log_info("[%d] Routing %s to %s:%d as %s", state->id, login, upstream->host, upstream->port,
+            state->out_user);
+
+        state->out_session = pool_take(&server->pool, upstream->host, upstream->port);
+
+        if (state->out_session) {
+            log_info("[%d] Using pooled connection to %s:%d", state->id, upstream->host, upstream->port);
+
+            // Already in the event and past key exchange
+            state->out_ready = 1;
+            ssh_set_blocking(state->out_session, 1);
+            set_out_pcap(state);
+
+        } else {
+            if (open_outbound_connection(state) != 0) {
+                break;
+            }
+
+            if (ssh_event_add_session(server->event, state->out_session) != SSH_OK) {
+                log_error("[%d] Error adding out session to polling context", state->id);
+                break;
+            }
+        }
+
+        return 0;
+    } while (0);
+
+    return -1;
+}
+
+// Publickey auth upstream needs our own keys, without them it's bound to fail so isn't worth a connection
+static int can_proxy_auth(ssh_message message)
+{
+    keyptr keys;
+
+    if (ssh_message_subtype(message) != SSH_AUTH_METHOD_PUBLICKEY) return 1;
+
+    keys = keys_get();
+    keys_put(keys);
+
+    return keys != NULL;
+}
+
+// Until routes have an upstream, the inbound session has no callbacks so libssh queues its messages. The
+// first auth request says who is logging in, and is kept to be answered once the upstream is ready.
+// ssh-userauth is accepted here, the upstream is asked for it when auth is proxied
+static int wait_for_login(stateptr state)
+{
+    ssh_message message;
+
+    while ((message = ssh_message_get(state->in_session)) != NULL) {
+        if (ssh_message_type(message) == SSH_REQUEST_AUTH && can_proxy_auth(message)) {
+            state->auth_message = message;
+            return route_session(state, ssh_message_auth_user(message));
+        }
+
+        if (ssh_message_type(message) == SSH_REQUEST_AUTH) {
+            log_warn("[%d] Refusing publickey auth, no key files to authenticate upstream with", state->id);
+            ssh_set_auth_methods(state->in_session, SSH_AUTH_METHOD_PASSWORD);
+            ssh_message_reply_default(message);
+            ssh_message_free(message);
+            continue;
+        }
+
+        if (ssh_message_type(message) == SSH_REQUEST_SERVICE) {
+            ssh_message_service_reply_success(message);
+        } else {
+            log_info("[%d] Rejecting message of type %d before login", state->id, ssh_message_type(message));
+            ssh_message_reply_default(message);
+        }
+        ssh_message_free(message);
+    }
+
+    return 0;
+}
+
+static void open_transcript(stateptr state)
+{
+    char file_name[1024];
+
+    if (!state->config->transcript_file) return;
+
+    // Each connection gets its own transcript, suffixed with the connection id. Ids restart in every process,
+    // so the pid keeps a replacement from appending to the files of the one it's taking over from
+    snprintf(file_name, sizeof(file_name), "%s.%d.%d%s", state->config->transcript_file, (int) getpid(), state->id,
+        state->config->compress_level ? ".zst" : "");
+
+    state->transcript = transcript_open(file_name, state->id);
+}
+
+// Client address as text, empty if it can't be had
+static void peer_address(int fd, char *buf, size_t len)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+
+    buf[0] = '\x0';
+
+    if (getpeername(fd, (struct sockaddr *) &addr, &addr_len) != 0) return;
+
+    if (addr.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((struct sockaddr_in *) &addr)->sin_addr, buf, len);
+    } else if (addr.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &addr)->sin6_addr, buf, len);
+    }
+}
+
+static stateptr new_state(serverptr server)
+{
+    stateptr state;
+
+    state = calloc(1, sizeof(struct state_struct));
+    if (state == NULL) {
+        log_error("Unable to allocate connection state");
+        return NULL;
+    }
+
+    state->server = server;
+    state->config = server->config;
+    state->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+    timer_init(&state->timer, session_timer, state);
+
+    return state;
+}
+
+static void free_state(stateptr state)
+{
+    // Detach from the event loop first so no more callbacks arrive
+    stop_session(state);
+    timer_cancel(&state->server->timers, &state->timer);
+
+    channels_free(state);
+
+    // Refers to the session, so goes first
+    if (state->auth_message) {
+        ssh_message_free(state->auth_message);
+        state->auth_message = NULL;
+    }
+
+    if (state->in_session) {
+        ssh_disconnect(state->in_session);
+        ssh_free(state->in_session);
+        state->in_session = NULL;
+    }
+
+    if (state->out_session) {
+        ssh_disconnect(state->out_session);
+        ssh_free(state->out_session);
+        state->out_session = NULL;
+    }
+
+    cleanup_pcap(state);
+
+    transcript_close(state->transcript);
+    state->transcript = NULL;
+
+    if (state->upstream) {
+        upstream_release(state->upstream);
+    }
+    routes_put(state->routes);
+    free(state->login);
+    free(state->out_user);
+    free(state->user);
+
+    free(state);
+}
+
+static void accept_connection(serverptr server, int listen_fd)
+{
+    stateptr state;
+    int fd;
+    int ok = 0;
+
+    // Take the connection off our listen queue
+    fd = listener_accept(listen_fd);
+    if (fd < 0) {
+        return;
+    }
+
+    state = new_state(server);
+    if (state == NULL) {
+        close(fd);
+        return;
+    }
+
+    peer_address(fd, state->source, sizeof(state->source));
+
+    do {
+        // Create new in_session
+        state->in_session = ssh_new();
+        if (state->in_session == NULL) {
+            log_error("Unable to create new session");
+            break;
+        }
+
+        // Start pcap capture on the in_session
+        set_in_pcap(state);
+
+        // Start the decrypted channel transcript
+        open_transcript(state);
+
+        // Hand the socket to libssh
+        if (ssh_bind_accept_fd(server->bind, state->in_session, fd) == SSH_ERROR) {
+            log_error("Error accepting a connection: %s", ssh_get_error(server->bind));
+            break;
+        }
+        log_info("[%d] Accepted a connection on worker %d", state->id, server->worker);
+
+        // Start key exchange on the inbound connection
+        log_info("[%d] Exchanging keys on inbound connection...", state->id);
+
+        ssh_set_blocking(state->in_session, 0);
+
+        if (ssh_handle_key_exchange(state->in_session) == SSH_ERROR) {
+            log_error("[%d] ssh_handle_key_exchange errored: %s", state->id, ssh_get_error(state->in_session));
+            ++server->metrics.kex_failures;
+            break;
+        }
+
+        // Both handshakes are driven by the shared event from here on
+        if (ssh_event_add_session(server->event, state->in_session) != SSH_OK) {
+            log_error("[%d] Error adding in session to polling context", state->id);
+            break;
+        }
+
+        // With routes the upstream depends on the username, so route_session connects it once that's known
+        if (!server->config->routes_file) {
+            // Use a warm upstream connection if there is one, otherwise start one alongside
+            state->upstream = upstream_pick();
+            state->out_session = pool_take(&server->pool, state->upstream->host, state->upstream->port);
+
+            if (state->out_session) {
+                log_info("[%d] Using pooled connection to %s:%d", state->id,
+                    state->upstream->host, state->upstream->port);
+
+                state->out_ready = 1;
+                ssh_set_blocking(state->out_session, 1);
+
+                // Key exchange already happened, capture starts from here
+                set_out_pcap(state);
+
+            } else {
+                if (open_outbound_connection(state) != 0) {
+                    break;
+                }
+
+                if (ssh_event_add_session(server->event, state->out_session) != SSH_OK) {
+                    log_error("[%d] Error adding out session to polling context", state->id);
+                    break;
+                }
+
+            }
+        }
+
+        state->handshake = 1;
+        timer_arm(&server->timers, &state->timer, timer_now() + (uint64_t) server->config->connect_timeout * 1000);
+
+        ok = 1;
+    } while (0);
+
+    if (ok) {
+        // Add to the list of sessions
+        state->next = server->sessions;
+        server->sessions = state;
+        ++server->session_count;
+        ++server->metrics.sessions;
+        ++server->metrics.sessions_total;
+    } else {
+        // The socket is only owned by the session once libssh has accepted it
+        if (state->in_session == NULL || ssh_get_fd(state->in_session) != fd) {
+            close(fd);
+        }
+        free_state(state);
+    }
+}
+
+static void handshake_step(stateptr state)
+{
+    int rc;
+
+    if (!state->in_ready) {
+        rc = ssh_handle_key_exchange(state->in_session);
+
+        if (rc == SSH_OK) {
+            log_info("[%d] Keys exchanged", state->id);
+            state->in_ready = 1;
+
+        } else if (rc == SSH_ERROR) {
+            log_error("[%d] ssh_handle_key_exchange errored: %s", state->id, ssh_get_error(state->in_session));
+            ++state->server->metrics.kex_failures;
+            state->finished = 1;
+            return;
+
+        }
+    }
+
+    if (state->in_ready && !state->out_session && state->config->routes_file) {
+        if (wait_for_login(state) != 0) {
+            state->finished = 1;
+            return;
+        }
+    }
+
+    if (!state->out_ready && state->out_session) {
+        rc = ssh_connect(state->out_session);
+
+        if (rc == SSH_OK) {
+            log_info("[%d] Connected to %s:%d", state->id, state->upstream->host, state->upstream->port);
+            state->out_ready = 1;
+            upstream_connected(state->upstream, (histogram_now() - state->connect_started) / 1000);
+
+            // Auth and channel requests are proxied synchronously
+            ssh_set_blocking(state->out_session, 1);
+
+        } else if (rc == SSH_ERROR) {
+            log_error("[%d] Error making outbound connection: %s", state->id, ssh_get_error(state->out_session));
+            ++state->server->metrics.connect_failures;
+            upstream_failed(state->upstream);
+            state->finished = 1;
+            return;
+
+        }
+    }
+
+    if (state->in_ready && state->out_ready) {
+        // Set up callbacks and start relaying
+        state->handshake = 0;
+        timer_cancel(&state->server->timers, &state->timer);
+
+        if (start_session(state) != 0) {
+            state->finished = 1;
+            return;
+        }
+
+        log_info("[%d] Session started, %d active", state->id, state->server->session_count);
+
+    }
+}
+
+static int session_dead(stateptr state)
+{
+    if (state->finished) return 1;
+
+    if (ssh_get_status(state->in_session) & (SSH_CLOSED | SSH_CLOSED_ERROR)) return 1;
+    if (state->out_session && ssh_get_status(state->out_session) & (SSH_CLOSED | SSH_CLOSED_ERROR)) return 1;
+
+    return 0;
+}
+
+static void log_latency(stateptr state)
+{
+    char name[64];
+
+    snprintf(name, sizeof(name), "[%d] Client to server", state->id);
+    histogram_log(&state->latency[TRANSCRIPT_IN], name);
+
+    snprintf(name, sizeof(name), "[%d] Server to client", state->id);
+    histogram_log(&state->latency[TRANSCRIPT_OUT], name);
+}
+
+// Worker totals including the sessions still running, all owned by this thread so nothing is locked
+// Call with stats_lock held
+static void log_all_latency(void)
+{
+    // A single worker's totals have already been logged as its own
+    if (stats_logged || stats_reported < 2 || stats_reported < stats_workers) return;
+
+    histogram_log(&stats_total[TRANSCRIPT_IN], "All workers client to server");
+    histogram_log(&stats_total[TRANSCRIPT_OUT], "All workers server to client");
+
+    stats_logged = 1;
+}
+
+static void add_all_latency(struct histogram *total, int round)
+{
+    pthread_mutex_lock(&stats_lock);
+
+    if (round != stats_round) {
+        memset(stats_total, 0, sizeof(stats_total));
+        stats_round = round;
+        stats_reported = 0;
+        stats_logged = 0;
+    }
+
+    histogram_add(&stats_total[TRANSCRIPT_IN], &total[TRANSCRIPT_IN]);
+    histogram_add(&stats_total[TRANSCRIPT_OUT], &total[TRANSCRIPT_OUT]);
+    ++stats_reported;
+
+    log_all_latency();
+
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void dump_stats(serverptr server)
+{
+    struct histogram total[2];
+    char name[64];
+    stateptr state;
+
+    total[TRANSCRIPT_IN] = server->latency[TRANSCRIPT_IN];
+    total[TRANSCRIPT_OUT] = server->latency[TRANSCRIPT_OUT];
+
+    for (state = server->sessions; state; state = state->next) {
+        log_latency(state);
+        histogram_add(&total[TRANSCRIPT_IN], &state->latency[TRANSCRIPT_IN]);
+        histogram_add(&total[TRANSCRIPT_OUT], &state->latency[TRANSCRIPT_OUT]);
+    }
+
+    snprintf(name, sizeof(name), "Worker %d client to server", server->worker);
+    histogram_log(&total[TRANSCRIPT_IN], name);
+
+    snprintf(name, sizeof(name), "Worker %d server to client", server->worker);
+    histogram_log(&total[TRANSCRIPT_OUT], name);
+
+    add_all_latency(total, server->stats_seen);
+}
+
+static void service_sessions(serverptr server)
+{
+    stateptr *link = &server->sessions;
+    stateptr state;
+
+    while ((state = *link) != NULL) {
+        if (state->handshake) {
+            handshake_step(state);
+        } else {
+            service_session(state);
+        }
+
+        if (session_dead(state)) {
+            // Unlink and free
+            *link = state->next;
+            --server->session_count;
+            --server->metrics.sessions;
+
+            log_info("[%d] Session ended, %d active", state->id, server->session_count);
+            log_latency(state);
+
+            // Fold into the worker's totals
+            histogram_add(&server->latency[TRANSCRIPT_IN], &state->latency[TRANSCRIPT_IN]);
+            histogram_add(&server->latency[TRANSCRIPT_OUT], &state->latency[TRANSCRIPT_OUT]);
+
+            free_state(state);
+        } else {
+            link = &state->next;
+        }
+    }
+}
+
+static void drain_timer(timerptr timer, void *arg)
+{
+    (void)timer;
+
+    serverptr server = (serverptr) arg;
+
+    log_warn("Worker %d drain deadline passed, closing %d sessions", server->worker, server->session_count);
+    server->drain_expired = 1;
+}
+
+static void close_listeners(serverptr server)
+{
+    int i;
+
+    for (i = 0; i < server->listen_count; i++) {
+        if (server->event) ssh_event_remove_fd(server->event, server->listen_fds[i]);
+        close(server->listen_fds[i]);
+    }
+    server->listen_count = 0;
+}
+
+static void start_drain(serverptr server)
+{
+    server->draining = 1;
+
+    // Whoever took over, if anyone, has its own reference to the sockets and their queues
+    close_listeners(server);
+    server->accept_pending = 0;
+
+    // The metrics port is shared with our replacement too
+    if (server->worker == 0) {
+        metrics_drain();
+    }
+
+    if (server->handoff_fd >= 0) {
+        ssh_event_remove_fd(server->event, server->handoff_fd);
+        handoff_cleanup(server->handoff_fd);
+        server->handoff_fd = -1;
+    }
+
+    // No new sessions to use them
+    pool_cleanup(&server->pool);
+    timer_cancel(&server->timers, &server->pool_timer);
+
+    timer_arm(&server->timers, &server->drain_timer, timer_now() + (uint64_t) server->config->drain_timeout * 1000);
+
+    log_info("Worker %d stopped accepting, draining %d sessions for up to %d seconds", server->worker,
+        server->session_count, server->config->drain_timeout);
+}
+
+static int handoff_callback(socket_t fd, int revents, void *userdata)
+{
+    (void)fd;
+
+    serverptr server = (serverptr) userdata;
+
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        server->handoff_pending = 1;
+    }
+
+    return 0;
+}
+
+static void handoff_step(serverptr server)
+{
+    int acked;
+
+    if (server->handoff_conn < 0) {
+        if (draining) return;
+
+        server->handoff_conn = handoff_send(server->handoff_fd, listen_fds, listen_count);
+        if (server->handoff_conn < 0) return;
+
+        // One replacement at a time, the next waits in the backlog
+        ssh_event_remove_fd(server->event, server->handoff_fd);
+        if (ssh_event_add_fd(server->event, server->handoff_conn, POLLIN, handoff_callback, server) == SSH_OK) {
+            return;
+        }
+
+        log_error("Error adding handoff connection to polling context");
+        acked = 0;
+
+    } else {
+        acked = handoff_acked(server->handoff_conn);
+        if (acked < 0) return;
+
+        ssh_event_remove_fd(server->event, server->handoff_conn);
+
+        if (!acked) {
+            log_warn("Replacement exited before starting, still accepting connections");
+        }
+    }
+
+    close(server->handoff_conn);
+    server->handoff_conn = -1;
+
+    if (acked) {
+        log_info("Replacement is accepting connections");
+        server_drain();
+        return;
+    }
+
+    if (ssh_event_add_fd(server->event, server->handoff_fd, POLLIN, handoff_callback, server) != SSH_OK) {
+        log_error("Error adding handoff socket to polling context");
+    }
+}
+
+int server_handoff(serverptr server)
+{
+    // Only called for worker 0, before it starts
+    server->handoff_fd = handoff_listen(server->config->handoff_path);
+    if (server->handoff_fd < 0) {
+        return -1;
+    }
+
+    if (ssh_event_add_fd(server->event, server->handoff_fd, POLLIN, handoff_callback, server) != SSH_OK) {
+        log_error("Error adding handoff socket to polling context");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Keeps warm connections to every backend sessions may be sent to, returns when next due as pool_service does
+static time_t service_pool(serverptr server)
+{
+    upstreamptr upstream;
+    time_t due, next = 0;
+    int i;
+
+    for (i = 0; i < upstream_count(); i++) {
+        upstream = upstream_get(i);
+
+        // Its connections would only sit there going stale until it's back
+        if (upstream_count() > 1 && !__atomic_load_n(&upstream->healthy, __ATOMIC_RELAXED)) {
+            pool_drop(&server->pool, upstream->host, upstream->port);
+            continue;
+        }
+
+        due = pool_service(&server->pool, upstream->host, upstream->port);
+        if (due && (next == 0 || due < next)) next = due;
+    }
+
+    return next;
+}
+
+static int listen_callback(socket_t fd, int revents, void *userdata)
+{
+    (void)fd;
+
+    serverptr server = (serverptr) userdata;
+
+    // Sessions can't be added to the event while it is being polled, so just flag it
+    if (revents & POLLIN) {
+        server->accept_pending = 1;
+    }
+
+    return 0;
+}
+
+int server_init(serverptr server, configptr config, int worker)
+{
+    int i, count;
+
+    server->config = config;
+    server->worker = worker;
+    server->listen_count = 0;
+    server->wake_fd = -1;
+    server->handoff_fd = -1;
+    server->handoff_conn = -1;
+
+    // Create our own listen socket, or take over some from the process we're replacing
+    count = listener_open(config->in_port, worker, config->workers, server->listen_fds,
+        LISTENER_MAX - listen_count);
+    if (count < 0) {
+        return -1;
+    }
+    server->listen_count = count;
+
+    for (i = 0; i < count; i++) {
+        listen_fds[listen_count] = server->listen_fds[i];
+        ++listen_count;
+    }
+
+    // Create new bind, used to accept connections on sockets we hand it
+    server->bind = ssh_bind_new();
+    if (server->bind == NULL) {
+        log_error("Unable to create new bind");
+        return -1;
+    }
+
+    // Set bind options
+    if (config->dsa_key_file) {
+        ssh_bind_options_set(server->bind, SSH_BIND_OPTIONS_DSAKEY, config->dsa_key_file);
+    }
+    if (config->rsa_key_file) {
+        ssh_bind_options_set(server->bind, SSH_BIND_OPTIONS_RSAKEY, config->rsa_key_file);
+    }
+    if (config->ecdsa_key_file) {
+        ssh_bind_options_set(server->bind, SSH_BIND_OPTIONS_ECDSAKEY, config->ecdsa_key_file);
+    }
+    ssh_bind_options_set(server->bind, SSH_BIND_OPTIONS_LOG_VERBOSITY, &config->log_level);
+
+    // Create the event shared by all of this worker's sessions
+    server->event = ssh_event_new();
+    if (server->event == NULL) {
+        log_error("Could not create polling context");
+        return -1;
+    }
+
+    for (i = 0; i < server->listen_count; i++) {
+        if (ssh_event_add_fd(server->event, server->listen_fds[i], POLLIN, listen_callback, server) != SSH_OK) {
+            log_error("Error adding listen socket to polling context");
+            return -1;
+        }
+    }
+
+    // Lets signal handlers interrupt the poll, which otherwise only returns for sockets and timers
+    server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server->wake_fd < 0) {
+        log_error("Unable to create wakeup eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    if (ssh_event_add_fd(server->event, server->wake_fd, POLLIN, wake_callback, server) != SSH_OK) {
+        log_error("Error adding wakeup eventfd to polling context");
+        return -1;
+    }
+
+    wake_fds[wake_count] = server->wake_fd;
+    ++wake_count;
+
+    // Pool of warm upstream connections, filled from the poll loop
+    // Counted from here, summed by the metrics endpoint
+    metrics_register(&server->metrics);
+
+    pool_init(&server->pool, config->pool_size, config->log_level, config->connect_timeout, server->event);
+    timer_init(&server->pool_timer, NULL, NULL);
+    timer_init(&server->drain_timer, drain_timer, server);
+
+    log_info("Worker %d listening on port %d", worker, config->in_port);
+
+    return 0;
+}
+
+void server_run(serverptr server)
+{
+    log_info("Worker %d entering poll loop...", server->worker);
+
+    time_t pool_due;
+    int i;
+
+    pthread_mutex_lock(&stats_lock);
+    ++stats_workers;
+    pthread_mutex_unlock(&stats_lock);
+
+    while (!terminate) {
+        // Sleep until a socket, the wake_fd or the next timer needs us. Errors here are per session (or EINTR)
+        // and are picked up by reap_sessions
+        ssh_event_dopoll(server->event, timer_timeout(&server->timers));
+
+        timer_run(&server->timers);
+
+        if (draining && !server->draining) {
+            start_drain(server);
+        }
+
+        if (server->handoff_pending) {
+            server->handoff_pending = 0;
+            handoff_step(server);
+        }
+
+        if (server->accept_pending) {
+            server->accept_pending = 0;
+            for (i = 0; i < server->listen_count; i++) {
+                accept_connection(server, server->listen_fds[i]);
+            }
+        }
+
+        service_sessions(server);
+
+        if (server->draining) {
+            if (server->session_count == 0 || server->drain_expired) break;
+        } else {
+            pool_due = service_pool(server);
+            if (pool_due) {
+                timer_arm(&server->timers, &server->pool_timer, (uint64_t) pool_due * 1000);
+            } else {
+                timer_cancel(&server->timers, &server->pool_timer);
+            }
+        }
+
+        if (server->stats_seen != stats_requested) {
+            server->stats_seen = stats_requested;
+            dump_stats(server);
+        }
+    }
+
+    // The others may be waiting on this worker's latency for the last SIGUSR1
+    pthread_mutex_lock(&stats_lock);
+    --stats_workers;
+    log_all_latency();
+    pthread_mutex_unlock(&stats_lock);
+
+    log_info("Worker %d exited poll loop", server->worker);
+}
+
+static void *server_thread(void *arg)
+{
+    serverptr server = (serverptr) arg;
+    cpu_set_t cpus;
+    long cpu_count;
+
+    // Pin to a single CPU so the worker's sessions stay cache local
+    cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_count > 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(server->worker % cpu_count, &cpus);
+
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            log_error("Worker %d unable to pin to CPU %ld", server->worker, server->worker % cpu_count);
+        }
+    }
+
+    server_run(server);
+
+    return NULL;
+}
+
+int server_start(serverptr server)
+{
+    int rc;
+
+    rc = pthread_create(&server->thread, NULL, server_thread, server);
+    if (rc != 0) {
+        log_error("Unable to start worker %d: %s", server->worker, strerror(rc));
+        return -1;
+    }
+
+    return 0;
+}
+
+void server_wait(serverptr server)
+{
+    pthread_join(server->thread, NULL);
+}
+
+void server_cleanup(serverptr server)
+{
+    stateptr state;
+
+    // Tear down any remaining sessions
+    while ((state = server->sessions) != NULL) {
+        server->sessions = state->next;
+        --server->session_count;
+        free_state(state);
+    }
+
+    pool_cleanup(&server->pool);
+    timer_cleanup(&server->timers);
+
+    close_listeners(server);
+
+    if (server->event) {
+        if (server->wake_fd >= 0) {
+            ssh_event_remove_fd(server->event, server->wake_fd);
+        }
+        if (server->handoff_fd >= 0) {
+            ssh_event_remove_fd(server->event, server->handoff_fd);
+        }
+        if (server->handoff_conn >= 0) {
+            ssh_event_remove_fd(server->event, server->handoff_conn);
+        }
+        ssh_event_free(server->event);
+        server->event = NULL;
+    }
+
+    if (server->bind) {
+        ssh_bind_free(server->bind);
+        server->bind = NULL;
+    }
+
+    if (server->handoff_conn >= 0) {
+        close(server->handoff_conn);
+        server->handoff_conn = -1;
+    }
+
+    if (server->handoff_fd >= 0) {
+        handoff_cleanup(server->handoff_fd);
+        server->handoff_fd = -1;
+    }
+
+    // Left open until exit, a late signal may still write to it
+}
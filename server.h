@@ -0,0 +1,14 @@
+#include "state.h"
+
+#define SERVER_MAX_WORKERS 256
+
+int server_init(serverptr server, configptr config, int worker);
+void server_run(serverptr server);
+int server_start(serverptr server);
+void server_wait(serverptr server);
+int server_handoff(serverptr server);
+void server_stop(void);
+void server_drain(void);
+void server_wake(void);
+void server_request_stats(void);
+void server_cleanup(serverptr server);
@@ -1,44 +1,54 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <libssh/libssh.h>
 #include <libssh/server.h>
 #include <libssh/callbacks.h>
 
 #include "state.h"
+#include "channel.h"
 #include "in_channel.h"
 #include "out_channel.h"
+#include "keys.h"
+#include "index.h"
+#include "log.h"
 
-void poll_loop(stateptr state);
-
-void dump_auth_methods(int methods)
+char *format_auth_methods(int methods, char *buf, size_t size)
 {
+    size_t len = 0;
+
+    buf[0] = '\x0';
+
     if (methods & SSH_AUTH_METHOD_NONE) {
-        fprintf(stdout, " SSH_AUTH_METHOD_NONE");
+        len += snprintf(buf + len, size - len, " SSH_AUTH_METHOD_NONE");
         methods &= ~SSH_AUTH_METHOD_NONE;
     }
-    if (methods & SSH_AUTH_METHOD_PASSWORD) {
-        fprintf(stdout, " SSH_AUTH_METHOD_PASSWORD");
+    if (methods & SSH_AUTH_METHOD_PASSWORD && len < size) {
+        len += snprintf(buf + len, size - len, " SSH_AUTH_METHOD_PASSWORD");
         methods &= ~SSH_AUTH_METHOD_PASSWORD;
     }
-    if (methods & SSH_AUTH_METHOD_PUBLICKEY) {
-        fprintf(stdout, " SSH_AUTH_METHOD_PUBLICKEY");
+    if (methods & SSH_AUTH_METHOD_PUBLICKEY && len < size) {
+        len += snprintf(buf + len, size - len, " SSH_AUTH_METHOD_PUBLICKEY");
         methods &= ~SSH_AUTH_METHOD_PUBLICKEY;
     }
-    if (methods & SSH_AUTH_METHOD_HOSTBASED) {
-        fprintf(stdout, " SSH_AUTH_METHOD_HOSTBASED");
+    if (methods & SSH_AUTH_METHOD_HOSTBASED && len < size) {
+        len += snprintf(buf + len, size - len, " SSH_AUTH_METHOD_HOSTBASED");
         methods &= ~SSH_AUTH_METHOD_HOSTBASED;
     }
-    if (methods & SSH_AUTH_METHOD_INTERACTIVE) {
-        fprintf(stdout, " SSH_AUTH_METHOD_INTERACTIVE");
+    if (methods & SSH_AUTH_METHOD_INTERACTIVE && len < size) {
+        len += snprintf(buf + len, size - len, " SSH_AUTH_METHOD_INTERACTIVE");
         methods &= ~SSH_AUTH_METHOD_INTERACTIVE;
     }
-    if (methods & SSH_AUTH_METHOD_GSSAPI_MIC) {
-        fprintf(stdout, " SSH_AUTH_METHOD_GSSAPI_MIC");
+    if (methods & SSH_AUTH_METHOD_GSSAPI_MIC && len < size) {
+        len += snprintf(buf + len, size - len, " SSH_AUTH_METHOD_GSSAPI_MIC");
         methods &= ~SSH_AUTH_METHOD_GSSAPI_MIC;
     }
 
-    if (methods != 0) {
-        fprintf(stdout, " + 0x%x", methods);
+    if (methods != 0 && len < size) {
+        snprintf(buf + len, size - len, " + 0x%x", methods);
     }
+
+    return buf;
 }
 
 char *auth_result(int auth_int)
@@ -77,44 +87,135 @@ int in_auth (const char *prompt, char *buf, size_t len, int echo, int verify, vo
     (void)buf;
     (void)userdata;
 
-    fprintf(stdout, "in_auth callback called with prompt %s, buf len %ld, echo %d, verify %d\n",
+    log_info("in_auth callback called with prompt %s, buf len %ld, echo %d, verify %d",
         prompt, len, echo, verify);
 
     return SSH_ERROR;
 }
 
-void in_global_request (ssh_session session, ssh_message message, void *userdata)
+static void free_forward(struct forward_request *request)
 {
-    (void)session;
-    (void)message;
-    (void)userdata;
+    free(request->address);
+    free(request);
+}
 
-    fprintf(stdout, "in_global_request callback called (TODO)\n");
+static struct forward_request *queue_forward(stateptr state, int cancel, const char *address, int port)
+{
+    struct forward_request *request, **link;
 
-    // TODO
+    request = calloc(1, sizeof(struct forward_request));
+    if (request == NULL) return NULL;
+
+    request->address = strdup(address ? address : "");
+    if (request->address == NULL) {
+        free(request);
+        return NULL;
+    }
+    request->cancel = cancel;
+    request->port = port;
+
+    for (link = &state->forwards; *link; link = &(*link)->next);
+    *link = request;
+
+    return request;
 }
 
-ssh_channel in_channel_open_request_x11 (ssh_session session, const char * originator_address, int originator_port, void *userdata)
+// Sends the oldest forward request upstream, or picks up the answer to it. SSH_AGAIN until it has one
+static int send_forward(stateptr state, int blocking, int *bound_port)
 {
-    (void)session;
-    (void)userdata;
+    struct forward_request *request = state->forwards;
+    int rc;
 
-    fprintf(stdout, "in_open_request_x11 callback called with originator address %s, port %d (TODO)\n",
-        originator_address, originator_port);
+    // libssh carries on with the request already sent rather than sending another
+    ssh_set_blocking(state->out_session, blocking);
 
-    // TODO
-    return NULL;
+    if (request->cancel) {
+        rc = ssh_channel_cancel_forward(state->out_session, request->address, request->port);
+    } else {
+        rc = ssh_channel_listen_forward(state->out_session, request->address, request->port, bound_port);
+    }
+
+    ssh_set_blocking(state->out_session, 1);
+
+    if (rc == SSH_AGAIN) return rc;
+
+    if (rc != SSH_OK) {
+        log_error("[%d] Upstream refused %s %s:%d", state->id, (request->cancel ? "cancel-tcpip-forward" :
+            "tcpip-forward"), request->address, request->port);
+    }
+
+    state->forwards = request->next;
+    free_forward(request);
+
+    return rc;
 }
 
-ssh_channel in_channel_open_request_auth_agent (ssh_session session, void *userdata)
+static void service_forwards(stateptr state)
+{
+    while (state->forwards && send_forward(state, 0, NULL) != SSH_AGAIN);
+}
+
+void in_global_request (ssh_session session, ssh_message message, void *userdata)
 {
     (void)session;
-    (void)userdata;
 
-    fprintf(stdout, "in_channel_open_request_auth_agent callback called (TODO)\n");
+    stateptr state = (stateptr) userdata;
+    const char *address = ssh_message_global_request_address(message);
+    int port = ssh_message_global_request_port(message);
+    struct forward_request **link;
+    int cancel = 0, bound_port = 0, rc;
+
+    switch (ssh_message_subtype(message)) {
+    case SSH_GLOBAL_REQUEST_CANCEL_TCPIP_FORWARD:
+        cancel = 1;
+        // Fall through
+
+    case SSH_GLOBAL_REQUEST_TCPIP_FORWARD:
+        log_info("[%d] in_global_request %s %s:%d", state->id, (cancel ? "cancel-tcpip-forward" : "tcpip-forward"),
+            address, port);
+
+        transcript_text(state->transcript, TRANSCRIPT_IN, TRANSCRIPT_REQUEST, TRANSCRIPT_NO_CHANNEL,
+            (cancel ? "cancel-tcpip-forward" : "tcpip-forward"), "%s:%d", address, port);
+
+        // Have the upstream listen instead, in the order the client asked
+        if (queue_forward(state, cancel, address, port) == NULL) {
+            log_error("[%d] Unable to allocate forward request", state->id);
+            ssh_message_reply_default(message);
+            break;
+        }
 
-    // TODO
-    return NULL;
+        if (cancel || port != 0) {
+            // libssh frees the message when we return, so the client can't wait for the upstream's answer.
+            // It's told yes now and a refusal is logged, rather than the worker waiting on the upstream.
+            // service_session sends it once we're out of the event loop
+            ssh_message_global_request_reply_success(message, 0);
+            break;
+        }
+
+        // Only the upstream knows which port it picked, which the client has to be told, so this one waits
+        rc = SSH_OK;
+        while (state->forwards->next && rc != SSH_AGAIN) {
+            rc = send_forward(state, 1, NULL);
+        }
+
+        if (rc == SSH_AGAIN) {
+            // Still no answer to an earlier one, give up on this one rather than wait any longer
+            for (link = &state->forwards; (*link)->next; link = &(*link)->next);
+            free_forward(*link);
+            *link = NULL;
+            ssh_message_reply_default(message);
+        } else if (send_forward(state, 1, &bound_port) == SSH_OK) {
+            ssh_message_global_request_reply_success(message, bound_port);
+        } else {
+            ssh_message_reply_default(message);
+        }
+        break;
+
+    default:
+        log_info("[%d] in_global_request of type %d refused", state->id, ssh_message_subtype(message));
+        ssh_message_reply_default(message);
+        break;
+    }
 }
 
 int out_auth (const char *prompt, char *buf, size_t len, int echo, int verify, void *userdata)
@@ -122,7 +223,7 @@ int out_auth (const char *prompt, char *buf, size_t len, int echo, int verify, v
     (void)buf;
     (void)userdata;
 
-    fprintf(stdout, "out_auth callback called with prompt %s, buf len %ld, echo %d, verify %d\n",
+    log_info("out_auth callback called with prompt %s, buf len %ld, echo %d, verify %d",
         prompt, len, echo, verify);
 
     return SSH_ERROR;
@@ -131,35 +232,153 @@ int out_auth (const char *prompt, char *buf, size_t len, int echo, int verify, v
 void out_global_request (ssh_session session, ssh_message message, void *userdata)
 {
     (void)session;
-    (void)message;
-    (void)userdata;
 
-    fprintf(stdout, "out_global_request callback called (TODO)\n");
+    stateptr state = (stateptr) userdata;
 
-    // TODO
+    // Upstream requests such as keepalives and host key updates are for sshdump, not the client
+    log_info("[%d] out_global_request of type %d refused", state->id, ssh_message_subtype(message));
+
+    ssh_message_reply_default(message);
+}
+
+// Client opened an X11 or agent channel, which normally only servers do, mirror it upstream
+static ssh_channel open_in_request(stateptr state, int type, const char *name, const char *orig_host, int orig_port)
+{
+    channelptr pair;
+    ssh_channel upstream;
+
+    pair = channel_new(state);
+    if (pair == NULL) return NULL;
+
+    if (type == SSH_CHANNEL_X11) {
+        upstream = create_out_x11(pair, orig_host, orig_port);
+    } else {
+        upstream = create_out_auth_agent(pair);
+    }
+
+    if (upstream == NULL || create_in_channel(pair) == NULL) {
+        channel_free(pair);
+        return NULL;
+    }
+
+    transcript_text(state->transcript, TRANSCRIPT_IN, TRANSCRIPT_OPEN, pair->id, name, "%s:%d",
+        orig_host ? orig_host : "", orig_port);
+
+    log_info("[%d] Channel %u opened, %u active", state->id, pair->id, state->channel_count);
+
+    // libssh accepts it once it's returned
+    return pair->in_channel;
+}
+
+// Upstream opened an X11 or agent channel back through the client's forwarding. The client's answer comes
+// later, a refusal closes the upstream channel then
+static ssh_channel open_out_request(stateptr state, int type, const char *name, const char *orig_host, int orig_port)
+{
+    channelptr pair;
+    ssh_channel client;
+
+    pair = channel_new(state);
+    if (pair == NULL) return NULL;
+
+    if (type == SSH_CHANNEL_X11) {
+        client = create_in_x11(pair, orig_host, orig_port);
+    } else {
+        client = create_in_auth_agent(pair);
+    }
+
+    if (client == NULL || new_out_channel(pair) == NULL) {
+        channel_free(pair);
+        return NULL;
+    }
+
+    transcript_text(state->transcript, TRANSCRIPT_OUT, TRANSCRIPT_OPEN, pair->id, name, "%s:%d",
+        orig_host ? orig_host : "", orig_port);
+
+    log_info("[%d] Channel %u opened, %u active", state->id, pair->id, state->channel_count);
+
+    // libssh accepts it once it's returned
+    return pair->out_channel;
+}
+
+ssh_channel in_channel_open_request_x11 (ssh_session session, const char * originator_address, int originator_port, void *userdata)
+{
+    (void)session;
+
+    stateptr state = (stateptr) userdata;
+
+    log_info("in_open_request_x11 callback called with originator address %s, port %d",
+        originator_address, originator_port);
+
+    return open_in_request(state, SSH_CHANNEL_X11, "x11", originator_address, originator_port);
+}
+
+ssh_channel in_channel_open_request_auth_agent (ssh_session session, void *userdata)
+{
+    (void)session;
+
+    stateptr state = (stateptr) userdata;
+
+    log_info("in_channel_open_request_auth_agent callback called");
+
+    return open_in_request(state, SSH_CHANNEL_AUTH_AGENT, "auth-agent@openssh.com", NULL, 0);
 }
 
 ssh_channel out_channel_open_request_x11 (ssh_session session, const char * originator_address, int originator_port, void *userdata)
 {
     (void)session;
-    (void)userdata;
 
-    fprintf(stdout, "out_open_request_x11 callback called with originator address %s, port %d (TODO)\n",
+    stateptr state = (stateptr) userdata;
+
+    log_info("out_open_request_x11 callback called with originator address %s, port %d",
         originator_address, originator_port);
 
-    // TODO
-    return NULL;
+    return open_out_request(state, SSH_CHANNEL_X11, "x11", originator_address, originator_port);
 }
 
 ssh_channel out_channel_open_request_auth_agent (ssh_session session, void *userdata)
 {
     (void)session;
-    (void)userdata;
 
-    fprintf(stdout, "out_channel_open_request_auth_agent callback called (TODO)\n");
+    stateptr state = (stateptr) userdata;
 
-    // TODO
-    return NULL;
+    log_info("out_channel_open_request_auth_agent callback called");
+
+    return open_out_request(state, SSH_CHANNEL_AUTH_AGENT, "auth-agent@openssh.com", NULL, 0);
+}
+
+// Username to authenticate upstream with. With routes, later attempts can't switch to a login that would
+// route elsewhere
+static const char *upstream_user(stateptr state, const char *user)
+{
+    if (state->login == NULL) return user;
+
+    if (strcmp(user, state->login) != 0) {
+        log_warn("[%d] Refusing user %s, already routed as %s", state->id, user, state->login);
+        return NULL;
+    }
+
+    return state->out_user;
+}
+
+// Row in the index for this session, with its login, client and upstream
+void index_event(stateptr state, int kind, const char *text)
+{
+    char upstream[UPSTREAM_HOST_SIZE + 16] = "";
+
+    if (state->upstream) {
+        snprintf(upstream, sizeof(upstream), strchr(state->upstream->host, ':') ? "[%s]:%d" : "%s:%d",
+            state->upstream->host, state->upstream->port);
+    }
+
+    index_add(kind, state->id, state->user, state->source, upstream, text);
+}
+
+static void auth_succeeded(stateptr state, const char *user, const char *method)
+{
+    free(state->user);
+    state->user = strdup(user);
+
+    index_event(state, INDEX_LOGIN, method);
 }
 
 int auth_password(ssh_session session, const char *user, const char *password, void *userdata)
@@ -167,13 +386,19 @@ int auth_password(ssh_session session, const char *user, const char *password, v
     (void)session;
 
     stateptr state = (stateptr) userdata;
-    int result;
+    const char *out_user;
+    int result = SSH_AUTH_DENIED;
 
-    fprintf(stdout, "auth_password callback called with user %s, password %s\n", user, password);
+    log_info("auth_password callback called with user %s, password %s", user, password);
 
-    result = ssh_userauth_password(state->out_session, user, password);
+    out_user = upstream_user(state, user);
+    if (out_user) {
+        result = ssh_userauth_password(state->out_session, out_user, password);
+    }
 
-    fprintf(stdout, "auth_password callback returning %s\n", auth_result(result));
+    log_info("auth_password callback returning %s", auth_result(result));
+    metrics_auth(&state->server->metrics, METRICS_AUTH_PASSWORD, result);
+    if (result == SSH_AUTH_SUCCESS) auth_succeeded(state, user, "password");
 
     return result;
 }
@@ -183,25 +408,26 @@ int auth_none(ssh_session session, const char *user, void *userdata)
     (void)session;
 
     stateptr state = (stateptr) userdata;
+    const char *out_user;
     int result;
     int auth_methods;
+    char methods_str[256];
 
-    fprintf(stdout, "auth_none callback called with user %s\n", user);
+    log_info("auth_none callback called with user %s", user);
 
-    result = ssh_userauth_none(state->out_session, user);
+    out_user = upstream_user(state, user);
+    result = out_user ? ssh_userauth_none(state->out_session, out_user) : SSH_AUTH_DENIED;
 
-    if (result != SSH_AUTH_SUCCESS) {
+    if (out_user && result != SSH_AUTH_SUCCESS) {
         // Get list of valid auth methods
         auth_methods = ssh_userauth_list(state->out_session, NULL);
 
         // Dump them out
-        fprintf(stdout, "Returned auth_methods:");
-        dump_auth_methods(auth_methods);
-        fprintf(stdout, "\n");
+        log_info("Returned auth_methods:%s", format_auth_methods(auth_methods, methods_str, sizeof(methods_str)));
 
         // Only offer PUBLICKEY if we have key files configured
-        if (auth_methods & SSH_AUTH_METHOD_PUBLICKEY && (!state->pub_key_file || !state->priv_key_file)) {
-            fprintf(stderr, "Removing SSH_AUTH_METHOD_PUBLICKEY auth method because key files not specified\n");
+        if (auth_methods & SSH_AUTH_METHOD_PUBLICKEY && (!state->config->pub_key_file || !state->config->priv_key_file)) {
+            log_warn("Removing SSH_AUTH_METHOD_PUBLICKEY auth method because key files not specified");
             auth_methods &= ~SSH_AUTH_METHOD_PUBLICKEY;
         }
 
@@ -209,7 +435,9 @@ int auth_none(ssh_session session, const char *user, void *userdata)
         ssh_set_auth_methods(state->in_session, auth_methods);
     }
 
-    fprintf(stdout, "auth_none callback returning %s\n", auth_result(result));
+    log_info("auth_none callback returning %s", auth_result(result));
+    metrics_auth(&state->server->metrics, METRICS_AUTH_NONE, result);
+    if (result == SSH_AUTH_SUCCESS) auth_succeeded(state, user, "none");
 
     return result;
 }
@@ -217,11 +445,13 @@ int auth_none(ssh_session session, const char *user, void *userdata)
 int auth_gssapi_mic(ssh_session session, const char *user, const char *principal, void *userdata)
 {
     (void)session;
-    (void)userdata;
 
-    fprintf(stdout, "auth_gssapi_mic callback called with user %s, principal %s (TODO)\n", user, principal);
+    stateptr state = (stateptr) userdata;
+
+    log_info("auth_gssapi_mic callback called with user %s, principal %s (TODO)", user, principal);
 
     // TODO
+    metrics_auth(&state->server->metrics, METRICS_AUTH_GSSAPI, SSH_AUTH_DENIED);
     return SSH_AUTH_DENIED;
 }
 
@@ -231,7 +461,8 @@ int auth_pubkey(ssh_session session, const char *user, struct ssh_key_struct *pu
     (void)pubkey;
 
     stateptr state = (stateptr) userdata;
-    ssh_key pkey;
+    keyptr keys;
+    const char *out_user;
     int result = SSH_AUTH_DENIED;
     char *state_str = "[UNKNOWN]";
 
@@ -244,39 +475,36 @@ int auth_pubkey(ssh_session session, const char *user, struct ssh_key_struct *pu
         break;
     }
 
-    fprintf(stdout, "auth_pubkey callback called with user %s, signature state %s\n", user, state_str);
+    log_info("auth_pubkey callback called with user %s, signature state %s", user, state_str);
 
-    switch(signature_state){
-    case SSH_PUBLICKEY_STATE_NONE:
-        if (state->pub_key_file && state->priv_key_file) {
-            if (ssh_pki_import_pubkey_file(state->pub_key_file, &pkey) != SSH_OK){
-                fprintf(stderr, "Failed to load public key %s\n", state->pub_key_file);
-                result = SSH_AUTH_DENIED;
-            } else {
-                result = ssh_userauth_try_publickey(state->out_session, user, pkey);
-                ssh_key_free(pkey);
-            }
-        } else {
-            fprintf(stderr, "Public and private key files must be specified for outbound connection\n");
-        }
-        break;
+    // Loaded at startup (and on SIGHUP), never per login
+    keys = keys_get();
+    out_user = upstream_user(state, user);
 
-    case SSH_PUBLICKEY_STATE_VALID:
-        if (state->pub_key_file && state->priv_key_file) {
-            if (ssh_pki_import_privkey_file(state->priv_key_file, NULL, NULL, NULL, &pkey) != SSH_OK){
-                fprintf(stderr, "Failed to load private key %s\n", state->priv_key_file);
-                result = SSH_AUTH_DENIED;
-            } else {
-                result = ssh_userauth_publickey(state->out_session, user, pkey);
-            }
-        } else {
-            fprintf(stderr, "Public and private key files must be specified for outbound connection\n");
-        }
-        break;
+    if (keys == NULL) {
+        log_error("Public and private key files must be specified for outbound connection");
 
+    } else if (out_user) {
+        switch(signature_state){
+        case SSH_PUBLICKEY_STATE_NONE:
+            result = ssh_userauth_try_publickey(state->out_session, out_user, keys->pub);
+            break;
+
+        case SSH_PUBLICKEY_STATE_VALID:
+            result = ssh_userauth_publickey(state->out_session, out_user, keys->priv);
+            break;
+        }
     }
 
-    fprintf(stdout, "auth_pubkey callback returning %s\n", auth_result(result));
+    keys_put(keys);
+
+    log_info("auth_pubkey callback returning %s", auth_result(result));
+    metrics_auth(&state->server->metrics, METRICS_AUTH_PUBLICKEY, result);
+
+    // Success without a signature only says the key would do
+    if (result == SSH_AUTH_SUCCESS && signature_state == SSH_PUBLICKEY_STATE_VALID) {
+        auth_succeeded(state, user, "publickey");
+    }
 
     return result;
 }
@@ -288,13 +516,13 @@ int service_request(ssh_session session, const char *service, void *userdata)
     stateptr state = (stateptr) userdata;
     int rc = -1;
 
-    fprintf(stdout, "service_request callback called with service %s\n", service);
+    log_info("service_request callback called with service %s", service);
 
     if (ssh_service_request(state->out_session, service) == SSH_OK) {
         rc = 0;
     }
 
-    fprintf(stdout, "service_request callback returnng %d\n", rc);
+    log_info("service_request callback returnng %d", rc);
 
     return rc;
 }
@@ -304,28 +532,143 @@ ssh_channel channel_open_request_session(ssh_session session, void *userdata)
     (void)session;
 
     stateptr state = (stateptr) userdata;
+    channelptr pair;
     ssh_channel result = NULL;
 
-    fprintf(stdout, "open_request_session callback called\n");
+    log_info("open_request_session callback called");
 
-    if (create_out_channel(state)) {
-        if (create_in_channel(state)) {
-            result = state->in_channel;
-        } else {
-            destroy_out_channel(state);
-        }
+    pair = channel_new(state);
+    if (pair == NULL) return NULL;
+
+    if (create_out_channel(pair) && create_in_channel(pair)) {
+        transcript_text(state->transcript, TRANSCRIPT_IN, TRANSCRIPT_OPEN, pair->id, "session", "%s", "");
+        log_info("[%d] Channel %u opened, %u active", state->id, pair->id, state->channel_count);
+        result = pair->in_channel;
+    } else {
+        channel_free(pair);
     }
 
     return result;
 }
 
+// Client asked for a connection to be made from the upstream, open the upstream side first so a refusal
+// there can be passed back
+static int channel_open_request_direct_tcpip(stateptr state, ssh_message message)
+{
+    const char *host = ssh_message_channel_request_open_destination(message);
+    int port = ssh_message_channel_request_open_destination_port(message);
+    const char *orig_host = ssh_message_channel_request_open_originator(message);
+    int orig_port = ssh_message_channel_request_open_originator_port(message);
+    channelptr pair;
+    ssh_channel channel;
+
+    log_info("[%d] direct-tcpip open to %s:%d from %s:%d", state->id, host, port, orig_host, orig_port);
+
+    pair = channel_new(state);
+    if (pair == NULL) return 1;
+
+    if (create_out_forward(pair, host, port, orig_host, orig_port) == NULL) {
+        channel_free(pair);
+        return 1;
+    }
+
+    channel = ssh_message_channel_request_open_reply_accept(message);
+    if (channel == NULL) {
+        log_error("[%d] Unable to accept direct-tcpip channel", state->id);
+        channel_free(pair);
+        return 0;
+    }
+
+    set_in_channel(pair, channel);
+
+    transcript_text(state->transcript, TRANSCRIPT_IN, TRANSCRIPT_OPEN, pair->id, "direct-tcpip", "%s:%d %s:%d",
+        host, port, orig_host, orig_port);
+
+    log_info("[%d] Channel %u opened, %u active", state->id, pair->id, state->channel_count);
+
+    return 0;
+}
+
+// Upstream has a connection on a port forwarded with tcpip-forward, pass it on to the client. Accepted
+// upstream straight away, and closed again if the client refuses
+static int channel_open_request_forwarded_tcpip(stateptr state, ssh_message message)
+{
+    const char *host = ssh_message_channel_request_open_destination(message);
+    int port = ssh_message_channel_request_open_destination_port(message);
+    const char *orig_host = ssh_message_channel_request_open_originator(message);
+    int orig_port = ssh_message_channel_request_open_originator_port(message);
+    channelptr pair;
+    ssh_channel channel;
+
+    log_info("[%d] forwarded-tcpip open on %s:%d from %s:%d", state->id, host, port, orig_host, orig_port);
+
+    pair = channel_new(state);
+    if (pair == NULL) return 1;
+
+    if (create_in_forward(pair, host, port, orig_host, orig_port) == NULL) {
+        channel_free(pair);
+        return 1;
+    }
+
+    channel = ssh_message_channel_request_open_reply_accept(message);
+    if (channel == NULL) {
+        log_error("[%d] Unable to accept forwarded-tcpip channel", state->id);
+        channel_free(pair);
+        return 0;
+    }
+
+    set_out_channel(pair, channel);
+
+    transcript_text(state->transcript, TRANSCRIPT_OUT, TRANSCRIPT_OPEN, pair->id, "forwarded-tcpip", "%s:%d %s:%d",
+        host, port, orig_host, orig_port);
+
+    log_info("[%d] Channel %u opened, %u active", state->id, pair->id, state->channel_count);
+
+    return 0;
+}
+
+// Messages libssh has no callback for, returning 1 sends the default refusal
+static int in_message(ssh_session session, ssh_message message, void *userdata)
+{
+    (void)session;
+
+    stateptr state = (stateptr) userdata;
+
+    if (ssh_message_type(message) == SSH_REQUEST_CHANNEL_OPEN &&
+        ssh_message_subtype(message) == SSH_CHANNEL_DIRECT_TCPIP) {
+        return channel_open_request_direct_tcpip(state, message);
+    }
+
+    log_info("[%d] Rejecting message of type %d, subtype %d", state->id, ssh_message_type(message),
+        ssh_message_subtype(message));
+
+    return 1;
+}
+
+static int out_message(ssh_session session, ssh_message message, void *userdata)
+{
+    (void)session;
+
+    stateptr state = (stateptr) userdata;
+
+    if (ssh_message_type(message) == SSH_REQUEST_CHANNEL_OPEN &&
+        ssh_message_subtype(message) == SSH_CHANNEL_FORWARDED_TCPIP) {
+        return channel_open_request_forwarded_tcpip(state, message);
+    }
+
+    log_info("[%d] Rejecting upstream message of type %d, subtype %d", state->id, ssh_message_type(message),
+        ssh_message_subtype(message));
+
+    return 1;
+}
+
 ssh_string gssapi_select_oid(ssh_session session, const char *user, int n_oid, ssh_string *oids, void *userdata)
 {
     (void)session;
     (void)userdata;
     (void)oids;
 
-    fprintf(stdout, "gssapi_select_oid callback called, user %s, number of OIDs = %d (TODO)\n", user, n_oid);
+    log_info("gssapi_select_oid callback called, user %s, number of OIDs = %d (TODO)", user, n_oid);
 
     // TODO
     return NULL;
@@ -338,7 +681,7 @@ int gssapi_accept_sec_ctx(ssh_session session, ssh_string input_token, ssh_strin
     (void)output_token;
     (void)userdata;
 
-    fprintf(stdout, "gssapi_accept_sec_ctx_callback callback called (TODO)\n");
+    log_info("gssapi_accept_sec_ctx_callback callback called (TODO)");
 
     // TODO
     return SSH_ERROR;
@@ -351,13 +694,91 @@ int gssapi_verify_mic(ssh_session session, ssh_string mic, void *mic_buffer, siz
     (void)mic_buffer;
     (void)userdata;
 
-    fprintf(stdout, "gssapi_verify_mic callback called, mic buffer size = %ld (TODO)\n", mic_buffer_size);
+    log_info("gssapi_verify_mic callback called, mic buffer size = %ld (TODO)", mic_buffer_size);
 
     // TODO
     return SSH_ERROR;
 }
 
-void dump_session(stateptr state)
+// Answers an auth request the way libssh does for the server callbacks, for ones that were queued
+static void handle_auth_message(stateptr state, ssh_message message)
+{
+    const char *user = ssh_message_auth_user(message);
+    int pk_state, result = SSH_AUTH_DENIED;
+
+    switch (ssh_message_subtype(message)) {
+    case SSH_AUTH_METHOD_NONE:
+        result = auth_none(state->in_session, user, state);
+        break;
+
+    case SSH_AUTH_METHOD_PASSWORD:
+        result = auth_password(state->in_session, user, ssh_message_auth_password(message), state);
+        break;
+
+    case SSH_AUTH_METHOD_PUBLICKEY:
+        pk_state = ssh_message_auth_publickey_state(message);
+        result = auth_pubkey(state->in_session, user, ssh_message_auth_pubkey(message), pk_state, state);
+
+        // The key would do, the client signs with it next
+        if (result == SSH_AUTH_SUCCESS && pk_state == SSH_PUBLICKEY_STATE_NONE) {
+            ssh_message_auth_reply_pk_ok_simple(message);
+            return;
+        }
+        break;
+    }
+
+    if (result == SSH_AUTH_SUCCESS || result == SSH_AUTH_PARTIAL) {
+        ssh_message_auth_reply_success(message, result == SSH_AUTH_PARTIAL);
+    } else {
+        ssh_message_reply_default(message);
+    }
+}
+
+static void handle_queued_messages(stateptr state)
+{
+    ssh_message message;
+    const char *service;
+
+    // The auth request routes were waiting for
+    if (state->auth_message) {
+        handle_auth_message(state, state->auth_message);
+        ssh_message_free(state->auth_message);
+        state->auth_message = NULL;
+    }
+
+    while ((message = ssh_message_get(state->in_session)) != NULL) {
+        switch (ssh_message_type(message)) {
+        case SSH_REQUEST_AUTH:
+            handle_auth_message(state, message);
+            break;
+
+        case SSH_REQUEST_SERVICE:
+            service = ssh_message_service_service(message);
+
+            if (service_request(state->in_session, service, state) == 0) {
+                ssh_message_service_reply_success(message);
+            } else {
+                ssh_message_reply_default(message);
+            }
+            break;
+
+        default:
+            log_info("Rejecting queued message of type %d", ssh_message_type(message));
+            ssh_message_reply_default(message);
+            break;
+        }
+
+        ssh_message_free(message);
+    }
+}
+
+static void start_out_session(stateptr state)
+{
+    ssh_set_callbacks(state->out_session, &state->out_callbacks);
+    ssh_set_message_callback(state->out_session, out_message, state);
+}
+
+int start_session(stateptr state)
 {
     struct ssh_server_callbacks_struct server_callbacks = {
         .auth_password_function = &auth_password,
@@ -373,6 +794,7 @@ void dump_session(stateptr state)
     };
 
     struct ssh_callbacks_struct in_callbacks = {
+        .userdata = state,
         .auth_function = &in_auth,
         .global_request_function = &in_global_request,
         .channel_open_request_x11_function = &in_channel_open_request_x11,
@@ -380,73 +802,83 @@ void dump_session(stateptr state)
     };
 
     struct ssh_callbacks_struct out_callbacks = {
+        .userdata = state,
         .auth_function = &out_auth,
         .global_request_function = &out_global_request,
         .channel_open_request_x11_function = &out_channel_open_request_x11,
         .channel_open_request_auth_agent_function = &out_channel_open_request_auth_agent
     };
 
-    // Set up in session callbacks
-    ssh_callbacks_init(&in_callbacks);
-    ssh_callbacks_init(&out_callbacks);
-    ssh_callbacks_init(&server_callbacks);
+    // Callback structures are kept in the state as libssh holds on to them
+    state->server_callbacks = server_callbacks;
+    state->in_callbacks = in_callbacks;
+    state->out_callbacks = out_callbacks;
+
+    // Set up session callbacks
+    ssh_callbacks_init(&state->in_callbacks);
+    ssh_callbacks_init(&state->out_callbacks);
+    ssh_callbacks_init(&state->server_callbacks);
+
+    ssh_set_callbacks(state->in_session, &state->in_callbacks);
+    ssh_set_server_callbacks(state->in_session, &state->server_callbacks);
 
-    ssh_set_callbacks(state->in_session, &in_callbacks);
-    ssh_set_callbacks(state->out_session, &out_callbacks);
-    ssh_set_server_callbacks(state->in_session, &server_callbacks);
+    // Channel types the callbacks don't cover, such as port forwards, arrive as messages
+    ssh_set_message_callback(state->in_session, in_message, state);
 
-    // Enter poll loop
-    poll_loop(state);
+    start_out_session(state);
 
-    // Clear in session callbacks
-    ssh_set_callbacks(state->in_session, NULL);
-    ssh_set_callbacks(state->out_session, NULL);
-    ssh_set_server_callbacks(state->in_session, NULL);
+    // Messages that arrived while the upstream was still connecting were queued rather than handled
+    handle_queued_messages(state);
 
-    return;
+    return 0;
 }
 
-void poll_loop(stateptr state)
+void stop_session(stateptr state)
 {
-    do {
-        // Create the event
-        state->event = ssh_event_new();
-        if (state->event == NULL) {
-            fprintf(stderr, "Could not create polling context\n");
-            break;
-        }
+    struct forward_request *request;
 
-        // Add sessions to the event
-        ssh_set_blocking(state->in_session, 0);
+    // Answers to these are of no use once the session is going
+    while ((request = state->forwards) != NULL) {
+        state->forwards = request->next;
+        free_forward(request);
+    }
 
-        if (ssh_event_add_session(state->event, state->in_session) != SSH_OK) {
-            fprintf(stderr, "Error adding in session to polling context\n");
-            break;
-        }
+    // Remove sessions from the shared event
+    if (state->in_session) {
+        ssh_event_remove_session(state->server->event, state->in_session);
+        ssh_set_callbacks(state->in_session, NULL);
+        ssh_set_server_callbacks(state->in_session, NULL);
+        ssh_set_message_callback(state->in_session, NULL, NULL);
+    }
 
-        if (ssh_event_add_session(state->event, state->out_session) != SSH_OK) {
-            fprintf(stderr, "Error adding out session to polling context\n");
-            break;
-        }
+    if (state->out_session) {
+        ssh_event_remove_session(state->server->event, state->out_session);
+        ssh_set_callbacks(state->out_session, NULL);
+        ssh_set_message_callback(state->out_session, NULL, NULL);
+    }
+}
 
-        // Poll for events
-        fprintf(stdout, "Entering poll loop...\n");
+void service_session(stateptr state)
+{
+    time_t due;
+    uint32_t id;
 
-        while (!state->finished) {
-            if (ssh_event_dopoll(state->event, 100) == SSH_ERROR) {
-                fprintf(stderr, "ssh_event_dopoll error: %s\n", ssh_get_error(state->in_session));
-                break;
-            }
+    // Picks up the upstream's answers to port forwards, and sends the next
+    if (state->forwards) service_forwards(state);
+
+    // Forward, and finish closes that were waiting for queued data to be sent
+    for (id = 0; id < state->channel_size; id++) {
+        if (state->channels[id]) {
+            channel_service(state->channels[id]);
         }
+    }
 
-        fprintf(stdout, "Exited poll loop\n");
-    } while(0);
+    // Write out transcript records that have been buffered for a while, and make sure the loop wakes for
+    // ones that haven't been yet
+    transcript_service(state->transcript);
 
-    if (state->event) {
-        // Destroy event
-        ssh_event_remove_session(state->event, state->in_session);
-        ssh_event_remove_session(state->event, state->out_session);
-        ssh_event_free(state->event);
-        state->event = NULL;
+    due = transcript_due(state->transcript);
+    if (due && !timer_armed(&state->timer)) {
+        timer_arm(&state->server->timers, &state->timer, (uint64_t) due * 1000);
     }
-}
\ No newline at end of file
+}
@@ -1,3 +1,8 @@
 #include "state.h"
 
-void dump_session(stateptr state);
+char *auth_result(int auth_int);
+
+int start_session(stateptr state);
+void index_event(stateptr state, int kind, const char *text);
+void stop_session(stateptr state);
+void service_session(stateptr state);
@@ -1,148 +1,225 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include <libssh/libssh.h>
-#include <libssh/server.h>
 
 #include "state.h"
 #include "args.h"
-#include "pcap.h"
-#include "session.h"
-
-int open_outbound_connection(struct state_struct *state);
-
-struct state_struct state = {
+#include "server.h"
+#include "capture.h"
+#include "keys.h"
+#include "metrics.h"
+#include "listener.h"
+#include "handoff.h"
+#include "upstream.h"
+#include "routes.h"
+#include "index.h"
+#include "log.h"
+
+struct config_struct config = {
     .log_level = SSH_LOG_NONE,
     .in_port = 9000,
+    .workers = 1,
     .out_host = "localhost",
     .out_port = 22,
-    .finished = 0
+    .connect_timeout = 30,
+    .drain_timeout = 600
 };
 
+static void signal_handler(int signum)
+{
+    if (signum == SIGHUP) {
+        keys_request_reload();
+        routes_request_reload();
+        return;
+    }
+
+    if (signum == SIGUSR1) {
+        server_request_stats();
+        return;
+    }
+
+    if (signum == SIGUSR2) {
+        server_drain();
+        return;
+    }
+
+    server_stop();
+}
+
 int main(int argc, char **argv){
     int result = 1;
-    ssh_bind sshbind = NULL;
-    int r;
+    struct server_struct *servers = NULL;
+    int inherited[LISTENER_MAX];
+    int inherited_count = 0;
+    int handoff_conn = -1;
+    int initialised = 0;
+    int started = 0;
+    int i;
+    struct sigaction action = {
+        .sa_handler = signal_handler
+    };
 
     do {
         // Parse command line arguments
-        if(!parse_args(argc, argv, &state)) {
+        if(!parse_args(argc, argv, &config)) {
             break;
         }
 
-        // Create new in_session
-        state.in_session = ssh_new();
-        if (state.in_session == NULL) {
-            fprintf(stderr, "Unable to create new session\n");
+        // Start the log writer
+        if (log_start() != 0) {
             break;
         }
 
-        // Start pcap capture on the in_session
-        set_pcap(&state);
-
-        // Create new bind
-        sshbind = ssh_bind_new();
-        if (sshbind == NULL) {
-            fprintf(stderr, "Unable to create new bind\n");
+        // Sessions are spread over these from the first connection
+        if (upstream_init(config.out_host, config.out_port, config.balance) != 0) {
             break;
         }
 
-        // Set bind options
-        if (state.dsa_key_file) {
-            ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_DSAKEY, state.dsa_key_file);
+        if (config.routes_file && (routes_load(config.routes_file, config.out_port) != 0 || routes_start() != 0)) {
+            break;
         }
-        if (state.rsa_key_file) {
-            ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_RSAKEY, state.rsa_key_file);
+
+        // Stop cleanly on interrupt, and don't die writing to a closed socket
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+        sigaction(SIGHUP, &action, NULL);
+        sigaction(SIGUSR1, &action, NULL);
+        sigaction(SIGUSR2, &action, NULL);
+        signal(SIGPIPE, SIG_IGN);
+
+        // Start the capture writer before any sessions want it, it does all capture and transcript file I/O
+        if ((config.pcap_file || config.transcript_file) &&
+            capture_start(config.pcap_file, (uint64_t) config.pcap_max_size * 1024 * 1024, config.pcap_max_age,
+                config.output_backend, config.compress_level) != 0) {
+            break;
         }
-        if (state.ecdsa_key_file) {
-            ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_ECDSAKEY, state.ecdsa_key_file);
+
+        // Rows are collected from every worker and written by the index's own thread
+        if (config.index_dir && index_start(config.index_dir) != 0) {
+            break;
         }
-        ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_BINDPORT, &state.in_port);
-        ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_LOG_VERBOSITY, &state.log_level);
 
-        // Start listening for incoming connection
-        if(ssh_bind_listen(sshbind) < 0){
-            fprintf(stderr, "Error listening to socket: %s\n", ssh_get_error(sshbind));
+        // Initialise libssh before any threads use it
+        ssh_init();
+
+        // Load the outbound auth keys once, rather than on every login
+        if (config.pub_key_file && config.priv_key_file &&
+            (keys_load(config.pub_key_file, config.priv_key_file) != 0 || keys_start() != 0)) {
             break;
         }
-        fprintf(stdout, "Listening on port %d\n", state.in_port);
 
-        // Accept a connection
-        r = ssh_bind_accept(sshbind, state.in_session);
-        if (r == SSH_ERROR) {
-            fprintf(stderr, "Error accepting a connection: %s\n", ssh_get_error(sshbind));
+        // Take over the listen sockets of a running sshdump, or ones from systemd, so no connection is refused
+        if (config.handoff_path) {
+            inherited_count = handoff_receive(config.handoff_path, inherited, LISTENER_MAX, &handoff_conn);
+            if (inherited_count < 0) {
+                break;
+            }
+        }
+        if (inherited_count == 0) {
+            inherited_count = handoff_systemd(inherited, LISTENER_MAX);
+        }
+        listener_adopt(inherited, inherited_count);
+
+        // Set up a listening server per worker
+        servers = calloc(config.workers, sizeof(struct server_struct));
+        if (servers == NULL) {
+            log_error("Unable to allocate workers");
             break;
         }
-        fprintf(stdout, "Accepted a connection\n");
 
-        // Open outbound session
-        if (open_outbound_connection(&state) != 0) {
+        for (initialised = 0; initialised < config.workers; initialised++) {
+            if (server_init(&servers[initialised], &config, initialised) != 0) {
+                break;
+            }
+        }
+        if (initialised < config.workers) {
+            // Clean up the partially initialised one too
+            ++initialised;
             break;
         }
 
-        // Do key exchange
-        fprintf(stdout, "Exchanging keys on inbound connection...\n");
+        // Keep checking the upstreams so a dead one stops getting sessions before anyone connects to it
+        if (upstream_start() != 0) {
+            break;
+        }
 
-        if (ssh_handle_key_exchange(state.in_session)) {
-            fprintf(stderr, "ssh_handle_key_exchange errored: %s\n", ssh_get_error(state.in_session));
+        // Workers have registered their counters, so the endpoint can sum them from here on
+        if (config.metrics_address && metrics_start(config.metrics_address) != 0) {
             break;
         }
 
-        fprintf(stdout, "Keys exchanged\n");
+        // Our replacement takes over from us from now on
+        if (config.handoff_path && server_handoff(&servers[0]) != 0) {
+            break;
+        }
 
-        // Dump the in_session
-        dump_session(&state);
+        // Up and listening, the process we took over from can drain now
+        handoff_ack(handoff_conn);
+        handoff_conn = -1;
+
+        if (config.workers == 1) {
+            // Accept and relay connections on this thread until stopped
+            server_run(&servers[0]);
+
+        } else {
+            // Start the workers and wait for them to stop
+            for (started = 0; started < config.workers; started++) {
+                if (server_start(&servers[started]) != 0) {
+                    server_stop();
+                    break;
+                }
+            }
+
+            for (i = 0; i < started; i++) {
+                server_wait(&servers[i]);
+            }
+
+            if (started < config.workers) {
+                break;
+            }
+        }
 
         result = 0;
     } while(0);
 
-    // Clean up
-    if (state.in_session) {
-        ssh_disconnect(state.in_session);
-        ssh_free(state.in_session);
-        state.in_session = NULL;
-    }
+    // Stop scraping before the counters go
+    metrics_stop();
 
-    if (state.out_session) {
-        ssh_disconnect(state.out_session);
-        ssh_free(state.out_session);
-        state.out_session = NULL;
-    }
+    upstream_stop();
 
-    if (sshbind) {
-        ssh_bind_free(sshbind);
+    // Workers have their own copies. Without an ack, the old process carries on
+    for (i = 0; i < inherited_count; i++) {
+        close(inherited[i]);
+    }
+    listener_adopt(NULL, 0);
+    if (handoff_conn >= 0) {
+        close(handoff_conn);
     }
 
-    cleanup_pcap(&state);
-    
-    ssh_finalize();
-
-    return result;
-}
+    // Clean up
+    for (i = 0; i < initialised; i++) {
+        server_cleanup(&servers[i]);
+    }
+    free(servers);
 
-int open_outbound_connection(struct state_struct *state)
-{
-    int rc;
+    // Sessions are gone, write out the last of their rows
+    index_stop();
 
-    state->out_session = ssh_new();
-    if (state->out_session == NULL) {
-        fprintf(stderr, "Unable to create new session\n");
-        return -1;
-    }
+    // Every session has closed its capture pipes, let the writer finish the files
+    capture_stop();
 
-    ssh_options_set(state->out_session, SSH_OPTIONS_LOG_VERBOSITY, &state->log_level);
-    ssh_options_set(state->out_session, SSH_OPTIONS_HOST, state->out_host);
-    ssh_options_set(state->out_session, SSH_OPTIONS_PORT, &state->out_port);
+    keys_stop();
+    keys_cleanup();
 
-    // Connect to server
-    fprintf(stdout, "Connecting to %s:%d\n", state->out_host, state->out_port);
+    routes_stop();
+    routes_cleanup();
 
-    rc = ssh_connect(state->out_session);
-    if (rc != SSH_OK) {
-        fprintf(stderr, "Error making outbound connection: %s\n", ssh_get_error(state->out_session));
-        return -1;
-    }
+    ssh_finalize();
 
-    fprintf(stdout, "Connected to %s:%d\n", state->out_host, state->out_port);
+    log_stop();
 
-    return 0;
+    return result;
 }
@@ -1,26 +1,40 @@
 #include <libssh/libssh.h>
+#include <libssh/callbacks.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "forward.h"
+#include "transcript.h"
+#include "pool.h"
+#include "timer.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "upstream.h"
+#include "routes.h"
+#include "listener.h"
 
 #ifndef STATE_H
 #define STATE_H
 
-struct state_struct {
-    int finished;
-    
+struct config_struct {
     int log_level;
 
     int in_port;
+    int workers;            // Number of event loop threads
 
-    char *out_host;
-    int out_port;
+    char *out_host;         // Comma separated upstreams, see upstream.h
+    int out_port;           // For upstreams that don't give one
+    int balance;            // How sessions are spread over them
+    char *routes_file;      // Upstreams by login, see routes.h. Connects wait for the username when set
+    int connect_timeout;    // Seconds allowed for the upstream connect and both key exchanges
+    int pool_size;          // Warm upstream connections to keep per worker
 
-    char *pcap_file;
-    ssh_pcap_file pcap;
-
-    ssh_event event;
-    ssh_session in_session;
-    ssh_session out_session;
-    ssh_channel in_channel;
-    ssh_channel out_channel;
+    char *pcap_file;        // Capture file name template, see capture.h
+    int pcap_max_size;      // Megabytes per capture file before rotating, 0 for no limit
+    int pcap_max_age;       // Seconds per capture file before rotating, 0 for no limit
+    char *transcript_file;
+    int output_backend;     // How the capture thread writes files, see output.h
+    int compress_level;     // zstd level for capture files, 0 for none
 
     char *rsa_key_file;     // Private RSA key used for inbound connections
     char *dsa_key_file;     // Private DSA key used for inbound connections
@@ -28,6 +42,104 @@ struct state_struct {
 
     char *pub_key_file;     // Public key file used for outbound authentication
     char *priv_key_file;    // Private key file used for outbound authentication
+
+    char *metrics_address;  // Loopback port or Unix socket path for the metrics endpoint
+
+    char *handoff_path;     // Unix socket listen sockets are handed over on, see handoff.h
+    int drain_timeout;      // Seconds sessions are given to end once we stop accepting
+
+    char *index_dir;        // Directory logins and commands are indexed in, see index.h
+};
+typedef struct config_struct *configptr;
+
+struct state_struct;
+struct channel_struct;
+
+struct server_struct {
+    configptr config;
+
+    int worker;             // Worker number, also the CPU the thread is pinned to
+    pthread_t thread;
+
+    int listen_fds[LISTENER_MAX];   // SO_REUSEPORT sockets owned by this worker, several if more were taken over
+    int listen_count;
+    ssh_bind bind;
+    ssh_event event;
+
+    struct pool_struct pool;
+    struct timer_struct pool_timer;     // Wakes the loop when a pooled connection needs attention
+
+    int wake_fd;            // eventfd for waking the loop from signal handlers and other threads
+    struct timer_heap timers;
+
+    struct histogram latency[2];    // Per direction, from every session that has ended on this worker
+    int stats_seen;                 // Last SIGUSR1 this worker dumped for
+
+    struct metrics_struct metrics;  // Only this worker writes to it, see metrics.h
+
+    int accept_pending;     // Set by the listen socket callback, handled after the poll returns
+
+    int handoff_fd;         // Handoff socket, only on worker 0
+    int handoff_conn;       // Replacement we've sent our listen sockets to, waiting for its ack
+    int handoff_pending;    // Set by the handoff callbacks, handled after the poll returns
+
+    int draining;           // Stopped accepting, exits once the sessions are gone
+    int drain_expired;
+    struct timer_struct drain_timer;
+
+    int session_count;      // Number of sessions in the list below
+    struct state_struct *sessions;
+};
+typedef struct server_struct *serverptr;
+
+// A tcpip-forward or cancel for the upstream, which only has one global request outstanding at a time
+struct forward_request {
+    struct forward_request *next;
+    int cancel;
+    int port;
+    char *address;
+};
+
+struct state_struct {
+    struct state_struct *next;
+
+    serverptr server;
+    configptr config;
+
+    int id;
+    int finished;
+
+    int handshake;          // Still connecting and exchanging keys
+    int in_ready;           // Inbound key exchange complete
+    int out_ready;          // Outbound connection and key exchange complete
+    upstreamptr upstream;
+    routesptr routes;                   // Held while upstream points into it
+    ssh_message auth_message;           // First auth request, answered once the routed upstream is ready
+    char *login;                        // Username the upstream was routed on
+    char *out_user;                     // Username sent upstream, login less any @target
+    uint64_t connect_started;           // ns, for the upstream's latency average
+    char source[64];                    // Client address, for the index
+    char *user;                         // Login once authenticated, for the index
+    struct timer_struct timer;          // Handshake deadline, then the transcript flush
+
+    ssh_pcap_file in_pcap;
+    ssh_pcap_file out_pcap;
+    transcriptptr transcript;
+    struct histogram latency[2];    // Per direction, indexed by TRANSCRIPT_IN and TRANSCRIPT_OUT
+
+    ssh_session in_session;
+    ssh_session out_session;
+    struct forward_request *forwards;   // Waiting for, or sent to, the upstream in order
+
+    // Channel pairs indexed by id, NULL for free slots, see channel.h
+    struct channel_struct **channels;
+    uint32_t channel_size;
+    uint32_t channel_count;
+
+    // Callback structures must outlive the sessions they are set on
+    struct ssh_server_callbacks_struct server_callbacks;
+    struct ssh_callbacks_struct in_callbacks;
+    struct ssh_callbacks_struct out_callbacks;
 };
 typedef struct state_struct *stateptr;
 
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+
+#include "timer.h"
+#include "log.h"
+
+uint64_t timer_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void place(struct timer_heap *heap, int i, timerptr timer)
+{
+    heap->timers[i] = timer;
+    timer->index = i;
+}
+
+static void sift_up(struct timer_heap *heap, int i)
+{
+    timerptr timer = heap->timers[i];
+    int parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (heap->timers[parent]->due <= timer->due) break;
+
+        place(heap, i, heap->timers[parent]);
+        i = parent;
+    }
+
+    place(heap, i, timer);
+}
+
+static void sift_down(struct timer_heap *heap, int i)
+{
+    timerptr timer = heap->timers[i];
+    int child;
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= heap->count) break;
+
+        if (child + 1 < heap->count && heap->timers[child + 1]->due < heap->timers[child]->due) ++child;
+        if (timer->due <= heap->timers[child]->due) break;
+
+        place(heap, i, heap->timers[child]);
+        i = child;
+    }
+
+    place(heap, i, timer);
+}
+
+void timer_init(timerptr timer, timer_fn fn, void *arg)
+{
+    timer->due = 0;
+    timer->index = -1;
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+int timer_arm(struct timer_heap *heap, timerptr timer, uint64_t due)
+{
+    timerptr *grown;
+    int size;
+
+    // Already armed, just move it
+    if (timer->index >= 0) {
+        timer->due = due;
+        sift_up(heap, timer->index);
+        sift_down(heap, timer->index);
+        return 0;
+    }
+
+    if (heap->count == heap->size) {
+        size = heap->size ? heap->size * 2 : 16;
+
+        grown = realloc(heap->timers, size * sizeof(timerptr));
+        if (grown == NULL) {
+            log_error("Unable to grow timer heap");
+            return -1;
+        }
+
+        heap->timers = grown;
+        heap->size = size;
+    }
+
+    timer->due = due;
+    place(heap, heap->count++, timer);
+    sift_up(heap, timer->index);
+
+    return 0;
+}
+
+void timer_cancel(struct timer_heap *heap, timerptr timer)
+{
+    timerptr last;
+    int i = timer->index;
+
+    if (i < 0) return;
+
+    timer->index = -1;
+
+    // Fill the hole with the last timer and let it find its place
+    if (--heap->count > i) {
+        last = heap->timers[heap->count];
+        place(heap, i, last);
+        sift_up(heap, i);
+        sift_down(heap, last->index);
+    }
+}
+
+int timer_armed(timerptr timer)
+{
+    return timer->index >= 0;
+}
+
+int timer_timeout(struct timer_heap *heap)
+{
+    uint64_t now;
+
+    if (heap->count == 0) return -1;
+
+    now = timer_now();
+    if (heap->timers[0]->due <= now) return 0;
+
+    if (heap->timers[0]->due - now >= INT_MAX) return INT_MAX;
+
+    // Round up so the loop doesn't wake a millisecond early and spin
+    return (int) (heap->timers[0]->due - now + 1);
+}
+
+void timer_run(struct timer_heap *heap)
+{
+    uint64_t now = timer_now();
+    timerptr timer;
+
+    // Callbacks may arm or cancel timers, including the one running
+    while (heap->count > 0 && heap->timers[0]->due <= now) {
+        timer = heap->timers[0];
+        timer_cancel(heap, timer);
+
+        if (timer->fn) timer->fn(timer, timer->arg);
+    }
+}
+
+void timer_cleanup(struct timer_heap *heap)
+{
+    int i;
+
+    for (i = 0; i < heap->count; i++) {
+        heap->timers[i]->index = -1;
+    }
+
+    free(heap->timers);
+    heap->timers = NULL;
+    heap->count = 0;
+    heap->size = 0;
+}
@@ -0,0 +1,38 @@
+#include <stdint.h>
+
+#ifndef TIMER_H
+#define TIMER_H
+
+/*
+ * Deadlines for an event loop, kept in a binary min-heap so the loop can
+ * sleep until the earliest one rather than waking on a fixed interval. Timers
+ * are embedded in whatever owns them and never allocated by the heap itself.
+ */
+
+struct timer_struct;
+typedef void (*timer_fn)(struct timer_struct *timer, void *arg);
+
+struct timer_struct {
+    uint64_t due;           // Monotonic milliseconds
+    int index;              // Position in the heap, -1 when not armed
+    timer_fn fn;            // NULL for timers that only need the loop to wake
+    void *arg;
+};
+typedef struct timer_struct *timerptr;
+
+struct timer_heap {
+    timerptr *timers;
+    int count;
+    int size;
+};
+
+uint64_t timer_now(void);
+void timer_init(timerptr timer, timer_fn fn, void *arg);
+int timer_arm(struct timer_heap *heap, timerptr timer, uint64_t due);
+void timer_cancel(struct timer_heap *heap, timerptr timer);
+int timer_armed(timerptr timer);
+int timer_timeout(struct timer_heap *heap);
+void timer_run(struct timer_heap *heap);
+void timer_cleanup(struct timer_heap *heap);
+
+#endif
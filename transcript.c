@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "transcript.h"
+#include "capture.h"
+#include "log.h"
+
+// Largest payload that fits in one record
+#define MAX_PAYLOAD (CAPTURE_BLOCK_SIZE - sizeof(struct transcript_record))
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static time_t monotonic_seconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec;
+}
+
+static void flush(transcriptptr transcript)
+{
+    struct capture_block *block = transcript->block;
+
+    if (block == NULL) return;
+
+    // The capture thread owns it from here
+    block->fd = transcript->fd;
+    block->offset = transcript->offset;
+    transcript->offset += block->len;
+    transcript->block = NULL;
+
+    capture_block_write(block);
+}
+
+static void append(transcriptptr transcript, const void *header, size_t header_len, const void *data, size_t len)
+{
+    struct capture_block *block = transcript->block;
+
+    // Records never span blocks, so dropping one never leaves half a record behind
+    if (block && block->len + header_len + len > CAPTURE_BLOCK_SIZE) {
+        flush(transcript);
+        block = NULL;
+    }
+
+    if (block == NULL) {
+        block = capture_block_new();
+        if (block == NULL) {
+            ++transcript->dropped;
+            return;
+        }
+
+        transcript->block = block;
+        transcript->oldest = monotonic_seconds();
+    }
+
+    memcpy(block->data + block->len, header, header_len);
+    block->len += header_len;
+
+    if (len > 0) {
+        memcpy(block->data + block->len, data, len);
+        block->len += len;
+    }
+}
+
+transcriptptr transcript_open(const char *file_name, int session_id)
+{
+    transcriptptr transcript;
+    struct transcript_header header;
+    off_t end;
+
+    transcript = calloc(1, sizeof(struct transcript_struct));
+    if (transcript == NULL) {
+        log_error("Unable to allocate transcript");
+        return NULL;
+    }
+
+    transcript->session_id = session_id;
+
+    transcript->fd = open(file_name, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (transcript->fd < 0) {
+        log_error("Error opening transcript file %s: %s", file_name, strerror(errno));
+        free(transcript);
+        return NULL;
+    }
+
+    // Blocks are written at explicit offsets, possibly out of order, so no O_APPEND
+    end = lseek(transcript->fd, 0, SEEK_END);
+    transcript->offset = end < 0 ? 0 : end;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRANSCRIPT_MAGIC, sizeof(header.magic));
+    header.version = TRANSCRIPT_VERSION;
+    header.session_id = session_id;
+    header.start_time = now_ns();
+
+    append(transcript, &header, sizeof(header), NULL, 0);
+
+    return transcript;
+}
+
+void transcript_write(transcriptptr transcript, int direction, int type, uint32_t channel, const void *data,
+    uint32_t len)
+{
+    struct transcript_record record;
+    uint32_t chunk;
+
+    if (transcript == NULL) return;
+
+    memset(&record, 0, sizeof(record));
+    record.timestamp = now_ns();
+    record.channel = channel;
+    record.type = type;
+    record.direction = direction;
+
+    do {
+        chunk = len > MAX_PAYLOAD ? MAX_PAYLOAD : len;
+        record.len = chunk;
+
+        append(transcript, &record, sizeof(record), data, chunk);
+
+        data = (const char *) data + chunk;
+        len -= chunk;
+    } while (len > 0);
+}
+
+void transcript_text(transcriptptr transcript, int direction, int type, uint32_t channel, const char *name,
+    const char *format, ...)
+{
+    char payload[1024];
+    size_t name_len;
+    int len;
+    va_list args;
+
+    if (transcript == NULL) return;
+
+    // Name, NUL, then the formatted arguments
+    name_len = strnlen(name, sizeof(payload) - 2);
+    memcpy(payload, name, name_len);
+    payload[name_len] = '\x0';
+
+    va_start(args, format);
+    len = vsnprintf(payload + name_len + 1, sizeof(payload) - name_len - 1, format, args);
+    va_end(args);
+
+    if (len < 0) len = 0;
+    if ((size_t) len >= sizeof(payload) - name_len - 1) len = sizeof(payload) - name_len - 2;
+
+    transcript_write(transcript, direction, type, channel, payload, name_len + 1 + len);
+}
+
+void transcript_service(transcriptptr transcript)
+{
+    if (transcript == NULL) return;
+
+    // Don't let quiet sessions sit on their records
+    if (transcript->block && monotonic_seconds() >= transcript->oldest + TRANSCRIPT_FLUSH_SECS) {
+        flush(transcript);
+    }
+}
+
+time_t transcript_due(transcriptptr transcript)
+{
+    // When transcript_service next has something to do, 0 for nothing
+    if (transcript == NULL || transcript->block == NULL) return 0;
+
+    return transcript->oldest + TRANSCRIPT_FLUSH_SECS;
+}
+
+void transcript_close(transcriptptr transcript)
+{
+    if (transcript == NULL) return;
+
+    flush(transcript);
+    capture_close(transcript->fd);
+
+    if (transcript->dropped) {
+        log_warn("[%d] Transcript lost %llu records, the capture thread fell behind", transcript->session_id,
+            (unsigned long long) transcript->dropped);
+    }
+
+    free(transcript);
+}
@@ -0,0 +1,81 @@
+#include <stdint.h>
+#include <time.h>
+
+#include "capture.h"
+
+#ifndef TRANSCRIPT_H
+#define TRANSCRIPT_H
+
+/*
+ * Transcript file layout, all fields in host byte order:
+ *
+ *   struct transcript_header
+ *   struct transcript_record + payload
+ *   struct transcript_record + payload
+ *   ...
+ *
+ * DATA and STDERR payloads are the raw channel bytes, split over several records
+ * if they don't fit in a capture block. All other payloads are a name (request
+ * name, signal name...), a NUL, then any arguments as text.
+ */
+
+#define TRANSCRIPT_MAGIC "SSHDTRN1"
+#define TRANSCRIPT_VERSION 1
+
+#define TRANSCRIPT_FLUSH_SECS 1         // Longest time a record sits in the buffer
+
+// Record directions
+#define TRANSCRIPT_IN  0                // Client to server
+#define TRANSCRIPT_OUT 1                // Server to client
+
+// Record types
+#define TRANSCRIPT_DATA        1
+#define TRANSCRIPT_STDERR      2
+#define TRANSCRIPT_EOF         3
+#define TRANSCRIPT_CLOSE       4
+#define TRANSCRIPT_REQUEST     5
+#define TRANSCRIPT_SIGNAL      6
+#define TRANSCRIPT_EXIT_STATUS 7
+#define TRANSCRIPT_EXIT_SIGNAL 8
+#define TRANSCRIPT_OPEN        9        // Payload is the channel type, then where it goes
+
+#define TRANSCRIPT_NO_CHANNEL 0xffffffff    // Channel for connection-wide records such as global requests
+
+struct transcript_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t session_id;
+    uint64_t start_time;        // Nanoseconds since the epoch
+};
+
+struct transcript_record {
+    uint64_t timestamp;         // Nanoseconds since the epoch
+    uint32_t channel;
+    uint32_t len;               // Payload bytes following the record
+    uint8_t type;
+    uint8_t direction;
+    uint16_t reserved;
+    uint32_t reserved2;
+};
+
+// Records are collected in a capture block, the capture thread writes it out
+struct transcript_struct {
+    int fd;
+    int session_id;
+    uint64_t offset;            // File offset of the block being filled
+    uint64_t dropped;           // Records lost because the capture thread was behind
+    time_t oldest;              // When the oldest buffered record was added
+    struct capture_block *block;
+};
+typedef struct transcript_struct *transcriptptr;
+
+transcriptptr transcript_open(const char *file_name, int session_id);
+void transcript_write(transcriptptr transcript, int direction, int type, uint32_t channel, const void *data,
+    uint32_t len);
+void transcript_text(transcriptptr transcript, int direction, int type, uint32_t channel, const char *name,
+    const char *format, ...) __attribute__((format(printf, 6, 7)));
+void transcript_service(transcriptptr transcript);
+time_t transcript_due(transcriptptr transcript);
+void transcript_close(transcriptptr transcript);
+
+#endif
@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "upstream.h"
+#include "log.h"
+
+static struct upstream_struct upstreams[UPSTREAM_MAX];
+static int count = 0;
+static int policy = UPSTREAM_ROUND_ROBIN;
+static unsigned next_pick = 0;
+
+static int stop_fd = -1;
+static pthread_t probe_thread;
+static int probe_started = 0;
+
+static const char *policy_names[] = { "round-robin", "least-sessions", "latency" };
+
+int upstream_policy(const char *name)
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof(policy_names) / sizeof(policy_names[0])); i++) {
+        if (strcmp(name, policy_names[i]) == 0) return i;
+    }
+
+    return -1;
+}
+
+const char *upstream_policy_name(int which)
+{
+    return policy_names[which];
+}
+
+int upstream_parse(upstreamptr upstream, const char *entry, size_t len, int default_port)
+{
+    const char *host = entry;
+    const char *colon = NULL;
+    size_t host_len = len;
+    char *end;
+    long port = default_port;
+
+    // host, host:port, [v6], [v6]:port
+    if (len > 0 && entry[0] == '[') {
+        colon = memchr(entry, ']', len);
+        if (colon == NULL) {
+            log_error("Unterminated [ in upstream %.*s", (int) len, entry);
+            return -1;
+        }
+        host = entry + 1;
+        host_len = colon - host;
+        colon = (colon + 1 < entry + len && colon[1] == ':') ? colon + 1 : NULL;
+    } else {
+        colon = memchr(entry, ':', len);
+        if (colon && memchr(colon + 1, ':', entry + len - colon - 1)) colon = NULL;
+        if (colon) host_len = colon - entry;
+    }
+
+    if (colon) {
+        port = strtol(colon + 1, &end, 10);
+        if (end != entry + len || port < 1 || port > 65535) {
+            log_error("Invalid port in upstream %.*s", (int) len, entry);
+            return -1;
+        }
+    }
+
+    if (host_len == 0 || host_len >= UPSTREAM_HOST_SIZE) {
+        log_error("Invalid host in upstream %.*s", (int) len, entry);
+        return -1;
+    }
+
+    memset(upstream, 0, sizeof(*upstream));
+    memcpy(upstream->host, host, host_len);
+    upstream->port = port;
+    upstream->healthy = 1;
+
+    return 0;
+}
+
+static int add_upstream(const char *entry, size_t len, int default_port)
+{
+    if (count == UPSTREAM_MAX) {
+        log_error("Too many upstream hosts, at most %d", UPSTREAM_MAX);
+        return -1;
+    }
+
+    if (upstream_parse(&upstreams[count], entry, len, default_port) != 0) return -1;
+    ++count;
+
+    return 0;
+}
+
+int upstream_init(const char *list, int default_port, int which)
+{
+    const char *entry = list;
+    const char *comma;
+    size_t len;
+
+    count = 0;
+    policy = which;
+
+    while (*entry) {
+        comma = strchr(entry, ',');
+        len = comma ? (size_t) (comma - entry) : strlen(entry);
+
+        if (len > 0 && add_upstream(entry, len, default_port) != 0) return -1;
+
+        entry += len;
+        if (*entry == ',') ++entry;
+    }
+
+    if (count == 0) {
+        log_error("No upstream hosts in '%s'", list);
+        return -1;
+    }
+
+    if (count > 1) {
+        log_info("Spreading sessions over %d upstreams by %s", count, policy_names[policy]);
+    }
+
+    return 0;
+}
+
+int upstream_count(void)
+{
+    return count;
+}
+
+upstreamptr upstream_get(int index)
+{
+    return &upstreams[index];
+}
+
+upstreamptr upstream_pick(void)
+{
+    upstreamptr upstream, best = NULL;
+    uint64_t cost, best_cost = 0;
+    unsigned start;
+    int i, healthy_only;
+
+    // A rotating start is the whole of round robin, and spreads ties for the others
+    start = __atomic_fetch_add(&next_pick, 1, __ATOMIC_RELAXED);
+
+    for (healthy_only = 1; healthy_only >= 0 && best == NULL; healthy_only--) {
+        for (i = 0; i < count; i++) {
+            upstream = &upstreams[(start + i) % count];
+
+            if (healthy_only && !__atomic_load_n(&upstream->healthy, __ATOMIC_RELAXED)) continue;
+
+            if (policy == UPSTREAM_ROUND_ROBIN) {
+                best = upstream;
+                break;
+            }
+
+            cost = __atomic_load_n(&upstream->active, __ATOMIC_RELAXED) + 1;
+            if (policy == UPSTREAM_LATENCY) {
+                // Unmeasured backends look fast so they get tried
+                cost *= __atomic_load_n(&upstream->latency_us, __ATOMIC_RELAXED) + 1;
+            }
+
+            if (best == NULL || cost < best_cost) {
+                best = upstream;
+                best_cost = cost;
+            }
+        }
+    }
+
+    upstream_use(best);
+
+    return best;
+}
+
+void upstream_use(upstreamptr upstream)
+{
+    __atomic_add_fetch(&upstream->active, 1, __ATOMIC_RELAXED);
+}
+
+void upstream_release(upstreamptr upstream)
+{
+    __atomic_sub_fetch(&upstream->active, 1, __ATOMIC_RELAXED);
+}
+
+static void mark_up(upstreamptr upstream)
+{
+    __atomic_store_n(&upstream->failures, 0, __ATOMIC_RELAXED);
+
+    if (!__atomic_exchange_n(&upstream->healthy, 1, __ATOMIC_RELAXED)) {
+        log_info("Upstream %s:%d is back, reinstating it", upstream->host, upstream->port);
+    }
+}
+
+void upstream_connected(upstreamptr upstream, uint64_t latency_us)
+{
+    uint64_t average = __atomic_load_n(&upstream->latency_us, __ATOMIC_RELAXED);
+
+    // Racing workers may lose a sample, which an average can live with
+    if (average == 0) {
+        average = latency_us;
+    } else {
+        average = average - (average >> UPSTREAM_EWMA_SHIFT) + (latency_us >> UPSTREAM_EWMA_SHIFT);
+    }
+    __atomic_store_n(&upstream->latency_us, average, __ATOMIC_RELAXED);
+
+    mark_up(upstream);
+}
+
+void upstream_failed(upstreamptr upstream)
+{
+    int expected = 1;
+
+    if (__atomic_add_fetch(&upstream->failures, 1, __ATOMIC_RELAXED) < UPSTREAM_EJECT_FAILURES) return;
+
+    if (__atomic_compare_exchange_n(&upstream->healthy, &expected, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        log_warn("Upstream %s:%d failed %d times in a row, ejecting it", upstream->host, upstream->port,
+            UPSTREAM_EJECT_FAILURES);
+    }
+}
+
+// 1 once fd is ready, 0 on timeout or when stopping
+static int wait_for(int fd, short events)
+{
+    struct pollfd fds[2];
+    int rc;
+
+    fds[0].fd = fd;
+    fds[0].events = events;
+    fds[1].fd = stop_fd;
+    fds[1].events = POLLIN;
+
+    do {
+        rc = poll(fds, 2, UPSTREAM_PROBE_TIMEOUT_SECS * 1000);
+    } while (rc < 0 && errno == EINTR);
+
+    return rc > 0 && !fds[1].revents && fds[0].revents;
+}
+
+static int probe(upstreamptr upstream)
+{
+    struct addrinfo hints, *addresses, *address;
+    char port[16], banner[4];
+    socklen_t len;
+    int fd, error, ok = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", upstream->port);
+
+    if (getaddrinfo(upstream->host, port, &hints, &addresses) != 0) return 0;
+
+    // Up means it answers with an SSH banner, not just that the port is open
+    for (address = addresses; address && !ok; address = address->ai_next) {
+        fd = socket(address->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) continue;
+
+        error = 0;
+        len = sizeof(error);
+
+        if ((connect(fd, address->ai_addr, address->ai_addrlen) == 0 || errno == EINPROGRESS) &&
+                wait_for(fd, POLLOUT) && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0 &&
+                wait_for(fd, POLLIN) && recv(fd, banner, sizeof(banner), 0) == sizeof(banner) &&
+                memcmp(banner, "SSH-", sizeof(banner)) == 0) {
+            ok = 1;
+        }
+
+        close(fd);
+    }
+
+    freeaddrinfo(addresses);
+
+    return ok;
+}
+
+static void *probe_main(void *arg)
+{
+    struct pollfd stop;
+    int i, rc;
+
+    (void)arg;
+
+    stop.fd = stop_fd;
+    stop.events = POLLIN;
+
+    for (;;) {
+        for (i = 0; i < count; i++) {
+            if (probe(&upstreams[i])) {
+                mark_up(&upstreams[i]);
+            } else {
+                upstream_failed(&upstreams[i]);
+            }
+        }
+
+        rc = poll(&stop, 1, UPSTREAM_PROBE_SECS * 1000);
+        if (rc > 0 || (rc < 0 && errno != EINTR)) break;
+    }
+
+    return NULL;
+}
+
+int upstream_start(void)
+{
+    int rc;
+
+    // Nothing to choose between with one
+    if (count < 2) return 0;
+
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (stop_fd < 0) {
+        log_error("Unable to create upstream probe eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    rc = pthread_create(&probe_thread, NULL, probe_main, NULL);
+    if (rc != 0) {
+        log_error("Unable to start upstream probe thread: %s", strerror(rc));
+        close(stop_fd);
+        stop_fd = -1;
+        return -1;
+    }
+
+    probe_started = 1;
+
+    return 0;
+}
+
+void upstream_stop(void)
+{
+    uint64_t value = 1;
+
+    if (probe_started) {
+        if (write(stop_fd, &value, sizeof(value)) < 0) {
+            log_error("Unable to stop upstream probe thread: %s", strerror(errno));
+        }
+        pthread_join(probe_thread, NULL);
+        probe_started = 0;
+    }
+
+    if (stop_fd >= 0) close(stop_fd);
+    stop_fd = -1;
+}
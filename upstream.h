@@ -0,0 +1,53 @@
+#include <stdint.h>
+
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+/*
+ * The upstream servers sessions are spread across, given as a comma
+ * separated list to --host. Shared by every worker, so the counters are only
+ * touched with atomics. A backend is ejected after UPSTREAM_EJECT_FAILURES
+ * failed connects or probes in a row, and reinstated by the first that
+ * succeeds. The probe thread connects to each backend every
+ * UPSTREAM_PROBE_SECS and waits for its SSH banner. With every backend
+ * ejected, sessions go to all of them rather than none.
+ */
+
+#define UPSTREAM_MAX 64
+#define UPSTREAM_HOST_SIZE 256
+
+#define UPSTREAM_ROUND_ROBIN    0
+#define UPSTREAM_LEAST_SESSIONS 1
+#define UPSTREAM_LATENCY        2       // Lowest connect and key exchange EWMA, scaled by active sessions
+
+#define UPSTREAM_EJECT_FAILURES 3
+#define UPSTREAM_PROBE_SECS 5
+#define UPSTREAM_PROBE_TIMEOUT_SECS 3
+#define UPSTREAM_EWMA_SHIFT 3           // Each sample counts for 1/8
+
+struct upstream_struct {
+    char host[UPSTREAM_HOST_SIZE];
+    int port;
+
+    int healthy;
+    int failures;                       // In a row
+    int active;                         // Sessions using it now
+    uint64_t latency_us;                // EWMA of connect plus key exchange, 0 until measured
+};
+typedef struct upstream_struct *upstreamptr;
+
+int upstream_policy(const char *name);
+const char *upstream_policy_name(int policy);
+int upstream_parse(upstreamptr upstream, const char *entry, size_t len, int default_port);
+int upstream_init(const char *list, int default_port, int policy);
+int upstream_count(void);
+upstreamptr upstream_get(int index);
+upstreamptr upstream_pick(void);
+void upstream_use(upstreamptr upstream);
+void upstream_release(upstreamptr upstream);
+void upstream_connected(upstreamptr upstream, uint64_t latency_us);
+void upstream_failed(upstreamptr upstream);
+int upstream_start(void);
+void upstream_stop(void);
+
+#endif